@@ -28,6 +28,7 @@ LOCAL_SRC_FILES := \
     core/selinux.cpp \
     core/module.cpp \
     core/thread.cpp \
+    core/metrics.cpp \
     core/core-rs.cpp \
     core/resetprop/resetprop.cpp \
     core/su/su.cpp \
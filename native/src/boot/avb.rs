@@ -0,0 +1,300 @@
+use byteorder::{BigEndian, ByteOrder};
+use digest::DynDigest;
+use rsa::pkcs1::DecodeRsaPrivateKey;
+use rsa::pkcs8::DecodePrivateKey;
+use rsa::traits::PublicKeyParts;
+use rsa::{BigUint, Pkcs1v15Sign, RsaPrivateKey};
+use sha1::Sha1;
+use sha2::{Sha256, Sha512};
+
+use base::libc::c_char;
+use base::{log_err, LoggedResult, MappedFile, StrErr, Utf8CStr};
+
+// https://android.googlesource.com/platform/external/avb/+/refs/heads/android11-release/libavb/avb_vbmeta_image.h
+const VBMETA_HEADER_SIZE: usize = 256;
+// https://android.googlesource.com/platform/external/avb/+/refs/heads/android11-release/libavb/avb_hash_descriptor.h
+const HASH_DESCRIPTOR_SIZE: usize = 132;
+const DESCRIPTOR_TAG_HASH: u64 = 2;
+
+// Offsets of the fields in AvbVBMetaImageHeader
+const AUTH_BLOCK_SIZE: usize = 12;
+const AUX_BLOCK_SIZE: usize = 20;
+const ALGORITHM_TYPE: usize = 28;
+const HASH_OFFSET: usize = 32;
+const HASH_SIZE: usize = 40;
+const SIGNATURE_OFFSET: usize = 48;
+const SIGNATURE_SIZE: usize = 56;
+const PUBLIC_KEY_OFFSET: usize = 64;
+const PUBLIC_KEY_SIZE: usize = 72;
+const PUBLIC_KEY_METADATA_OFFSET: usize = 80;
+const PUBLIC_KEY_METADATA_SIZE: usize = 88;
+const DESCRIPTORS_OFFSET: usize = 96;
+const DESCRIPTORS_SIZE: usize = 104;
+
+fn get_u64(buf: &[u8], off: usize) -> usize {
+    BigEndian::read_u64(&buf[off..]) as usize
+}
+
+fn put_u64(buf: &mut [u8], off: usize, v: usize) {
+    BigEndian::write_u64(&mut buf[off..], v as u64)
+}
+
+#[inline(always)]
+fn align_64(x: usize) -> usize {
+    (x + 63) & !63
+}
+
+// Algorithm types are SHA256_RSA{2048,4096,8192} (1-3) and SHA512_RSA{2048,4096,8192} (4-6)
+fn algorithm_digest(algorithm: u32) -> LoggedResult<Box<dyn DynDigest>> {
+    match algorithm {
+        1..=3 => Ok(Box::<Sha256>::default()),
+        4..=6 => Ok(Box::<Sha512>::default()),
+        _ => Err(log_err!("Unsupported vbmeta algorithm type {}", algorithm)),
+    }
+}
+
+fn load_key(path: &Utf8CStr) -> LoggedResult<RsaPrivateKey> {
+    let key = MappedFile::open(path)?;
+    let key = key.as_ref();
+    if let Ok(pem) = std::str::from_utf8(key) {
+        if let Ok(key) = RsaPrivateKey::from_pkcs8_pem(pem) {
+            return Ok(key);
+        }
+        if let Ok(key) = RsaPrivateKey::from_pkcs1_pem(pem) {
+            return Ok(key);
+        }
+    }
+    RsaPrivateKey::from_pkcs8_der(key).map_err(|_| log_err!("Unsupported AVB key"))
+}
+
+// AvbRSAPublicKeyHeader followed by the modulus n and rr = (2^bits)^2 mod n,
+// with n0inv = -1 / n[0] mod 2^32 as used by libavb's Montgomery arithmetic
+fn encode_public_key(key: &RsaPrivateKey) -> Vec<u8> {
+    let len = key.size();
+    let n = key.n();
+    let n_bytes = n.to_bytes_le();
+    let mut n0 = [0_u8; 4];
+    n0[..n_bytes.len().min(4)].copy_from_slice(&n_bytes[..n_bytes.len().min(4)]);
+    let n0 = u32::from_le_bytes(n0);
+    // Newton iteration doubles the correct low bits of the inverse each round
+    let mut inv = n0;
+    for _ in 0..5 {
+        inv = inv.wrapping_mul(2_u32.wrapping_sub(n0.wrapping_mul(inv)));
+    }
+    let rr = (BigUint::from(1_u32) << (len * 8 * 2)) % n;
+
+    let mut out = Vec::with_capacity(8 + len * 2);
+    out.extend_from_slice(&((len * 8) as u32).to_be_bytes());
+    out.extend_from_slice(&inv.wrapping_neg().to_be_bytes());
+    for v in [n, &rr] {
+        let bytes = v.to_bytes_be();
+        out.resize(out.len() + len - bytes.len(), 0);
+        out.extend_from_slice(&bytes);
+    }
+    out
+}
+
+// The hash descriptor of an AVB 2.0 hash footer image, fed with the image
+struct HashDescriptor {
+    // Offsets of the image size and digest fields within the vbmeta
+    image_size: usize,
+    digest: usize,
+    hasher: Box<dyn DynDigest>,
+}
+
+// Regenerates the vbmeta image of an AVB 2.0 hash footer. The hash descriptor
+// is updated with the new image, and the vbmeta is re-signed if a key is given.
+pub struct VBMeta {
+    data: Vec<u8>,
+    desc: Option<HashDescriptor>,
+    key: Option<RsaPrivateKey>,
+}
+
+impl VBMeta {
+    fn init(&mut self, key: *const c_char) -> LoggedResult<()> {
+        if self.data.len() < VBMETA_HEADER_SIZE || &self.data[..4] != b"AVB0" {
+            return Err(log_err!("Invalid vbmeta"));
+        }
+        match unsafe { Utf8CStr::from_ptr(key) } {
+            Ok(path) => match load_key(path).and_then(|key| self.rebuild(&key).map(|_| key)) {
+                Ok(key) => self.key = Some(key),
+                // Without a usable key, only the hash descriptor is updated
+                Err(_) => eprintln!(
+                    "! Cannot use AVBKEY [{}], vbmeta will not be re-signed",
+                    path
+                ),
+            },
+            Err(StrErr::NullPointerError) => {}
+            Err(e) => Err(e)?,
+        }
+
+        let hdr = &self.data[..VBMETA_HEADER_SIZE];
+        let aux = VBMETA_HEADER_SIZE + get_u64(hdr, AUTH_BLOCK_SIZE);
+        let mut pos = aux + get_u64(hdr, DESCRIPTORS_OFFSET);
+        let end = pos + get_u64(hdr, DESCRIPTORS_SIZE);
+        if end > self.data.len() {
+            return Err(log_err!("Invalid vbmeta"));
+        }
+        while pos + HASH_DESCRIPTOR_SIZE <= end {
+            let desc = &self.data[pos..end];
+            let next = pos + 16 + get_u64(desc, 8);
+            if BigEndian::read_u64(desc) != DESCRIPTOR_TAG_HASH {
+                pos = next;
+                continue;
+            }
+            let algorithm = desc[24..56].split(|c| *c == 0).next().unwrap_or_default();
+            let mut hasher: Box<dyn DynDigest> = match algorithm {
+                b"sha1" => Box::<Sha1>::default(),
+                b"sha256" => Box::<Sha256>::default(),
+                b"sha512" => Box::<Sha512>::default(),
+                _ => return Err(log_err!("Unsupported hash descriptor algorithm")),
+            };
+            let name_len = BigEndian::read_u32(&desc[56..]) as usize;
+            let salt_len = BigEndian::read_u32(&desc[60..]) as usize;
+            let digest_len = BigEndian::read_u32(&desc[64..]) as usize;
+            let salt = HASH_DESCRIPTOR_SIZE + name_len;
+            let digest = salt + salt_len;
+            if digest_len != hasher.output_size() || pos + digest + digest_len > next.min(end) {
+                return Err(log_err!("Invalid hash descriptor"));
+            }
+            hasher.update(&desc[salt..digest]);
+            self.desc = Some(HashDescriptor {
+                image_size: pos + 16,
+                digest: pos + digest,
+                hasher,
+            });
+            return Ok(());
+        }
+        Err(log_err!("No hash descriptor in vbmeta"))
+    }
+
+    // Lay out the authentication and auxiliary blocks again for the new key
+    fn rebuild(&mut self, key: &RsaPrivateKey) -> LoggedResult<()> {
+        let hdr = &self.data[..VBMETA_HEADER_SIZE];
+        let auth = VBMETA_HEADER_SIZE;
+        let aux = auth + get_u64(hdr, AUTH_BLOCK_SIZE);
+        let block = |off: usize, size: usize| {
+            self.data
+                .get((aux + get_u64(hdr, off))..(aux + get_u64(hdr, off) + get_u64(hdr, size)))
+                .ok_or_else(|| log_err!("Invalid vbmeta"))
+        };
+        let descriptors = block(DESCRIPTORS_OFFSET, DESCRIPTORS_SIZE)?;
+        let metadata = block(PUBLIC_KEY_METADATA_OFFSET, PUBLIC_KEY_METADATA_SIZE)?;
+        let public_key = encode_public_key(key);
+
+        // Keep the hash of the original algorithm, if any
+        let sha512 = matches!(BigEndian::read_u32(&hdr[ALGORITHM_TYPE..]), 4..=6);
+        let algorithm = match key.size() * 8 {
+            2048 => 1,
+            4096 => 2,
+            8192 => 3,
+            _ => return Err(log_err!("Unsupported AVB key size")),
+        } + if sha512 { 3 } else { 0 };
+        let hash_size = if sha512 { 64 } else { 32 };
+        let auth_size = align_64(hash_size + key.size());
+        let aux_size = align_64(descriptors.len() + public_key.len() + metadata.len());
+
+        let mut data = Vec::with_capacity(VBMETA_HEADER_SIZE + auth_size + aux_size);
+        data.extend_from_slice(hdr);
+        data.resize(VBMETA_HEADER_SIZE + auth_size, 0);
+        data.extend_from_slice(descriptors);
+        data.extend_from_slice(&public_key);
+        data.extend_from_slice(metadata);
+        data.resize(VBMETA_HEADER_SIZE + auth_size + aux_size, 0);
+
+        let (descriptors, metadata) = (descriptors.len(), metadata.len());
+        put_u64(&mut data, AUTH_BLOCK_SIZE, auth_size);
+        put_u64(&mut data, AUX_BLOCK_SIZE, aux_size);
+        BigEndian::write_u32(&mut data[ALGORITHM_TYPE..], algorithm);
+        put_u64(&mut data, HASH_OFFSET, 0);
+        put_u64(&mut data, HASH_SIZE, hash_size);
+        put_u64(&mut data, SIGNATURE_OFFSET, hash_size);
+        put_u64(&mut data, SIGNATURE_SIZE, key.size());
+        put_u64(&mut data, DESCRIPTORS_OFFSET, 0);
+        put_u64(&mut data, DESCRIPTORS_SIZE, descriptors);
+        put_u64(&mut data, PUBLIC_KEY_OFFSET, descriptors);
+        put_u64(&mut data, PUBLIC_KEY_SIZE, public_key.len());
+        put_u64(
+            &mut data,
+            PUBLIC_KEY_METADATA_OFFSET,
+            descriptors + public_key.len(),
+        );
+        put_u64(&mut data, PUBLIC_KEY_METADATA_SIZE, metadata);
+        self.data = data;
+        Ok(())
+    }
+
+    // The vbmeta to write into the new image, with the final size
+    pub fn data(&self) -> &[u8] {
+        &self.data
+    }
+
+    pub fn update(&mut self, data: &[u8]) {
+        if let Some(desc) = &mut self.desc {
+            desc.hasher.update(data);
+        }
+    }
+
+    // Completes the vbmeta written to the new image in place
+    pub fn finalize(&mut self, image_size: u64, vbmeta: &mut [u8]) -> bool {
+        fn inner(
+            desc: HashDescriptor,
+            key: Option<&RsaPrivateKey>,
+            image_size: u64,
+            vbmeta: &mut [u8],
+        ) -> LoggedResult<()> {
+            let HashDescriptor {
+                image_size: image_size_off,
+                digest,
+                mut hasher,
+            } = desc;
+            BigEndian::write_u64(&mut vbmeta[image_size_off..], image_size);
+            let len = hasher.output_size();
+            hasher.finalize_into_reset(&mut vbmeta[digest..(digest + len)])?;
+
+            let Some(key) = key else {
+                return Ok(());
+            };
+            // Header and auxiliary block are signed, with the results stored
+            // in the authentication block
+            let algorithm = BigEndian::read_u32(&vbmeta[ALGORITHM_TYPE..]);
+            let mut hasher = algorithm_digest(algorithm)?;
+            let auth = VBMETA_HEADER_SIZE;
+            let aux = auth + get_u64(vbmeta, AUTH_BLOCK_SIZE);
+            hasher.update(&vbmeta[..VBMETA_HEADER_SIZE]);
+            hasher.update(&vbmeta[aux..(aux + get_u64(vbmeta, AUX_BLOCK_SIZE))]);
+            let hash = hasher.finalize_reset();
+            let sig = if algorithm <= 3 {
+                key.sign(Pkcs1v15Sign::new::<Sha256>(), &hash)?
+            } else {
+                key.sign(Pkcs1v15Sign::new::<Sha512>(), &hash)?
+            };
+            let hash_off = auth + get_u64(vbmeta, HASH_OFFSET);
+            vbmeta[hash_off..(hash_off + hash.len())].copy_from_slice(&hash);
+            let sig_off = auth + get_u64(vbmeta, SIGNATURE_OFFSET);
+            vbmeta[sig_off..(sig_off + sig.len())].copy_from_slice(&sig);
+            Ok(())
+        }
+        match self.desc.take() {
+            Some(desc) if vbmeta.len() == self.data.len() => {
+                inner(desc, self.key.as_ref(), image_size, vbmeta).is_ok()
+            }
+            _ => false,
+        }
+    }
+}
+
+pub fn get_vbmeta(vbmeta: &[u8], key: *const c_char) -> Box<VBMeta> {
+    let mut v = VBMeta {
+        data: vbmeta.to_vec(),
+        desc: None,
+        key: None,
+    };
+    if v.init(key).is_err() {
+        // Keep the vbmeta as is
+        v.data = vbmeta.to_vec();
+        v.desc = None;
+        v.key = None;
+    }
+    Box::new(v)
+}
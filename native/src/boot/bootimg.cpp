@@ -1,6 +1,10 @@
+#include <array>
+#include <atomic>
 #include <bit>
 #include <functional>
 #include <memory>
+#include <optional>
+#include <sys/syscall.h>
 
 #include <base.hpp>
 
@@ -14,16 +18,13 @@ using namespace std;
 #define PADDING 15
 #define SHA256_DIGEST_SIZE 32
 #define SHA_DIGEST_SIZE 20
-
-static void decompress(format_t type, int fd, const void *in, size_t size) {
-    auto ptr = get_decoder(type, make_unique<fd_channel>(fd));
-    ptr->write(in, size);
-}
+// Blocks of the output image are fed to all of its digests in turn
+#define DIGEST_BLOCK_SZ (256 * 1024)
 
 static off_t compress(format_t type, int fd, const void *in, size_t size) {
     auto prev = lseek(fd, 0, SEEK_CUR);
     {
-        auto strm = get_encoder(type, make_unique<fd_channel>(fd));
+        auto strm = get_encoder(type, make_unique<fd_channel>(fd), env_encoder_opts());
         strm->write(in, size);
     }
     auto now = lseek(fd, 0, SEEK_CUR);
@@ -47,6 +48,147 @@ static size_t restore(int fd, const char *filename) {
     return size;
 }
 
+// Multi-buffer hashing: independent buffers are hashed concurrently, each on
+// its own core, as a single SHA256 stream cannot be split across threads.
+struct sha256_batch {
+    explicit sha256_batch(vector<byte_view> &&in) :
+        in(std::move(in)), out(this->in.size()), next(0) {}
+
+    vector<byte_view> in;
+    vector<array<uint8_t, SHA256_DIGEST_SIZE>> out;
+    atomic<size_t> next;
+
+    void run();
+    string hex(size_t i) const;
+
+private:
+    static void *worker(void *arg);
+};
+
+void *sha256_batch::worker(void *arg) {
+    auto self = static_cast<sha256_batch *>(arg);
+    for (size_t i; (i = self->next++) < self->in.size();)
+        sha256_hash(self->in[i], byte_data(self->out[i].data(), SHA256_DIGEST_SIZE));
+    return nullptr;
+}
+
+void sha256_batch::run() {
+    // The calling thread is one of the workers
+    size_t n = std::min<size_t>(in.size(), decompress_threads());
+    vector<pthread_t> threads;
+    for (size_t i = 1; i < n; ++i) {
+        pthread_t t;
+        if (pthread_create(&t, nullptr, worker, this) == 0)
+            threads.push_back(t);
+    }
+    worker(this);
+    for (auto t : threads)
+        pthread_join(t, nullptr);
+}
+
+static string hex_digest(const uint8_t *digest) {
+    char hex[SHA256_DIGEST_SIZE * 2 + 1];
+    for (int j = 0; j < SHA256_DIGEST_SIZE; ++j)
+        ssprintf(hex + j * 2, 3, "%02x", digest[j]);
+    return hex;
+}
+
+string sha256_batch::hex(size_t i) const {
+    return hex_digest(out[i].data());
+}
+
+// SHA256 of everything written to it
+struct sha256_out_stream : public out_stream {
+    rust::Box<SHA> ctx = get_sha(false);
+
+    bool write(const void *buf, size_t len) override {
+        ctx->update(byte_view(buf, len));
+        return true;
+    }
+
+    string hex() {
+        uint8_t digest[SHA256_DIGEST_SIZE];
+        ctx->finalize_into(byte_data(digest, sizeof(digest)));
+        return hex_digest(digest);
+    }
+};
+
+/*
+ * On unpack, every decompressed component is recorded in COMP_HASH_FILE as
+ *
+ *   <file>=<blob offset> <blob size> <blob sha256> <content sha256>
+ *
+ * where blob is the original compressed data in the boot image. On repack, if the
+ * component is unchanged and the source image still has the same blob, the original
+ * compressed data is copied verbatim instead of compressing the content again.
+ * Nothing is reused when encoder options are set in the environment, as the
+ * original blob was not necessarily produced with those options. The content hash
+ * is computed while decompressing, so unpack never reads its outputs back.
+ */
+
+struct comp_blob {
+    const char *file;
+    const uint8_t *blob;
+    size_t size;
+    string content_hash;
+};
+
+// The compressed blobs are hashed in one batch
+static void record_blobs(FILE *fp, const boot_img &boot, const vector<comp_blob> &blobs) {
+    vector<byte_view> in;
+    for (auto &b : blobs)
+        in.emplace_back(b.blob, b.size);
+    sha256_batch hashes(std::move(in));
+    hashes.run();
+    for (size_t i = 0; i < blobs.size(); ++i) {
+        auto &b = blobs[i];
+        fprintf(fp, "%s=%zu %zu %s %s\n", b.file, (size_t) (b.blob - boot.map.buf()), b.size,
+                hashes.hex(i).data(), b.content_hash.data());
+    }
+}
+
+static bool reuse_blob(int fd, int src_fd, const boot_img &boot, const char *file,
+                       const uint8_t *blob, size_t size, const mmap_data &content) {
+    if (env_encoder_opts_set())
+        return false;
+    string record;
+    parse_prop_file(COMP_HASH_FILE, [&](string_view key, string_view value) -> bool {
+        if (key == file) {
+            record = value;
+            return false;
+        }
+        return true;
+    });
+    if (record.empty())
+        return false;
+
+    size_t off, sz;
+    char blob_hash[SHA256_DIGEST_SIZE * 2 + 1];
+    char content_hash[SHA256_DIGEST_SIZE * 2 + 1];
+    if (sscanf(record.data(), "%zu %zu %64s %64s", &off, &sz, blob_hash, content_hash) != 4)
+        return false;
+    if (off != (size_t) (blob - boot.map.buf()) || sz != size)
+        return false;
+    sha256_batch hashes({ content, byte_view(blob, size) });
+    hashes.run();
+    if (hashes.hex(0) != content_hash || hashes.hex(1) != blob_hash)
+        return false;
+
+    fprintf(stderr, "Reuse unchanged [%s]\n", file);
+    // Copy in kernel if possible, fallback to writing from the mapped image
+    loff_t in_off = off;
+    size_t len = size;
+    while (len) {
+        ssize_t n = syscall(__NR_copy_file_range, src_fd, &in_off, fd, nullptr, len, 0);
+        if (n <= 0)
+            break;
+        len -= n;
+    }
+    if (len)
+        xwrite(fd, blob + size - len, len);
+    return true;
+}
+
 void dyn_img_hdr::print() const {
     uint32_t ver = header_version();
     fprintf(stderr, "%-*s [%u]\n", PADDING, "HEADER_VER", ver);
@@ -146,10 +288,20 @@ void dyn_img_hdr::load_hdr_file() {
     });
 }
 
-boot_img::boot_img(const char *image) : map(image) {
+boot_img::boot_img(const char *image) : map(image), magics(map.buf(), map.sz()) {
     fprintf(stderr, "Parsing boot image: [%s]\n", image);
-    for (const uint8_t *addr = map.buf(); addr < map.buf() + map.sz(); ++addr) {
-        format_t fmt = check_fmt(addr, map.sz());
+    const uint8_t *end = map.buf() + map.sz();
+    for (const uint8_t *addr = map.buf(); addr < end; ++addr) {
+        // Jump to the closest boot format magic
+        format_t fmt = UNKNOWN;
+        const uint8_t *next = end;
+        for (format_t f : { CHROMEOS, DHTB, BLOB, AOSP, AOSP_VENDOR }) {
+            if (auto p = magics.find(f, addr, next - addr)) {
+                next = p;
+                fmt = f;
+            }
+        }
+        addr = next;
         switch (fmt) {
         case CHROMEOS:
             // chromeos require external signing
@@ -224,11 +376,14 @@ struct [[gnu::packed]] fdt_header {
 };
 
 
-static int find_dtb_offset(const uint8_t *buf, unsigned sz) {
+// Use the magic index of the whole image if one is available, building one to
+// find a single DTB costs more than the memmem scan it replaces
+static int find_dtb_offset(const uint8_t *buf, unsigned sz, const magic_index *magics = nullptr) {
     const uint8_t * const end = buf + sz;
 
     for (auto curr = buf; curr < end; curr += sizeof(fdt_header)) {
-        curr = static_cast<uint8_t*>(memmem(curr, end - curr, DTB_MAGIC, sizeof(fdt_header::fdt32_t)));
+        curr = magics ? magics->find(DTB, curr, end - curr) : static_cast<const uint8_t *>(
+                memmem(curr, end - curr, DTB_MAGIC, sizeof(fdt_header::fdt32_t)));
         if (curr == nullptr)
             return -1;
 
@@ -407,7 +562,7 @@ bool boot_img::parse_image(const uint8_t *p, format_t type) {
     tail = byte_view(tail_addr, map.buf() + map.sz() - tail_addr);
 
     if (auto size = hdr->kernel_size()) {
-        if (int dtb_off = find_dtb_offset(kernel, size); dtb_off > 0) {
+        if (int dtb_off = find_dtb_offset(kernel, size, &magics); dtb_off > 0) {
             kernel_dtb = byte_view(kernel + dtb_off, size - dtb_off);
             hdr->kernel_size() = dtb_off;
             fprintf(stderr, "%-*s [%zu]\n", PADDING, "KERNEL_DTB_SZ", kernel_dtb.sz());
@@ -426,7 +581,7 @@ bool boot_img::parse_image(const uint8_t *p, format_t type) {
         }
         if (k_fmt == ZIMAGE) {
             z_hdr = reinterpret_cast<const zimage_hdr *>(kernel);
-            if (const void *gzip = memmem(kernel, hdr->kernel_size(), GZIP1_MAGIC "\x08\x00", 4)) {
+            if (const void *gzip = magics.find(GZIP, kernel, hdr->kernel_size())) {
                 fprintf(stderr, "ZIMAGE_KERNEL\n");
                 z_info.hdr_sz = (const uint8_t *) gzip - kernel;
 
@@ -517,7 +672,12 @@ bool boot_img::parse_image(const uint8_t *p, format_t type) {
 }
 
 bool boot_img::verify(const char *cert) const {
-    return rust::verify_boot_image(*this, cert);
+    auto verifier = rust::get_boot_verifier(tail, cert);
+    for (size_t pos = 0; pos < payload.sz(); pos += DIGEST_BLOCK_SZ) {
+        size_t len = std::min<size_t>(DIGEST_BLOCK_SZ, payload.sz() - pos);
+        verifier->update(byte_view(payload.buf() + pos, len));
+    }
+    return verifier->finalize();
 }
 
 int split_image_dtb(const char *filename) {
@@ -526,8 +686,8 @@ int split_image_dtb(const char *filename) {
     if (int off = find_dtb_offset(img.buf(), img.sz()); off > 0) {
         format_t fmt = check_fmt_lg(img.buf(), img.sz());
         if (COMPRESSED(fmt)) {
-            int fd = creat(KERNEL_FILE, 0644);
-            decompress(fmt, fd, img.buf(), off);
+            int fd = xopen(KERNEL_FILE, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            decompress(fmt, byte_view(img.buf(), off), fd);
             close(fd);
         } else {
             dump(img.buf(), off, KERNEL_FILE);
@@ -546,12 +706,20 @@ int unpack(const char *image, bool skip_decomp, bool hdr) {
     if (hdr)
         boot.hdr->dump_hdr_file();
 
+    unlink(COMP_HASH_FILE);
+    vector<comp_blob> blobs;
+    auto decompress_blob = [&](format_t fmt, const uint8_t *blob, size_t size, const char *file) {
+        int fd = xopen(file, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        sha256_out_stream content;
+        decompress(fmt, byte_view(blob, size), fd, &content);
+        close(fd);
+        blobs.push_back({ file, blob, size, content.hex() });
+    };
+
     // Dump kernel
     if (!skip_decomp && COMPRESSED(boot.k_fmt)) {
         if (boot.hdr->kernel_size() != 0) {
-            int fd = creat(KERNEL_FILE, 0644);
-            decompress(boot.k_fmt, fd, boot.kernel, boot.hdr->kernel_size());
-            close(fd);
+            decompress_blob(boot.k_fmt, boot.kernel, boot.hdr->kernel_size(), KERNEL_FILE);
         }
     } else {
         dump(boot.kernel, boot.hdr->kernel_size(), KERNEL_FILE);
@@ -563,9 +731,7 @@ int unpack(const char *image, bool skip_decomp, bool hdr) {
     // Dump ramdisk
     if (!skip_decomp && COMPRESSED(boot.r_fmt)) {
         if (boot.hdr->ramdisk_size() != 0) {
-            int fd = creat(RAMDISK_FILE, 0644);
-            decompress(boot.r_fmt, fd, boot.ramdisk, boot.hdr->ramdisk_size());
-            close(fd);
+            decompress_blob(boot.r_fmt, boot.ramdisk, boot.hdr->ramdisk_size(), RAMDISK_FILE);
         }
     } else {
         dump(boot.ramdisk, boot.hdr->ramdisk_size(), RAMDISK_FILE);
@@ -577,9 +743,7 @@ int unpack(const char *image, bool skip_decomp, bool hdr) {
     // Dump extra
     if (!skip_decomp && COMPRESSED(boot.e_fmt)) {
         if (boot.hdr->extra_size() != 0) {
-            int fd = creat(EXTRA_FILE, 0644);
-            decompress(boot.e_fmt, fd, boot.extra, boot.hdr->extra_size());
-            close(fd);
+            decompress_blob(boot.e_fmt, boot.extra, boot.hdr->extra_size(), EXTRA_FILE);
         }
     } else {
         dump(boot.extra, boot.hdr->extra_size(), EXTRA_FILE);
@@ -591,6 +755,12 @@ int unpack(const char *image, bool skip_decomp, bool hdr) {
     // Dump dtb
     dump(boot.dtb, boot.hdr->dtb_size(), DTB_FILE);
 
+    if (!skip_decomp) {
+        FILE *hash_fp = xfopen(COMP_HASH_FILE, "we");
+        record_blobs(hash_fp, boot, blobs);
+        fclose(hash_fp);
+    }
+
     return boot.flags[CHROMEOS_FLAG] ? 2 : 0;
 }
 
@@ -630,6 +800,7 @@ void repack(const char *src_img, const char *out_img, bool skip_comp) {
 
     // Create new image
     int fd = creat(out_img, 0644);
+    int src_fd = xopen(src_img, O_RDONLY | O_CLOEXEC);
 
     if (boot.flags[DHTB_FLAG]) {
         // Skip DHTB header
@@ -658,10 +829,16 @@ void repack(const char *src_img, const char *out_img, bool skip_comp) {
     }
     if (access(KERNEL_FILE, R_OK) == 0) {
         mmap_data m(KERNEL_FILE);
+        bool reused = false;
         if (!skip_comp && !COMPRESSED_ANY(check_fmt(m.buf(), m.sz())) && COMPRESSED(boot.k_fmt)) {
-            // Always use zopfli for zImage compression
-            auto fmt = (boot.flags[ZIMAGE_KERNEL] && boot.k_fmt == GZIP) ? ZOPFLI : boot.k_fmt;
-            hdr->kernel_size() = compress(fmt, fd, m.buf(), m.sz());
+            if (reuse_blob(fd, src_fd, boot, KERNEL_FILE, boot.kernel, boot.hdr->kernel_size(), m)) {
+                reused = true;
+                hdr->kernel_size() = boot.hdr->kernel_size();
+            } else {
+                // Always use zopfli for zImage compression
+                auto fmt = (boot.flags[ZIMAGE_KERNEL] && boot.k_fmt == GZIP) ? ZOPFLI : boot.k_fmt;
+                hdr->kernel_size() = compress(fmt, fd, m.buf(), m.sz());
+            }
         } else {
             hdr->kernel_size() = xwrite(fd, m.buf(), m.sz());
         }
@@ -671,7 +848,7 @@ void repack(const char *src_img, const char *out_img, bool skip_comp) {
                 fprintf(stderr, "! Recompressed kernel is too large, using original kernel\n");
                 ftruncate64(fd, lseek64(fd, - (off64_t) hdr->kernel_size(), SEEK_CUR));
                 xwrite(fd, boot.kernel, boot.hdr->kernel_size());
-            } else if (!skip_comp) {
+            } else if (!skip_comp && !reused) {
                 // Pad zeros to make sure the zImage file size does not change
                 // Also ensure the last 4 bytes are the uncompressed vmlinux size
                 uint32_t sz = m.sz();
@@ -714,7 +891,12 @@ void repack(const char *src_img, const char *out_img, bool skip_comp) {
             r_fmt = LZ4_LEGACY;
         }
         if (!skip_comp && !COMPRESSED_ANY(check_fmt(m.buf(), m.sz())) && COMPRESSED(r_fmt)) {
-            hdr->ramdisk_size() = compress(r_fmt, fd, m.buf(), m.sz());
+            if (r_fmt == boot.r_fmt &&
+                reuse_blob(fd, src_fd, boot, RAMDISK_FILE, boot.ramdisk, boot.hdr->ramdisk_size(), m)) {
+                hdr->ramdisk_size() = boot.hdr->ramdisk_size();
+            } else {
+                hdr->ramdisk_size() = compress(r_fmt, fd, m.buf(), m.sz());
+            }
         } else {
             hdr->ramdisk_size() = xwrite(fd, m.buf(), m.sz());
         }
@@ -733,7 +915,11 @@ void repack(const char *src_img, const char *out_img, bool skip_comp) {
     if (access(EXTRA_FILE, R_OK) == 0) {
         mmap_data m(EXTRA_FILE);
         if (!skip_comp && !COMPRESSED_ANY(check_fmt(m.buf(), m.sz())) && COMPRESSED(boot.e_fmt)) {
-            hdr->extra_size() = compress(boot.e_fmt, fd, m.buf(), m.sz());
+            if (reuse_blob(fd, src_fd, boot, EXTRA_FILE, boot.extra, boot.hdr->extra_size(), m)) {
+                hdr->extra_size() = boot.hdr->extra_size();
+            } else {
+                hdr->extra_size() = compress(boot.e_fmt, fd, m.buf(), m.sz());
+            }
         } else {
             hdr->extra_size() = xwrite(fd, m.buf(), m.sz());
         }
@@ -774,13 +960,22 @@ void repack(const char *src_img, const char *out_img, bool skip_comp) {
     file_align();
 
     // vbmeta
+    optional<rust::Box<rust::VBMeta>> vbmeta;
     if (boot.flags[AVB_FLAG]) {
         // According to avbtool.py, if the input is not an Android sparse image
         // (which boot images are not), the default block size is 4096
         file_align_with(4096);
         off.vbmeta = lseek(fd, 0, SEEK_CUR);
         uint64_t vbmeta_size = __builtin_bswap64(boot.avb_footer->vbmeta_size);
-        xwrite(fd, boot.vbmeta, vbmeta_size);
+        vbmeta.emplace(rust::get_vbmeta(byte_view(boot.vbmeta, vbmeta_size), getenv("AVBKEY")));
+        auto data = (*vbmeta)->data();
+        xwrite(fd, data.data(), data.size());
+        // The footer stays at the end of the original image, it must not overlap
+        // the vbmeta, which grows with the image when re-signed with a larger key
+        if (lseek(fd, 0, SEEK_CUR) + sizeof(AvbFooter) > boot.map.sz()) {
+            fprintf(stderr, "! vbmeta and AVB footer do not fit in the original image size\n");
+            exit(1);
+        }
     }
 
     // Pad image to original size if not chromeos (as it requires post processing)
@@ -791,6 +986,8 @@ void repack(const char *src_img, const char *out_img, bool skip_comp) {
         }
     }
 
+    close(src_fd);
+
     /******************
      * Patch the image
      ******************/
@@ -862,29 +1059,82 @@ void repack(const char *src_img, const char *out_img, bool skip_comp) {
         memcpy(footer, boot.avb_footer, sizeof(AvbFooter));
         footer->original_image_size = __builtin_bswap64(off.total);
         footer->vbmeta_offset = __builtin_bswap64(off.vbmeta);
+        footer->vbmeta_size = __builtin_bswap64((*vbmeta)->data().size());
         if (check_env("PATCHVBMETAFLAG")) {
-            auto vbmeta = reinterpret_cast<AvbVBMetaImageHeader*>(out.buf() + off.vbmeta);
-            vbmeta->flags = __builtin_bswap32(3);
+            auto hdr = reinterpret_cast<AvbVBMetaImageHeader*>(out.buf() + off.vbmeta);
+            hdr->flags = __builtin_bswap32(3);
         }
     }
 
+    if (boot.flags[BLOB_FLAG]) {
+        // Blob header
+        auto b_hdr = reinterpret_cast<blob_hdr *>(out.buf());
+        b_hdr->size = off.total - sizeof(blob_hdr);
+    }
+
+    /*****************
+     * Image digests
+     *****************/
+
+    // The DHTB checksum, the AVB 1.0 signature and the AVB 2.0 hash descriptor
+    // all cover the patched header, so they can only be computed after everything
+    // above. All digests are fed block by block in a single pass over the image,
+    // while each block is hot.
+    optional<rust::Box<SHA>> dhtb_ctx;
+    optional<rust::Box<rust::BootSigner>> signer;
+    size_t digest_start = off.total;
     if (boot.flags[DHTB_FLAG]) {
+        dhtb_ctx.emplace(get_sha(false));
+        digest_start = std::min<size_t>(digest_start, sizeof(dhtb_hdr));
+    }
+    if (boot.flags[AVB1_SIGNED_FLAG]) {
+        signer.emplace(rust::get_boot_signer("/boot", nullptr, nullptr));
+        digest_start = std::min<size_t>(digest_start, off.header);
+    }
+    // The AVB 2.0 digest also covers the DHTB header, which is only known
+    // after its checksum, so hash the image in a separate pass in that case
+    bool avb_late = dhtb_ctx.has_value();
+    if (vbmeta && !avb_late)
+        digest_start = 0;
+    for (size_t pos = digest_start; pos < off.total; pos += DIGEST_BLOCK_SZ) {
+        size_t end = std::min<size_t>(pos + DIGEST_BLOCK_SZ, off.total);
+        // Part of the current block within [start, off.total)
+        auto block = [&](size_t start) {
+            start = std::max(pos, std::min(start, end));
+            return byte_view(out.buf() + start, end - start);
+        };
+        if (dhtb_ctx)
+            (*dhtb_ctx)->update(block(sizeof(dhtb_hdr)));
+        if (signer)
+            (*signer)->update(block(off.header));
+        if (vbmeta && !avb_late)
+            (*vbmeta)->update(block(0));
+    }
+
+    if (dhtb_ctx) {
         // DHTB header
         auto d_hdr = reinterpret_cast<dhtb_hdr *>(out.buf());
         memcpy(d_hdr, DHTB_MAGIC, 8);
         d_hdr->size = off.total - sizeof(dhtb_hdr);
-        sha256_hash(byte_view(out.buf() + sizeof(dhtb_hdr), d_hdr->size),
-                    byte_data(d_hdr->checksum, 32));
-    } else if (boot.flags[BLOB_FLAG]) {
-        // Blob header
-        auto b_hdr = reinterpret_cast<blob_hdr *>(out.buf());
-        b_hdr->size = off.total - sizeof(blob_hdr);
+        (*dhtb_ctx)->finalize_into(byte_data(d_hdr->checksum, SHA256_DIGEST_SIZE));
+    }
+
+    if (vbmeta) {
+        if (avb_late) {
+            for (size_t pos = 0; pos < off.total; pos += DIGEST_BLOCK_SZ) {
+                size_t end = std::min<size_t>(pos + DIGEST_BLOCK_SZ, off.total);
+                (*vbmeta)->update(byte_view(out.buf() + pos, end - pos));
+            }
+        }
+        // Update the hash descriptor, and re-sign the vbmeta if a key is provided
+        auto size = (*vbmeta)->data().size();
+        if (!(*vbmeta)->finalize(off.total, byte_data(out.buf() + off.vbmeta, size)))
+            fprintf(stderr, "! Unable to update vbmeta hash descriptor\n");
     }
 
     // Sign the image after we finish patching the boot image
-    if (boot.flags[AVB1_SIGNED_FLAG]) {
-        byte_view payload(out.buf() + off.header, off.total - off.header);
-        auto sig = rust::sign_boot_image(payload, "/boot", nullptr, nullptr);
+    if (signer) {
+        auto sig = (*signer)->finalize();
         if (!sig.empty()) {
             lseek(fd, off.total, SEEK_SET);
             xwrite(fd, sig.data(), sig.size());
@@ -590,6 +590,9 @@ struct boot_img {
     // Memory map of the whole image
     const mmap_data map;
 
+    // Offsets of known magics in the whole image
+    const magic_index magics;
+
     // Android image header
     const dyn_img_hdr *hdr;
 
@@ -659,8 +662,5 @@ struct boot_img {
     bool parse_image(const uint8_t *addr, format_t type);
     const std::pair<const uint8_t *, dyn_img_hdr *> create_hdr(const uint8_t *addr, format_t type);
 
-    // Rust FFI
-    rust::Slice<const uint8_t> get_payload() const { return payload; }
-    rust::Slice<const uint8_t> get_tail() const { return tail; }
     bool verify(const char *cert = nullptr) const;
 };
@@ -1,5 +1,7 @@
 #include <memory>
 #include <functional>
+#include <deque>
+#include <sys/mman.h>
 
 #include <zlib.h>
 #include <bzlib.h>
@@ -23,6 +25,51 @@ constexpr size_t CHUNK = 0x40000;
 constexpr size_t LZ4_UNCOMPRESSED = 0x800000;
 constexpr size_t LZ4_COMPRESSED = LZ4_COMPRESSBOUND(LZ4_UNCOMPRESSED);
 
+static int opt_level(const encoder_opts &opts, int def, int min, int max) {
+    return opts.level < 0 ? def : std::clamp(opts.level, min, max);
+}
+
+// Valid levels of each format, matching the opt_level calls of its encoders
+static bool level_valid(format_t type, int level) {
+    switch (type) {
+        case GZIP:
+        case XZ:
+        case LZMA:
+            return level >= 0 && level <= 9;
+        case ZOPFLI:
+            return level >= 1 && level <= 15;
+        case BZIP2:
+            return level >= 1 && level <= 9;
+        case LZ4:
+        case LZ4_LEGACY:
+        case LZ4_LG:
+            return level >= 0 && level <= LZ4HC_CLEVEL_MAX;
+        default:
+            return false;
+    }
+}
+
+// Deflate window bits large enough to cover the requested window size
+static int opt_window_bits(const encoder_opts &opts) {
+    int bits = 9;
+    while (bits < 15 && ((size_t) 1 << bits) < opts.dict_sz)
+        ++bits;
+    return opts.dict_sz ? bits : 15;
+}
+
+static void opt_lzma(const encoder_opts &opts, lzma_options_lzma &opt) {
+    lzma_lzma_preset(&opt, opt_level(opts, 9, 0, 9));
+    if (opts.dict_sz)
+        opt.dict_size = std::clamp<size_t>(opts.dict_sz, LZMA_DICT_SIZE_MIN, 1536U << 20);
+}
+
+// LZ4 legacy blocks, levels below LZ4HC_CLEVEL_MIN use the fast compressor
+static int lz4_compress_block(const char *in, char *out, int len, int cap, int level) {
+    if (level < LZ4HC_CLEVEL_MIN)
+        return LZ4_compress_default(in, out, len, cap);
+    return LZ4_compress_HC(in, out, len, cap, level);
+}
+
 class gz_strm : public filter_out_stream {
 public:
     bool write(const void *buf, size_t len) override {
@@ -51,14 +98,14 @@ protected:
         COPY
     } mode;
 
-    gz_strm(mode_t mode, out_strm_ptr &&base) :
+    gz_strm(mode_t mode, out_strm_ptr &&base, int level = 9, int window_bits = 15) :
             filter_out_stream(std::move(base)), mode(mode), strm{}, outbuf{0} {
         switch(mode) {
         case DECODE:
             inflateInit2(&strm, 15 | 16);
             break;
         case ENCODE:
-            deflateInit2(&strm, 9, Z_DEFLATED, 15 | 16, 8, Z_DEFAULT_STRATEGY);
+            deflateInit2(&strm, level, Z_DEFLATED, window_bits | 16, 8, Z_DEFAULT_STRATEGY);
             break;
         default:
             break;
@@ -146,18 +193,19 @@ public:
 
 class gz_encoder : public gz_strm {
 public:
-    explicit gz_encoder(out_strm_ptr &&base) : gz_strm(ENCODE, std::move(base)) {};
+    gz_encoder(out_strm_ptr &&base, const encoder_opts &opts) :
+        gz_strm(ENCODE, std::move(base), opt_level(opts, 9, 0, 9), opt_window_bits(opts)) {};
 };
 
 class zopfli_encoder : public chunk_out_stream {
 public:
-    explicit zopfli_encoder(out_strm_ptr &&base) :
+    zopfli_encoder(out_strm_ptr &&base, const encoder_opts &opts) :
         chunk_out_stream(std::move(base), ZOPFLI_MASTER_BLOCK_SIZE),
         zo{}, out(nullptr), outsize(0), crc(crc32_z(0L, Z_NULL, 0)), in_total(0), bp(0) {
         ZopfliInitOptions(&zo);
 
         // This config is already better than gzip -9
-        zo.numiterations = 1;
+        zo.numiterations = opt_level(opts, 1, 1, 15);
         zo.blocksplitting = 0;
 
         ZOPFLI_APPEND_DATA(31, &out, &outsize);  /* ID1 */
@@ -245,14 +293,14 @@ protected:
         ENCODE
     } mode;
 
-    bz_strm(mode_t mode, out_strm_ptr &&base) :
+    bz_strm(mode_t mode, out_strm_ptr &&base, int level = 9) :
             filter_out_stream(std::move(base)), mode(mode), strm{}, outbuf{0} {
         switch(mode) {
         case DECODE:
             BZ2_bzDecompressInit(&strm, 0, 0);
             break;
         case ENCODE:
-            BZ2_bzCompressInit(&strm, 9, 0, 0);
+            BZ2_bzCompressInit(&strm, level, 0, 0);
             break;
         }
     }
@@ -296,7 +344,8 @@ public:
 
 class bz_encoder : public bz_strm {
 public:
-    explicit bz_encoder(out_strm_ptr &&base) : bz_strm(ENCODE, std::move(base)) {};
+    bz_encoder(out_strm_ptr &&base, const encoder_opts &opts) :
+        bz_strm(ENCODE, std::move(base), opt_level(opts, 9, 1, 9)) {};
 };
 
 class lzma_strm : public filter_out_stream {
@@ -317,12 +366,12 @@ protected:
         ENCODE_LZMA
     } mode;
 
-    lzma_strm(mode_t mode, out_strm_ptr &&base) :
+    lzma_strm(mode_t mode, out_strm_ptr &&base, const encoder_opts &opts = {}) :
             filter_out_stream(std::move(base)), mode(mode), strm(LZMA_STREAM_INIT), outbuf{0} {
         lzma_options_lzma opt;
 
         // Initialize preset
-        lzma_lzma_preset(&opt, 9);
+        opt_lzma(opts, opt);
         lzma_filter filters[] = {
             { .id = LZMA_FILTER_LZMA2, .options = &opt },
             { .id = LZMA_VLI_UNKNOWN, .options = nullptr },
@@ -374,12 +423,14 @@ public:
 
 class xz_encoder : public lzma_strm {
 public:
-    explicit xz_encoder(out_strm_ptr &&base) : lzma_strm(ENCODE_XZ, std::move(base)) {}
+    xz_encoder(out_strm_ptr &&base, const encoder_opts &opts) :
+        lzma_strm(ENCODE_XZ, std::move(base), opts) {}
 };
 
 class lzma_encoder : public lzma_strm {
 public:
-    explicit lzma_encoder(out_strm_ptr &&base) : lzma_strm(ENCODE_LZMA, std::move(base)) {}
+    lzma_encoder(out_strm_ptr &&base, const encoder_opts &opts) :
+        lzma_strm(ENCODE_LZMA, std::move(base), opts) {}
 };
 
 class LZ4F_decoder : public filter_out_stream {
@@ -437,8 +488,9 @@ private:
 
 class LZ4F_encoder : public filter_out_stream {
 public:
-    explicit LZ4F_encoder(out_strm_ptr &&base) :
-            filter_out_stream(std::move(base)), ctx(nullptr), out_buf(nullptr), outCapacity(0) {
+    LZ4F_encoder(out_strm_ptr &&base, const encoder_opts &opts) :
+            filter_out_stream(std::move(base)), ctx(nullptr), out_buf(nullptr), outCapacity(0),
+            level(opt_level(opts, 9, 0, LZ4HC_CLEVEL_MAX)) {
         LZ4F_createCompressionContext(&ctx, LZ4F_VERSION);
     }
 
@@ -451,7 +503,7 @@ public:
                     .contentChecksumFlag = LZ4F_contentChecksumEnabled,
                     .blockChecksumFlag = LZ4F_noBlockChecksum,
                 },
-                .compressionLevel = 9,
+                .compressionLevel = level,
                 .autoFlush = 1,
             };
             outCapacity = LZ4F_compressBound(BLOCK_SZ, &prefs);
@@ -495,6 +547,7 @@ private:
     LZ4F_compressionContext_t ctx;
     uint8_t *out_buf;
     size_t outCapacity;
+    int level;
 
     static constexpr size_t BLOCK_SZ = 1 << 22;
 };
@@ -548,9 +601,10 @@ private:
 
 class LZ4_encoder : public chunk_out_stream {
 public:
-    explicit LZ4_encoder(out_strm_ptr &&base, bool lg) :
+    LZ4_encoder(out_strm_ptr &&base, bool lg, const encoder_opts &opts) :
         chunk_out_stream(std::move(base), LZ4_UNCOMPRESSED),
-        out_buf(new char[LZ4_COMPRESSED]), lg(lg), in_total(0) {
+        out_buf(new char[LZ4_COMPRESSED]), lg(lg), in_total(0),
+        level(opt_level(opts, LZ4HC_CLEVEL_MAX, 0, LZ4HC_CLEVEL_MAX)) {
         bwrite("\x02\x21\x4c\x18", 4);
     }
 
@@ -564,7 +618,7 @@ public:
 protected:
     bool write_chunk(const void *buf, size_t len, bool) override {
         auto in = static_cast<const char *>(buf);
-        uint32_t block_sz = LZ4_compress_HC(in, out_buf, len, LZ4_COMPRESSED, LZ4HC_CLEVEL_MAX);
+        uint32_t block_sz = lz4_compress_block(in, out_buf, len, LZ4_COMPRESSED, level);
         if (block_sz == 0) {
             LOGW("LZ4HC compression failure\n");
             return false;
@@ -580,27 +634,1260 @@ private:
     char *out_buf;
     bool lg;
     uint32_t in_total;
+    int level;
+};
+
+// Runs jobs on a pool of worker threads, and hands the finished jobs back in
+// submission order, so the output of any parallel pipeline stays deterministic.
+template<class Job>
+class ordered_pool {
+public:
+    using work_fn = std::function<bool(Job &)>;
+
+    ordered_pool(int threads, work_fn &&work) :
+        threads(threads), work(std::move(work)), next_job(0), stop(false), started(false) {
+        pthread_mutex_init(&lock, nullptr);
+        pthread_cond_init(&cond, nullptr);
+    }
+
+    ~ordered_pool() {
+        shutdown();
+        pthread_mutex_destroy(&lock);
+        pthread_cond_destroy(&cond);
+    }
+
+    int size() const { return threads; }
+
+    // Stop all workers, jobs that are not yet started are abandoned
+    void shutdown() {
+        {
+            mutex_guard g(lock);
+            stop = true;
+            pthread_cond_broadcast(&cond);
+        }
+        for (auto t : workers)
+            pthread_join(t, nullptr);
+        workers.clear();
+    }
+
+    void submit(std::unique_ptr<Job> &&job) {
+        if (!started)
+            start_workers();
+        if (workers.empty()) {
+            // No worker could be started, do the work on the calling thread
+            bool ok = work(*job);
+            mutex_guard g(lock);
+            jobs.push_back({ std::move(job), true, ok });
+            ++next_job;
+            return;
+        }
+        mutex_guard g(lock);
+        jobs.push_back({ std::move(job) });
+        pthread_cond_broadcast(&cond);
+    }
+
+    // Consume finished jobs in order until at most max_pending jobs are in flight
+    template<class Fn>
+    bool drain(size_t max_pending, Fn &&consume) {
+        for (;;) {
+            entry e;
+            {
+                mutex_guard g(lock);
+                if (jobs.size() <= max_pending)
+                    return true;
+                while (!jobs.front().done)
+                    pthread_cond_wait(&cond, &lock);
+                e = std::move(jobs.front());
+                jobs.pop_front();
+                --next_job;
+            }
+            if (!e.ok || !consume(*e.job))
+                return false;
+        }
+    }
+
+private:
+    struct entry {
+        std::unique_ptr<Job> job;
+        bool done = false;
+        bool ok = false;
+    };
+
+    int threads;
+    work_fn work;
+
+    // The following variables should be guarded by lock
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    std::deque<entry> jobs;
+    size_t next_job;
+    bool stop;
+
+    bool started;
+    std::vector<pthread_t> workers;
+
+    void start_workers() {
+        started = true;
+        for (int i = 0; i < threads; ++i) {
+            pthread_t t;
+            errno = pthread_create(&t, nullptr, worker_loop, this);
+            if (errno) {
+                PLOGE("pthread_create");
+                continue;
+            }
+            workers.push_back(t);
+        }
+    }
+
+    static void *worker_loop(void *arg) {
+        auto self = static_cast<ordered_pool *>(arg);
+        for (;;) {
+            // References to deque elements stay valid when pushing to the back or
+            // popping other elements from the front, and the entry being worked on
+            // is never popped before it is done.
+            entry *e;
+            {
+                mutex_guard g(self->lock);
+                while (self->next_job == self->jobs.size() && !self->stop)
+                    pthread_cond_wait(&self->cond, &self->lock);
+                if (self->stop)
+                    return nullptr;
+                e = &self->jobs[self->next_job++];
+            }
+            bool ok = self->work(*e->job);
+            {
+                mutex_guard g(self->lock);
+                e->ok = ok;
+                e->done = true;
+                pthread_cond_broadcast(&self->cond);
+            }
+        }
+    }
+};
+
+// Block-parallel encoding: the input is split into fixed size blocks, each block is
+// compressed independently on a pool of worker threads, and the encoded blocks are
+// stitched back together in submission order. The output only depends on the block
+// size, so it is identical between runs regardless of scheduling.
+class par_encoder : public chunk_out_stream {
+public:
+    par_encoder(out_strm_ptr &&base, size_t block_sz, int threads, size_t dict_sz = 0) :
+        chunk_out_stream(std::move(base), block_sz),
+        pool(threads, [this](block &b) { return encode_block(b); }),
+        dict_sz(dict_sz), dict(dict_sz), dict_off(0) {}
+
+protected:
+    struct block {
+        // The last dict_sz bytes of preceding input, followed by the actual block data
+        heap_data in;
+        size_t dict_sz;
+        heap_data out;
+
+        // Per-block metadata used by some formats when stitching the stream
+        uint32_t crc = 0;
+        uint64_t unpadded_sz = 0;
+
+        const uint8_t *data() const { return in.buf() + dict_sz; }
+        size_t sz() const { return in.sz() - dict_sz; }
+    };
+
+    // Called on worker threads, must only touch the block itself
+    virtual bool encode_block(block &b) = 0;
+
+    // Called on the writing thread in block order
+    virtual bool commit_block(block &b) {
+        return bwrite(b.out.buf(), b.out.sz());
+    }
+
+    bool write_chunk(const void *buf, size_t len, bool) final {
+        auto b = make_unique<block>();
+        b->dict_sz = dict_off;
+        b->in = heap_data(dict_off + len);
+        memcpy(b->in.buf(), dict.buf(), dict_off);
+        memcpy(b->in.buf() + dict_off, buf, len);
+        update_dict(static_cast<const uint8_t *>(buf), len);
+        pool.submit(std::move(b));
+
+        // Bound the amount of blocks in flight to keep memory usage in check
+        return pool.drain(pool.size() * 2, [this](block &b) { return commit_block(b); });
+    }
+
+    // Classes inheriting this class has to call finalize() in its destructor
+    void finalize() {
+        chunk_out_stream::finalize();
+        bool ok = pool.drain(0, [this](block &b) { return commit_block(b); });
+        // Subclasses are about to be destructed, no more encode_block calls are allowed
+        pool.shutdown();
+        if (!ok) {
+            LOGE("Error in finalize, file truncated\n");
+        }
+    }
+
+private:
+    ordered_pool<block> pool;
+    size_t dict_sz;
+    heap_data dict;
+    size_t dict_off;
+
+    void update_dict(const uint8_t *buf, size_t len) {
+        if (dict_sz == 0)
+            return;
+        if (len >= dict_sz) {
+            memcpy(dict.buf(), buf + len - dict_sz, dict_sz);
+            dict_off = dict_sz;
+        } else {
+            size_t keep = std::min(dict_off, dict_sz - len);
+            memmove(dict.buf(), dict.buf() + dict_off - keep, keep);
+            memcpy(dict.buf() + keep, buf, len);
+            dict_off = keep + len;
+        }
+    }
+};
+
+// A single gzip member where each block is a raw deflate stream primed with the
+// previous 32KB of input and terminated with an empty stored block (sync flush).
+// This is the same layout pigz produces, and is readable by any inflate implementation.
+class gz_par_encoder : public par_encoder {
+public:
+    gz_par_encoder(out_strm_ptr &&base, const encoder_opts &opts, bool zopfli) :
+        par_encoder(std::move(base),
+                    opts.block_sz ? opts.block_sz : (zopfli ? ZOPFLI_MASTER_BLOCK_SIZE : GZ_BLOCK_SZ),
+                    opts.threads, (size_t) 1 << opt_window_bits(opts)),
+        zopfli(zopfli), crc(crc32_z(0L, Z_NULL, 0)), in_total(0),
+        level(zopfli ? opt_level(opts, 1, 1, 15) : opt_level(opts, 9, 0, 9)),
+        window_bits(opt_window_bits(opts)) {
+        // ID1 ID2 CM FLG MTIME(4) XFL OS
+        bwrite("\x1f\x8b\x08\x00\x00\x00\x00\x00\x02\x03", 10);
+    }
+
+    ~gz_par_encoder() override {
+        finalize();
+
+        uint8_t trailer[10] = {
+            // Final empty fixed huffman block
+            0x03, 0x00,
+            /* CRC */
+            (uint8_t) crc, (uint8_t) (crc >> 8), (uint8_t) (crc >> 16), (uint8_t) (crc >> 24),
+            /* ISIZE */
+            (uint8_t) in_total, (uint8_t) (in_total >> 8),
+            (uint8_t) (in_total >> 16), (uint8_t) (in_total >> 24),
+        };
+        bwrite(trailer, sizeof(trailer));
+    }
+
+protected:
+    bool encode_block(block &b) override {
+        b.crc = crc32_z(0L, b.data(), b.sz());
+        return zopfli ? zopfli_block(b) : deflate_block(b);
+    }
+
+    bool commit_block(block &b) override {
+        crc = crc32_combine(crc, b.crc, b.sz());
+        in_total += b.sz();
+        return par_encoder::commit_block(b);
+    }
+
+private:
+    static constexpr size_t GZ_BLOCK_SZ = 1 << 20;
+
+    bool zopfli;
+    unsigned long crc;
+    uint32_t in_total;
+    int level;
+    int window_bits;
+
+    bool deflate_block(block &b) const {
+        z_stream strm{};
+        if (deflateInit2(&strm, level, Z_DEFLATED, -window_bits, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            return false;
+        run_finally end([&] { deflateEnd(&strm); });
+        if (b.dict_sz && deflateSetDictionary(&strm, b.in.buf(), b.dict_sz) != Z_OK)
+            return false;
+        // Extra room for the sync flush marker
+        b.out = heap_data(deflateBound(&strm, b.sz()) + 16);
+        strm.next_in = (Bytef *) b.data();
+        strm.avail_in = b.sz();
+        strm.next_out = b.out.buf();
+        strm.avail_out = b.out.sz();
+        if (deflate(&strm, Z_SYNC_FLUSH) != Z_OK || strm.avail_in != 0) {
+            LOGW("gzip encode failed\n");
+            return false;
+        }
+        b.out = byte_view(b.out.buf(), b.out.sz() - strm.avail_out).clone();
+        return true;
+    }
+
+    bool zopfli_block(block &b) const {
+        ZopfliOptions zo;
+        ZopfliInitOptions(&zo);
+        zo.numiterations = level;
+        zo.blocksplitting = 0;
+
+        unsigned char *out = nullptr;
+        size_t outsize = 0;
+        unsigned char bp = 0;
+        ZopfliDeflatePart(&zo, 2, 0, b.in.buf(), b.dict_sz, b.in.sz(), &bp, &out, &outsize);
+
+        // Append an empty stored block to align the stream to byte boundary:
+        // 3 bits of block header (BFINAL = 0, BTYPE = 00), padding, then LEN/NLEN
+        for (int i = 0; i < 3; ++i) {
+            if (bp == 0)
+                ZOPFLI_APPEND_DATA(0, &out, &outsize);
+            bp = (bp + 1) & 7;
+        }
+        ZOPFLI_APPEND_DATA(0x00, &out, &outsize);
+        ZOPFLI_APPEND_DATA(0x00, &out, &outsize);
+        ZOPFLI_APPEND_DATA(0xff, &out, &outsize);
+        ZOPFLI_APPEND_DATA(0xff, &out, &outsize);
+
+        b.out = byte_view(out, outsize).clone();
+        free(out);
+        return true;
+    }
+};
+
+// A single xz stream with each block as an independent xz block, indexed at the end
+class xz_par_encoder : public par_encoder {
+public:
+    xz_par_encoder(out_strm_ptr &&base, const encoder_opts &opts) :
+        par_encoder(std::move(base), opts.block_sz ? opts.block_sz : XZ_BLOCK_SZ, opts.threads), opts(opts),
+        index(lzma_index_init(nullptr)), flags{ .version = 0, .check = LZMA_CHECK_CRC32 } {
+        uint8_t hdr[LZMA_STREAM_HEADER_SIZE];
+        lzma_stream_header_encode(&flags, hdr);
+        bwrite(hdr, sizeof(hdr));
+    }
+
+    ~xz_par_encoder() override {
+        finalize();
+
+        heap_data idx(lzma_index_size(index));
+        size_t pos = 0;
+        if (lzma_index_buffer_encode(index, idx.buf(), &pos, idx.sz()) != LZMA_OK) {
+            LOGE("LZMA index encode failed\n");
+        }
+        bwrite(idx.buf(), pos);
+
+        uint8_t footer[LZMA_STREAM_HEADER_SIZE];
+        flags.backward_size = lzma_index_size(index);
+        lzma_stream_footer_encode(&flags, footer);
+        bwrite(footer, sizeof(footer));
+
+        lzma_index_end(index, nullptr);
+    }
+
+protected:
+    bool encode_block(block &b) override {
+        lzma_options_lzma opt;
+        opt_lzma(opts, opt);
+        // A dictionary larger than the block is just wasted memory
+        opt.dict_size = std::max<uint32_t>(LZMA_DICT_SIZE_MIN, std::min<size_t>(opt.dict_size, b.sz()));
+        lzma_filter filters[] = {
+            { .id = LZMA_FILTER_LZMA2, .options = &opt },
+            { .id = LZMA_VLI_UNKNOWN, .options = nullptr },
+        };
+        lzma_block blk{};
+        blk.version = 0;
+        blk.check = LZMA_CHECK_CRC32;
+        blk.filters = filters;
+
+        heap_data out(lzma_block_buffer_bound(b.sz()));
+        size_t pos = 0;
+        if (lzma_ret code = lzma_block_buffer_encode(
+                &blk, nullptr, b.data(), b.sz(), out.buf(), &pos, out.sz()); code != LZMA_OK) {
+            LOGW("LZMA encode failed (%d)\n", code);
+            return false;
+        }
+        b.unpadded_sz = lzma_block_unpadded_size(&blk);
+        b.out = byte_view(out.buf(), pos).clone();
+        return true;
+    }
+
+    bool commit_block(block &b) override {
+        if (lzma_index_append(index, nullptr, b.unpadded_sz, b.sz()) != LZMA_OK)
+            return false;
+        return par_encoder::commit_block(b);
+    }
+
+private:
+    static constexpr size_t XZ_BLOCK_SZ = 1 << 23;
+
+    encoder_opts opts;
+    lzma_index *index;
+    lzma_stream_flags flags;
+};
+
+// An LZ4 frame with independent blocks. The content checksum has to be computed
+// sequentially over the whole input, so it is omitted (the flag is cleared in the header).
+class LZ4F_par_encoder : public par_encoder {
+public:
+    LZ4F_par_encoder(out_strm_ptr &&base, const encoder_opts &opts) :
+        par_encoder(std::move(base), std::min(opts.block_sz ? opts.block_sz : BLOCK_SZ, BLOCK_SZ), opts.threads),
+        level(opt_level(opts, 9, 0, LZ4HC_CLEVEL_MAX)) {
+        LZ4F_preferences_t prefs {
+            .frameInfo = {
+                .blockSizeID = LZ4F_max4MB,
+                .blockMode = LZ4F_blockIndependent,
+                .contentChecksumFlag = LZ4F_noContentChecksum,
+                .blockChecksumFlag = LZ4F_noBlockChecksum,
+            },
+            .compressionLevel = level,
+        };
+        LZ4F_compressionContext_t ctx;
+        LZ4F_createCompressionContext(&ctx, LZ4F_VERSION);
+        uint8_t hdr[LZ4F_HEADER_SIZE_MAX];
+        size_t len = LZ4F_compressBegin(ctx, hdr, sizeof(hdr), &prefs);
+        if (LZ4F_isError(len)) {
+            LOGE("LZ4F header error: %s\n", LZ4F_getErrorName(len));
+        } else {
+            bwrite(hdr, len);
+        }
+        LZ4F_freeCompressionContext(ctx);
+    }
+
+    ~LZ4F_par_encoder() override {
+        finalize();
+        // EndMark
+        bwrite("\x00\x00\x00\x00", 4);
+    }
+
+protected:
+    bool encode_block(block &b) override {
+        heap_data out(sizeof(uint32_t) + LZ4_COMPRESSBOUND(b.sz()));
+        auto dest = reinterpret_cast<char *>(out.buf() + sizeof(uint32_t));
+        int len = lz4_compress_block(reinterpret_cast<const char *>(b.data()), dest,
+                                     b.sz(), out.sz() - sizeof(uint32_t), level);
+        uint32_t block_sz;
+        if (len <= 0 || (size_t) len >= b.sz()) {
+            // Incompressible, store the block uncompressed
+            memcpy(dest, b.data(), b.sz());
+            len = b.sz();
+            block_sz = len | 0x80000000;
+        } else {
+            block_sz = len;
+        }
+        memcpy(out.buf(), &block_sz, sizeof(block_sz));
+        b.out = byte_view(out.buf(), sizeof(block_sz) + len).clone();
+        return true;
+    }
+
+private:
+    static constexpr size_t BLOCK_SZ = 1 << 22;
+    int level;
+};
+
+// LZ4 legacy blocks are independent by design, so the output is identical to LZ4_encoder
+class LZ4_par_encoder : public par_encoder {
+public:
+    LZ4_par_encoder(out_strm_ptr &&base, bool lg, const encoder_opts &opts) :
+        par_encoder(std::move(base), std::min(opts.block_sz ? opts.block_sz : LZ4_UNCOMPRESSED, LZ4_UNCOMPRESSED),
+                    opts.threads),
+        lg(lg), in_total(0), level(opt_level(opts, LZ4HC_CLEVEL_MAX, 0, LZ4HC_CLEVEL_MAX)) {
+        bwrite("\x02\x21\x4c\x18", 4);
+    }
+
+    ~LZ4_par_encoder() override {
+        finalize();
+        if (lg)
+            bwrite(&in_total, sizeof(in_total));
+    }
+
+protected:
+    bool encode_block(block &b) override {
+        heap_data out(sizeof(uint32_t) + LZ4_COMPRESSED);
+        uint32_t block_sz = lz4_compress_block(
+                reinterpret_cast<const char *>(b.data()),
+                reinterpret_cast<char *>(out.buf() + sizeof(block_sz)),
+                b.sz(), LZ4_COMPRESSED, level);
+        if (block_sz == 0) {
+            LOGW("LZ4HC compression failure\n");
+            return false;
+        }
+        memcpy(out.buf(), &block_sz, sizeof(block_sz));
+        b.out = byte_view(out.buf(), sizeof(block_sz) + block_sz).clone();
+        return true;
+    }
+
+    bool commit_block(block &b) override {
+        in_total += b.sz();
+        return par_encoder::commit_block(b);
+    }
+
+private:
+    bool lg;
+    uint32_t in_total;
+    int level;
+};
+
+// Parallel decoding: compressed streams made of independently decodable units
+// (gzip members, xz blocks, LZ4 blocks) are split up front, each unit is decoded
+// on a pool of worker threads, and the results are written out in order.
+struct dec_unit {
+    byte_view in;
+    // Exact output size if known from the container, 0 otherwise
+    size_t out_sz = 0;
+    // LZ4 frame blocks may be stored uncompressed
+    bool stored = false;
+    heap_data out;
 };
 
-out_strm_ptr get_encoder(format_t type, out_strm_ptr &&base) {
+using dec_units = vector<unique_ptr<dec_unit>>;
+
+static void add_unit(dec_units &units, const uint8_t *buf, size_t sz, size_t out_sz = 0) {
+    auto u = make_unique<dec_unit>();
+    u->in = byte_view(buf, sz);
+    u->out_sz = out_sz;
+    units.push_back(std::move(u));
+}
+
+// Multi-member gzip (pigz --independent, concatenated files, etc.) is split at
+// every plausible member header. A false positive is harmless: the unit before
+// it fails to reach the end of its member, and decoding falls back to serial.
+static bool split_gz(byte_view in, dec_units &units) {
+    const uint8_t *buf = in.buf();
+    size_t sz = in.sz();
+    size_t start = 0;
+    for (size_t off = 1; off + 10 <= sz; ++off) {
+        auto p = static_cast<const uint8_t *>(memmem(buf + off, sz - off, "\x1f\x8b\x08", 3));
+        if (p == nullptr)
+            break;
+        off = p - buf;
+        // Reserved flag bits must be zero, XFL and OS have a small set of valid values
+        if (off + 10 > sz || (p[3] & 0xe0) || (p[8] != 0 && p[8] != 2 && p[8] != 4) ||
+            (p[9] > 13 && p[9] != 255))
+            continue;
+        add_unit(units, buf + start, off - start);
+        start = off;
+    }
+    add_unit(units, buf + start, sz - start);
+    return units.size() > 1;
+}
+
+static bool decode_gz(dec_unit &u, bool last) {
+    z_stream strm{};
+    if (inflateInit2(&strm, 15 | 16) != Z_OK)
+        return false;
+    run_finally cleanup([&] { inflateEnd(&strm); });
+
+    byte_channel ch(u.out);
+    uint8_t outbuf[CHUNK];
+    strm.next_in = const_cast<uint8_t *>(u.in.buf());
+    strm.avail_in = u.in.sz();
+    int ret;
+    do {
+        strm.next_out = outbuf;
+        strm.avail_out = sizeof(outbuf);
+        ret = inflate(&strm, Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END)
+            return false;
+        ch.write(outbuf, sizeof(outbuf) - strm.avail_out);
+    } while (ret != Z_STREAM_END && strm.avail_out == 0);
+    u.out_sz = u.out.sz();
+    // Every member except the last has to span exactly until the next header,
+    // trailing garbage after the last member is ignored like the serial decoder does.
+    return ret == Z_STREAM_END && (last || strm.avail_in == 0);
+}
+
+// Decode the index of a single stream xz file, nullptr if the layout is not recognized.
+// Concatenated streams are not handled and left to the serial decoder.
+static lzma_index *decode_xz_index(byte_view in, lzma_check *check = nullptr) {
+    const uint8_t *buf = in.buf();
+    size_t sz = in.sz();
+    // Skip stream padding
+    while (sz >= 4 && memcmp(buf + sz - 4, "\0\0\0\0", 4) == 0)
+        sz -= 4;
+    if (sz < 2 * LZMA_STREAM_HEADER_SIZE)
+        return nullptr;
+
+    lzma_stream_flags header, footer;
+    if (lzma_stream_header_decode(&header, buf) != LZMA_OK ||
+        lzma_stream_footer_decode(&footer, buf + sz - LZMA_STREAM_HEADER_SIZE) != LZMA_OK ||
+        lzma_stream_flags_compare(&header, &footer) != LZMA_OK)
+        return nullptr;
+    if (footer.backward_size > sz - 2 * LZMA_STREAM_HEADER_SIZE)
+        return nullptr;
+
+    lzma_index *idx = nullptr;
+    uint64_t memlimit = UINT64_MAX;
+    size_t pos = sz - LZMA_STREAM_HEADER_SIZE - footer.backward_size;
+    if (lzma_index_buffer_decode(&idx, &memlimit, nullptr, buf, &pos,
+                                 sz - LZMA_STREAM_HEADER_SIZE) != LZMA_OK)
+        return nullptr;
+    if (lzma_index_file_size(idx) != sz) {
+        lzma_index_end(idx, nullptr);
+        return nullptr;
+    }
+    if (check)
+        *check = header.check;
+    return idx;
+}
+
+// Single stream xz files with more than one block (xz -T, our own block-parallel
+// encoder): the stream index gives the exact offset and size of every block.
+static bool split_xz(byte_view in, dec_units &units, lzma_check &check) {
+    lzma_index *idx = decode_xz_index(in, &check);
+    if (idx == nullptr)
+        return false;
+    run_finally cleanup([&] { lzma_index_end(idx, nullptr); });
+
+    if (lzma_index_block_count(idx) < 2)
+        return false;
+
+    lzma_index_iter iter;
+    lzma_index_iter_init(&iter, idx);
+    while (!lzma_index_iter_next(&iter, LZMA_INDEX_ITER_BLOCK)) {
+        add_unit(units, in.buf() + iter.block.compressed_file_offset,
+                 iter.block.total_size, iter.block.uncompressed_size);
+    }
+    return true;
+}
+
+static bool decode_xz(dec_unit &u, lzma_check check) {
+    lzma_filter filters[LZMA_FILTERS_MAX + 1];
+    lzma_block block{};
+    block.version = 0;
+    block.check = check;
+    block.filters = filters;
+    block.header_size = lzma_block_header_size_decode(u.in.buf()[0]);
+    if (block.header_size > u.in.sz() ||
+        lzma_block_header_decode(&block, nullptr, u.in.buf()) != LZMA_OK)
+        return false;
+    run_finally cleanup([&] {
+        for (int i = 0; filters[i].id != LZMA_VLI_UNKNOWN; ++i)
+            free(filters[i].options);
+    });
+
+    u.out = heap_data(u.out_sz);
+    size_t in_pos = block.header_size;
+    size_t out_pos = 0;
+    lzma_ret ret = lzma_block_buffer_decode(&block, nullptr, u.in.buf(), &in_pos, u.in.sz(),
+                                            u.out.buf(), &out_pos, u.out.sz());
+    if (ret != LZMA_OK) {
+        LOGW("LZMA block decoding error: %d\n", ret);
+        return false;
+    }
+    return out_pos == u.out_sz;
+}
+
+// LZ4 legacy: a sequence of size prefixed blocks, each at most LZ4_UNCOMPRESSED.
+// The magic may reappear between blocks, and lz4_lg ends with the total input size.
+static bool split_lz4_legacy(byte_view in, dec_units &units) {
+    const uint8_t *buf = in.buf();
+    size_t sz = in.sz();
+    size_t pos = 0;
+    uint32_t block_sz;
+    while (pos + sizeof(block_sz) <= sz) {
+        memcpy(&block_sz, buf + pos, sizeof(block_sz));
+        pos += sizeof(block_sz);
+        if (block_sz == 0x184C2102)
+            continue;
+        if (block_sz > sz - pos)
+            break;
+        add_unit(units, buf + pos, block_sz);
+        pos += block_sz;
+    }
+    return units.size() > 1;
+}
+
+// LZ4 frame: only frames with independent blocks and no checksums can be split
+static bool split_lz4f(byte_view in, dec_units &units, size_t &block_max) {
+    const uint8_t *buf = in.buf();
+    size_t sz = in.sz();
+    if (sz < 7 || memcmp(buf, LZ42_MAGIC, 4) != 0)
+        return false;
+    uint8_t flg = buf[4];
+    uint8_t bd = buf[5];
+    // Version 01, block independence set, no block checksum, no content checksum, no dict id
+    if ((flg & 0xc0) != 0x40 || (flg & 0x35) != 0x20)
+        return false;
+    int block_id = (bd >> 4) & 0x7;
+    if (block_id < 4)
+        return false;
+    block_max = 1 << (8 + 2 * block_id);
+
+    size_t pos = 6 + ((flg & 0x08) ? 8 : 0) + 1;
+    uint32_t block_sz;
+    for (;;) {
+        if (pos + sizeof(block_sz) > sz)
+            return false;
+        memcpy(&block_sz, buf + pos, sizeof(block_sz));
+        pos += sizeof(block_sz);
+        if (block_sz == 0)
+            break;
+        bool stored = block_sz & 0x80000000U;
+        block_sz &= 0x7FFFFFFFU;
+        if (block_sz > sz - pos || block_sz > block_max)
+            return false;
+        add_unit(units, buf + pos, block_sz);
+        units.back()->stored = stored;
+        pos += block_sz;
+    }
+    // Concatenated frames are left to the serial decoder
+    return pos == sz && units.size() > 1;
+}
+
+static bool decode_lz4(dec_unit &u, size_t block_max) {
+    if (u.stored) {
+        u.out = u.in.clone();
+        u.out_sz = u.out.sz();
+        return true;
+    }
+    u.out = heap_data(block_max);
+    int r = LZ4_decompress_safe(reinterpret_cast<const char *>(u.in.buf()),
+                                reinterpret_cast<char *>(u.out.buf()), u.in.sz(), block_max);
+    if (r < 0) {
+        LOGW("LZ4HC decompression failure (%d)\n", r);
+        return false;
+    }
+    u.out_sz = r;
+    return true;
+}
+
+bool par_splittable(format_t type) {
+    switch (type) {
+        case GZIP:
+        case ZOPFLI:
+        case XZ:
+        case LZ4:
+        case LZ4_LEGACY:
+        case LZ4_LG:
+            return true;
+        default:
+            return false;
+    }
+}
+
+ssize_t par_decode(format_t type, byte_view in, out_stream &out, int threads) {
+    if (threads <= 1)
+        return 0;
+
+    dec_units units;
+    lzma_check check = LZMA_CHECK_NONE;
+    size_t block_max = LZ4_UNCOMPRESSED;
+    bool split;
+    switch (type) {
+        case GZIP:
+        case ZOPFLI:
+            split = split_gz(in, units);
+            break;
+        case XZ:
+            split = split_xz(in, units, check);
+            break;
+        case LZ4_LEGACY:
+        case LZ4_LG:
+            split = split_lz4_legacy(in, units);
+            break;
+        case LZ4:
+            split = split_lz4f(in, units, block_max);
+            break;
+        default:
+            split = false;
+            break;
+    }
+    if (!split)
+        return 0;
+
+    const dec_unit *last = units.back().get();
+    ordered_pool<dec_unit> pool(threads, [&](dec_unit &u) -> bool {
+        switch (type) {
+            case XZ:
+                return decode_xz(u, check);
+            case LZ4:
+            case LZ4_LEGACY:
+            case LZ4_LG:
+                return decode_lz4(u, block_max);
+            default:
+                return decode_gz(u, &u == last);
+        }
+    });
+
+    // Bound the amount of decoded units held in memory
+    size_t done = 0;
+    size_t consumed = 0;
+    bool ok = true;
+    auto consume = [&](dec_unit &u) -> bool {
+        if (!out.write(u.out.buf(), u.out_sz))
+            return false;
+        done += u.in.sz();
+        ++consumed;
+        return true;
+    };
+    for (auto &u : units) {
+        pool.submit(std::move(u));
+        if (!(ok = pool.drain(pool.size() * 2, consume)))
+            break;
+    }
+    if (ok)
+        ok = pool.drain(0, consume);
+    pool.shutdown();
+
+    if (!ok) {
+        // Members before the failed one are complete and already written out,
+        // let the serial decoder continue from there.
+        if (type == GZIP || type == ZOPFLI)
+            return done;
+        return -1;
+    }
+    return in.sz();
+}
+
+// Decoder output going straight into a shared writable mapping of a newly created,
+// empty file. The file is pre-sized from the container metadata when available,
+// and grown with mremap otherwise. Blocks are allocated with posix_fallocate before
+// they are mapped, so a full filesystem fails the allocation instead of faulting
+// with SIGBUS. If the file cannot grow that way, the rest of the output is staged
+// in memory and written with write(). On destruction, the file is trimmed to the
+// actual amount of data written.
+class mmap_out_stream : public out_stream {
+public:
+    // A non-zero hint is the exact size recorded in the container
+    mmap_out_stream(int fd, size_t hint, size_t guess, out_stream *tee) :
+        fd(fd), tee(tee), map(nullptr), cap(0), pos(0), exact(hint != 0), failed(false) {
+        if (!grow(hint ? hint : guess))
+            ftruncate(fd, 0);
+    }
+
+    ~mmap_out_stream() override {
+        if (map) {
+            munmap(map, cap);
+            ftruncate(fd, pos);
+        }
+    }
+
+    bool ok() const { return map != nullptr; }
+
+    // Make sure at least len bytes are available at the current position
+    uint8_t *reserve(size_t len) {
+        if (map && cap - pos < len) {
+            // Past an exact size only the tail of the last reserve is missing, after
+            // that the size was wrong and growing exponentially is cheaper
+            size_t sz = exact ? pos + len : std::max(cap * 2, pos + len);
+            exact = false;
+            if (!grow(sz))
+                unmap();
+        }
+        if (map)
+            return map + pos;
+        if (failed)
+            return nullptr;
+        if (stage.sz() < len)
+            stage = heap_data(len);
+        return stage.buf();
+    }
+    size_t avail() const { return map ? cap - pos : stage.sz(); }
+    void commit(size_t len) {
+        if (map) {
+            if (tee) tee->write(map + pos, len);
+            pos += len;
+        } else if (len) {
+            if (tee) tee->write(stage.buf(), len);
+            if (xwrite(fd, stage.buf(), len) != (ssize_t) len)
+                failed = true;
+        }
+    }
+
+    bool write(const void *buf, size_t len) override {
+        if (map == nullptr) {
+            if (tee) tee->write(buf, len);
+            return !failed && xwrite(fd, buf, len) == (ssize_t) len;
+        }
+        auto p = reserve(len);
+        if (p == nullptr)
+            return false;
+        memcpy(p, buf, len);
+        commit(len);
+        return true;
+    }
+
+private:
+    int fd;
+    out_stream *tee;
+    uint8_t *map;
+    size_t cap;
+    size_t pos;
+    bool exact;
+    bool failed;
+    heap_data stage;
+
+    bool grow(size_t sz) {
+        sz = align_to(std::max(sz, CHUNK), getpagesize());
+        if (int err = posix_fallocate(fd, 0, sz)) {
+            LOGW("Cannot allocate output with %d: %s\n", err, std::strerror(err));
+            return false;
+        }
+        void *p = map ? mremap(map, cap, sz, MREMAP_MAYMOVE)
+                      : mmap(nullptr, sz, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED) {
+            LOGW("mmap output failed with %d: %s\n", errno, std::strerror(errno));
+            return false;
+        }
+        map = static_cast<uint8_t *>(p);
+        cap = sz;
+        return true;
+    }
+
+    // Keep what is already mapped, and continue with write() from there
+    void unmap() {
+        munmap(map, cap);
+        map = nullptr;
+        if (ftruncate(fd, pos) < 0 || lseek(fd, pos, SEEK_SET) < 0)
+            failed = true;
+    }
+};
+
+// Decompressed size recorded in the container, 0 if unknown or implausible
+static size_t decoded_size_hint(format_t type, byte_view in) {
+    const uint8_t *buf = in.buf();
+    size_t sz = in.sz();
+    size_t hint = 0;
+    switch (type) {
+        case GZIP:
+        case ZOPFLI:
+            // ISIZE of the last member, only correct for single member files < 4GB
+            if (sz >= 18) {
+                uint32_t isize;
+                memcpy(&isize, buf + sz - 4, sizeof(isize));
+                hint = isize;
+            }
+            break;
+        case XZ:
+            if (lzma_index *idx = decode_xz_index(in)) {
+                hint = lzma_index_uncompressed_size(idx);
+                lzma_index_end(idx, nullptr);
+            }
+            break;
+        case LZ4:
+            // Content size is optional in the frame descriptor
+            if (sz >= 14 && memcmp(buf, LZ42_MAGIC, 4) == 0 && (buf[4] & 0x08)) {
+                uint64_t content_sz;
+                memcpy(&content_sz, buf + 6, sizeof(content_sz));
+                hint = content_sz;
+            }
+            break;
+        case LZ4_LG:
+            // The total uncompressed size is appended at the end
+            if (sz >= 8) {
+                uint32_t total;
+                memcpy(&total, buf + sz - 4, sizeof(total));
+                hint = total;
+            }
+            break;
+        default:
+            break;
+    }
+    // Reject hints that cannot possibly be right (garbage trailers, etc.)
+    if (hint / 1032 > sz)
+        hint = 0;
+    return hint;
+}
+
+static bool gz_decode(byte_view in, mmap_out_stream &out) {
+    z_stream strm{};
+    if (inflateInit2(&strm, 15 | 16) != Z_OK)
+        return false;
+    run_finally cleanup([&] { inflateEnd(&strm); });
+
+    strm.next_in = const_cast<uint8_t *>(in.buf());
+    strm.avail_in = in.sz();
+    for (;;) {
+        if ((strm.next_out = out.reserve(CHUNK)) == nullptr)
+            return false;
+        strm.avail_out = std::min(out.avail(), (size_t) UINT32_MAX);
+        size_t avail = strm.avail_out;
+        int code = inflate(&strm, Z_NO_FLUSH);
+        out.commit(avail - strm.avail_out);
+        if (code == Z_STREAM_END) {
+            // Concatenated members, anything else after a member is ignored
+            if (strm.avail_in > 1 && strm.next_in[0] == 0x1f && strm.next_in[1] == 0x8b) {
+                inflateReset(&strm);
+                continue;
+            }
+            return true;
+        }
+        if (code != Z_OK && code != Z_BUF_ERROR) {
+            LOGW("gzip decode failed (%d)\n", code);
+            return false;
+        }
+        // Truncated input, keep what has been decoded so far
+        if (strm.avail_in == 0 && strm.avail_out != 0)
+            return true;
+    }
+}
+
+static bool lzma_decode(byte_view in, mmap_out_stream &out) {
+    lzma_stream strm = LZMA_STREAM_INIT;
+    if (lzma_auto_decoder(&strm, UINT64_MAX, 0) != LZMA_OK)
+        return false;
+    run_finally cleanup([&] { lzma_end(&strm); });
+
+    strm.next_in = in.buf();
+    strm.avail_in = in.sz();
+    for (;;) {
+        if ((strm.next_out = out.reserve(CHUNK)) == nullptr)
+            return false;
+        strm.avail_out = out.avail();
+        lzma_ret code = lzma_code(&strm, LZMA_FINISH);
+        out.commit(out.avail() - strm.avail_out);
+        if (code == LZMA_STREAM_END)
+            return true;
+        if (code != LZMA_OK) {
+            LOGW("LZMA decode failed (%d)\n", code);
+            return false;
+        }
+    }
+}
+
+static bool bz_decode(byte_view in, mmap_out_stream &out) {
+    bz_stream strm{};
+    if (BZ2_bzDecompressInit(&strm, 0, 0) != BZ_OK)
+        return false;
+    run_finally cleanup([&] { BZ2_bzDecompressEnd(&strm); });
+
+    strm.next_in = (char *) in.buf();
+    strm.avail_in = in.sz();
+    for (;;) {
+        if ((strm.next_out = (char *) out.reserve(CHUNK)) == nullptr)
+            return false;
+        strm.avail_out = std::min(out.avail(), (size_t) UINT32_MAX);
+        size_t avail = strm.avail_out;
+        int code = BZ2_bzDecompress(&strm);
+        out.commit(avail - strm.avail_out);
+        if (code == BZ_STREAM_END)
+            return true;
+        if (code < 0) {
+            LOGW("bzip2 decode failed (%d)\n", code);
+            return false;
+        }
+        if (strm.avail_in == 0 && strm.avail_out != 0)
+            return true;
+    }
+}
+
+static bool lz4_legacy_decode(byte_view in, mmap_out_stream &out) {
+    const uint8_t *buf = in.buf();
+    size_t sz = in.sz();
+    size_t pos = 0;
+    uint32_t block_sz;
+    while (pos + sizeof(block_sz) <= sz) {
+        memcpy(&block_sz, buf + pos, sizeof(block_sz));
+        pos += sizeof(block_sz);
+        if (block_sz == 0x184C2102)
+            continue;
+        // lz4_lg ends with the total input size, which is not a block
+        if (block_sz > sz - pos)
+            break;
+        auto p = out.reserve(LZ4_UNCOMPRESSED);
+        if (p == nullptr)
+            return false;
+        int r = LZ4_decompress_safe(reinterpret_cast<const char *>(buf + pos),
+                                    reinterpret_cast<char *>(p), block_sz, LZ4_UNCOMPRESSED);
+        if (r < 0) {
+            LOGW("LZ4HC decompression failure (%d)\n", r);
+            return false;
+        }
+        out.commit(r);
+        pos += block_sz;
+    }
+    return true;
+}
+
+static bool lz4f_decode(byte_view in, mmap_out_stream &out) {
+    LZ4F_decompressionContext_t ctx;
+    if (LZ4F_isError(LZ4F_createDecompressionContext(&ctx, LZ4F_VERSION)))
+        return false;
+    run_finally cleanup([&] { LZ4F_freeDecompressionContext(ctx); });
+
+    const uint8_t *src = in.buf();
+    size_t len = in.sz();
+    size_t read, write;
+    do {
+        auto p = out.reserve(CHUNK);
+        if (p == nullptr)
+            return false;
+        read = len;
+        write = out.avail();
+        size_t code = LZ4F_decompress(ctx, p, &write, src, &read, nullptr);
+        if (LZ4F_isError(code)) {
+            LOGW("LZ4F decode error: %s\n", LZ4F_getErrorName(code));
+            return false;
+        }
+        out.commit(write);
+        src += read;
+        len -= read;
+    } while (len != 0 || write != 0);
+    return true;
+}
+
+static bool decode_direct(format_t type, byte_view in, mmap_out_stream &out) {
     switch (type) {
         case XZ:
-            return make_unique<xz_encoder>(std::move(base));
         case LZMA:
-            return make_unique<lzma_encoder>(std::move(base));
+            return lzma_decode(in, out);
         case BZIP2:
-            return make_unique<bz_encoder>(std::move(base));
+            return bz_decode(in, out);
         case LZ4:
-            return make_unique<LZ4F_encoder>(std::move(base));
+            return lz4f_decode(in, out);
         case LZ4_LEGACY:
-            return make_unique<LZ4_encoder>(std::move(base), false);
         case LZ4_LG:
-            return make_unique<LZ4_encoder>(std::move(base), true);
+            return lz4_legacy_decode(in, out);
         case ZOPFLI:
-            return make_unique<zopfli_encoder>(std::move(base));
         case GZIP:
         default:
-            return make_unique<gz_encoder>(std::move(base));
+            return gz_decode(in, out);
+    }
+}
+
+// The mapping writes from offset 0 and sizes the file, so only use it for an empty
+// regular file just created by the caller, never to append to existing content.
+// A shared writable mapping also requires the file to be opened for reading.
+static bool can_map_output(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode) || st.st_size != 0)
+        return false;
+    int flags = fcntl(fd, F_GETFL);
+    return flags >= 0 && (flags & O_ACCMODE) == O_RDWR && !(flags & O_APPEND) &&
+            lseek(fd, 0, SEEK_CUR) == 0;
+}
+
+// Copies everything written to a second stream
+class tee_out_stream : public filter_out_stream {
+public:
+    tee_out_stream(out_strm_ptr &&base, out_stream *tee) :
+        filter_out_stream(std::move(base)), tee(tee) {}
+
+    bool write(const void *buf, size_t len) override {
+        tee->write(buf, len);
+        return base->write(buf, len);
+    }
+
+private:
+    out_stream *tee;
+};
+
+bool decompress(format_t type, byte_view in, int fd, out_stream *tee) {
+    if (can_map_output(fd)) {
+        mmap_out_stream out(fd, decoded_size_hint(type, in), in.sz() * 4, tee);
+        if (out.ok()) {
+            ssize_t n = par_decode(type, in, out, decompress_threads());
+            if (n < 0)
+                return false;
+            if ((size_t) n == in.sz())
+                return true;
+            return decode_direct(type, byte_view(in.buf() + n, in.sz() - n), out);
+        }
+    }
+    // Not something we can map, go through write()
+    out_strm_ptr out = make_unique<fd_channel>(fd);
+    if (tee)
+        out = make_unique<tee_out_stream>(std::move(out), tee);
+    ssize_t n = par_decode(type, in, *out, decompress_threads());
+    if (n < 0)
+        return false;
+    if ((size_t) n == in.sz())
+        return true;
+    auto strm = get_decoder(type, std::move(out));
+    return strm->write(in.buf() + n, in.sz() - n);
+}
+
+static int compress_threads() {
+    const char *val = getenv("COMPRESSTHREADS");
+    if (val == nullptr)
+        return 1;
+    int threads = parse_int(val);
+    if (threads == 0)
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    return threads > 0 ? threads : 1;
+}
+
+int decompress_threads() {
+    // Decoding output does not depend on the thread count, use all cores by default
+    if (getenv("COMPRESSTHREADS") == nullptr)
+        return sysconf(_SC_NPROCESSORS_ONLN);
+    return compress_threads();
+}
+
+// A byte count with an optional k/m/g suffix, 0 if invalid
+static size_t parse_size(string_view s) {
+    size_t shift = 0;
+    if (!s.empty()) {
+        switch (s.back()) {
+            case 'k': case 'K': shift = 10; break;
+            case 'm': case 'M': shift = 20; break;
+            case 'g': case 'G': shift = 30; break;
+        }
+        if (shift)
+            s.remove_suffix(1);
+    }
+    int val = parse_int(s);
+    return val > 0 ? (size_t) val << shift : 0;
+}
+
+static size_t env_size(const char *name) {
+    const char *val = getenv(name);
+    if (val == nullptr)
+        return 0;
+    size_t sz = parse_size(val);
+    if (sz == 0)
+        LOGE("Invalid %s: [%s]\n", name, val);
+    return sz;
+}
+
+bool env_encoder_opts_set() {
+    return getenv("COMPRESSLEVEL") || getenv("COMPRESSTHREADS") ||
+           getenv("COMPRESSWINDOW") || getenv("COMPRESSBLOCK");
+}
+
+encoder_opts env_encoder_opts() {
+    encoder_opts opts;
+    if (const char *val = getenv("COMPRESSLEVEL")) {
+        // The format is not known here, only reject what no format accepts
+        opts.level = parse_int(val);
+        if (opts.level < 0 || opts.level > 15)
+            LOGE("Invalid COMPRESSLEVEL: [%s]\n", val);
+    }
+    opts.dict_sz = env_size("COMPRESSWINDOW");
+    opts.block_sz = env_size("COMPRESSBLOCK");
+    opts.threads = compress_threads();
+    return opts;
+}
+
+out_strm_ptr get_encoder(format_t type, out_strm_ptr &&base, const encoder_opts &opts) {
+    if (opts.threads > 1) {
+        switch (type) {
+            case XZ:
+                return make_unique<xz_par_encoder>(std::move(base), opts);
+            case LZ4:
+                return make_unique<LZ4F_par_encoder>(std::move(base), opts);
+            case LZ4_LEGACY:
+                return make_unique<LZ4_par_encoder>(std::move(base), false, opts);
+            case LZ4_LG:
+                return make_unique<LZ4_par_encoder>(std::move(base), true, opts);
+            case ZOPFLI:
+                return make_unique<gz_par_encoder>(std::move(base), opts, true);
+            case GZIP:
+                return make_unique<gz_par_encoder>(std::move(base), opts, false);
+            default:
+                // No block-parallel mode for this format
+                break;
+        }
+    }
+    switch (type) {
+        case XZ:
+            return make_unique<xz_encoder>(std::move(base), opts);
+        case LZMA:
+            return make_unique<lzma_encoder>(std::move(base), opts);
+        case BZIP2:
+            return make_unique<bz_encoder>(std::move(base), opts);
+        case LZ4:
+            return make_unique<LZ4F_encoder>(std::move(base), opts);
+        case LZ4_LEGACY:
+            return make_unique<LZ4_encoder>(std::move(base), false, opts);
+        case LZ4_LG:
+            return make_unique<LZ4_encoder>(std::move(base), true, opts);
+        case ZOPFLI:
+            return make_unique<zopfli_encoder>(std::move(base), opts);
+        case GZIP:
+        default:
+            return make_unique<gz_encoder>(std::move(base), opts);
     }
 }
 
@@ -660,9 +1947,26 @@ void decompress(char *infile, const char *outfile) {
                 }
             }
 
-            FILE *out_fp = outfile == "-"sv ? stdout : xfopen(outfile, "we");
-            strm = get_decoder(type, make_unique<fp_channel>(out_fp));
+            // Opened for reading as well, so the file can be mapped
+            FILE *out_fp = outfile == "-"sv ? stdout : xfopen(outfile, "w+e");
             if (ext) *ext = '.';
+
+            // Only a mapped regular file can be split into members/blocks up front,
+            // anything else (pipes, unsplittable formats) is decoded as a stream
+            struct stat st;
+            if (!in_std && par_splittable(type) && decompress_threads() > 1 &&
+                fstat(fileno(in_fp), &st) == 0 && S_ISREG(st.st_mode)) {
+                bool ok;
+                {
+                    mmap_data in(infile);
+                    ok = decompress(type, in, fileno(out_fp));
+                }
+                fclose(out_fp);
+                if (!ok)
+                    LOGE("Decompression error!\n");
+                break;
+            }
+            strm = get_decoder(type, make_unique<fp_channel>(out_fp));
         }
         if (!strm->write(buf, len))
             LOGE("Decompression error!\n");
@@ -676,9 +1980,39 @@ void decompress(char *infile, const char *outfile) {
 }
 
 void compress(const char *method, const char *infile, const char *outfile) {
-    format_t fmt = name2fmt[method];
+    // <format>[:<level>[:<window>[:<block>]]], empty fields keep the defaults
+    string_view name(method);
+    encoder_opts opts = env_encoder_opts();
+    if (auto colon = name.find(':'); colon != string_view::npos) {
+        string_view args = name.substr(colon + 1);
+        name = name.substr(0, colon);
+        for (int i = 0; i < 3; ++i) {
+            auto next = args.find(':');
+            string_view field = args.substr(0, next);
+            if (!field.empty()) {
+                if (i == 0) {
+                    opts.level = parse_int(field);
+                    if (opts.level < 0)
+                        LOGE("Invalid compression level: [%s]\n", method);
+                } else {
+                    size_t sz = parse_size(field);
+                    if (sz == 0)
+                        LOGE("Invalid %s size: [%s]\n", i == 1 ? "window" : "block", method);
+                    (i == 1 ? opts.dict_sz : opts.block_sz) = sz;
+                }
+            }
+            if (next == string_view::npos)
+                break;
+            args = args.substr(next + 1);
+            if (i == 2)
+                LOGE("Invalid compression method: [%s]\n", method);
+        }
+    }
+    format_t fmt = name2fmt[name];
     if (fmt == UNKNOWN)
         LOGE("Unknown compression method: [%s]\n", method);
+    if (opts.level >= 0 && !level_valid(fmt, opts.level))
+        LOGE("Invalid compression level for %s: [%d]\n", fmt2name[fmt], opts.level);
 
     bool in_std = infile == "-"sv;
     bool rm_in = false;
@@ -702,7 +2036,7 @@ void compress(const char *method, const char *infile, const char *outfile) {
         out_fp = outfile == "-"sv ? stdout : xfopen(outfile, "we");
     }
 
-    auto strm = get_encoder(fmt, make_unique<fp_channel>(out_fp));
+    auto strm = get_encoder(fmt, make_unique<fp_channel>(out_fp), opts);
 
     char buf[4096];
     size_t len;
@@ -726,13 +2060,53 @@ bool decompress(rust::Slice<const uint8_t> buf, int fd) {
         return false;
     }
 
+    fd_channel ch(fd);
+    ssize_t n = par_decode(type, buf, ch, decompress_threads());
+    if (n < 0)
+        return false;
+    if ((size_t) n == buf.length())
+        return true;
     auto strm = get_decoder(type, make_unique<fd_channel>(fd));
+    if (!strm->write(buf.data() + n, buf.length() - n)) {
+        return false;
+    }
+    return true;
+}
+
+// Single threaded, as callers already decode independent buffers in parallel
+bool decompress_to_vec(rust::Slice<const uint8_t> buf, rust::Vec<uint8_t> &out) {
+    format_t type = check_fmt(buf.data(), buf.length());
+
+    if (!COMPRESSED(type)) {
+        LOGE("Input file is not a supported compression format!\n");
+        return false;
+    }
+
+    auto strm = get_decoder(type, make_unique<rust_vec_channel>(out));
     if (!strm->write(buf.data(), buf.length())) {
         return false;
     }
     return true;
 }
 
+rust::Str compress_format(rust::Slice<const uint8_t> buf) {
+    format_t type = check_fmt(buf.data(), buf.length());
+    return COMPRESSED(type) ? fmt2name[type] : "";
+}
+
+bool stream_encoder::write(rust::Slice<const uint8_t> buf) {
+    return strm->write(buf.data(), buf.length());
+}
+
+std::unique_ptr<stream_encoder> get_fd_encoder(rust::Str format, int fd) {
+    format_t type = name2fmt[string_view(format.data(), format.size())];
+    if (!COMPRESSED(type))
+        return nullptr;
+    auto enc = make_unique<stream_encoder>();
+    enc->strm = get_encoder(type, make_unique<fd_channel>(fd), env_encoder_opts());
+    return enc;
+}
+
 bool xz(rust::Slice<const uint8_t> buf, rust::Vec<uint8_t> &out) {
     auto strm = get_encoder(XZ, make_unique<rust_vec_channel>(out));
     if (!strm->write(buf.data(), buf.length())) {
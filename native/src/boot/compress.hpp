@@ -5,10 +5,46 @@
 
 #include "format.hpp"
 
-out_strm_ptr get_encoder(format_t type, out_strm_ptr &&base);
+struct encoder_opts {
+    // Format specific level, negative to use the default (best) level.
+    // gzip: 0-9, zopfli: iterations 1-15, xz/lzma: preset 0-9, bzip2: 1-9,
+    // lz4: 0-12, lz4_legacy/lz4_lg: 0-12 (< 3 uses the fast compressor)
+    int level = -1;
+    // Window (gzip) or dictionary (xz/lzma) size, 0 to use the default
+    size_t dict_sz = 0;
+    // Block size in block-parallel mode, 0 to use the format default
+    size_t block_sz = 0;
+    int threads = 1;
+};
+
+// Options from env variables COMPRESSLEVEL, COMPRESSWINDOW, COMPRESSBLOCK and COMPRESSTHREADS
+encoder_opts env_encoder_opts();
+// Whether any of the env variables above is set
+bool env_encoder_opts_set();
+int decompress_threads();
+out_strm_ptr get_encoder(format_t type, out_strm_ptr &&base, const encoder_opts &opts = {});
 out_strm_ptr get_decoder(format_t type, out_strm_ptr &&base);
+// Whether par_decode can split the format into independently decodable units
+bool par_splittable(format_t type);
+// Decode independent members/blocks of buf concurrently. Returns how many bytes of
+// input were decoded, the rest (if any) has to go through the serial decoder.
+ssize_t par_decode(format_t type, byte_view buf, out_stream &out, int threads);
 void compress(const char *method, const char *infile, const char *outfile);
 void decompress(char *infile, const char *outfile);
 bool decompress(rust::Slice<const uint8_t> buf, int fd);
+bool decompress_to_vec(rust::Slice<const uint8_t> buf, rust::Vec<uint8_t> &out);
+// Name of the compression format of buf, empty if buf is not compressed
+rust::Str compress_format(rust::Slice<const uint8_t> buf);
+// Decompress into fd, an empty regular file just created is mapped and decoded in place.
+// All decoded data is also written to tee, if set.
+bool decompress(format_t type, byte_view buf, int fd, out_stream *tee = nullptr);
 bool xz(rust::Slice<const uint8_t> buf, rust::Vec<uint8_t> &out);
 bool unxz(rust::Slice<const uint8_t> buf, rust::Vec<uint8_t> &out);
+
+// An encoder writing into fd, for Rust code to stream into
+struct stream_encoder {
+    out_strm_ptr strm;
+    bool write(rust::Slice<const uint8_t> buf);
+};
+// nullptr if format is not a supported compression format
+std::unique_ptr<stream_encoder> get_fd_encoder(rust::Str format, int fd);
@@ -1,34 +1,52 @@
 #![allow(clippy::useless_conversion)]
 
-use std::collections::BTreeMap;
+use std::borrow::Borrow;
+use std::cmp::Ordering;
+use std::collections::{BTreeMap, HashMap};
+use std::ffi::{CString, OsString};
 use std::fmt::{Display, Formatter};
-use std::fs::{metadata, read, DirBuilder, File};
-use std::io::Write;
+use std::fs::{
+    metadata, read, read_to_string, remove_file, rename, DirBuilder, File, OpenOptions, Permissions,
+};
+use std::io::{self, IoSlice, Write};
 use std::mem::size_of;
-use std::os::unix::fs::{symlink, DirBuilderExt, FileTypeExt, MetadataExt};
-use std::path::Path;
-use std::process::exit;
+use std::ops::{Deref, Range};
+use std::os::fd::AsRawFd;
+use std::os::unix::ffi::OsStrExt;
+use std::os::unix::fs::{
+    fchown, symlink, DirBuilderExt, FileTypeExt, MetadataExt, OpenOptionsExt, PermissionsExt,
+};
+use std::path::{Path, PathBuf};
+use std::process::{self, exit};
 use std::str;
+use std::sync::Arc;
 
 use argh::FromArgs;
 use bytemuck::{from_bytes, Pod, Zeroable};
+use cxx::UniquePtr;
 use num_traits::cast::AsPrimitive;
 use size::{Base, Size, Style};
 
-use crate::ffi::{unxz, xz};
+use crate::ffi::{compress_format, decompress_to_vec, get_fd_encoder, unxz, xz, Encoder};
 use base::libc::{
-    c_char, dev_t, gid_t, major, makedev, minor, mknod, mode_t, uid_t, S_IFBLK, S_IFCHR, S_IFDIR,
-    S_IFLNK, S_IFMT, S_IFREG, S_IRGRP, S_IROTH, S_IRUSR, S_IWGRP, S_IWOTH, S_IWUSR, S_IXGRP,
-    S_IXOTH, S_IXUSR,
-};
-use base::{
-    log_err, map_args, EarlyExitExt, LoggedResult, MappedFile, ResultExt, Utf8CStr, WriteExt,
+    c_char, dev_t, fsetxattr, getxattr, gid_t, major, makedev, minor, mknod, mode_t, uid_t,
+    S_IFBLK, S_IFCHR, S_IFDIR, S_IFLNK, S_IFMT, S_IFREG, S_IRGRP, S_IROTH, S_IRUSR, S_IWGRP,
+    S_IWOTH, S_IWUSR, S_IXGRP, S_IXOTH, S_IXUSR,
 };
+use base::{log_err, map_args, EarlyExitExt, LoggedResult, MappedFile, ResultExt, Utf8CStr};
 
 use crate::ramdisk::MagiskCpio;
 
 #[derive(FromArgs)]
 struct CpioCli {
+    #[argh(option, short = 'c')]
+    compress: Option<String>,
+    #[argh(switch, short = 'k')]
+    keep_format: bool,
+    #[argh(switch, short = 'd')]
+    dedup: bool,
+    #[argh(option, short = 'f')]
+    script: Option<String>,
     #[argh(positional)]
     file: String,
     #[argh(positional)]
@@ -151,10 +169,20 @@ struct List {
 
 fn print_cpio_usage() {
     eprintln!(
-        r#"Usage: magiskboot cpio <incpio> [commands...]
+        r#"Usage: magiskboot cpio [-c <format>|-k] [-d] [-f <script>] <incpio> [commands...]
 
 Do cpio commands to <incpio> (modifications are done in-place).
 Each command is a single argument; add quotes for each command.
+With -f, commands are also read from <script> ('-' for STDIN), one per
+line; empty lines and lines starting with '#' are ignored. All commands
+run on a single in-memory copy of <incpio>, which is written back once,
+and only if a command modified it (or -c/-d is given).
+A compressed <incpio> is decompressed on load, and the result is
+compressed with the same format while being written.
+With -c, the result is compressed with <format> instead.
+-k is accepted for compatibility; keeping the format is the default.
+With -d, regular files with identical content and attributes are stored
+once, as hardlinks. Hardlinks in <incpio> are always preserved.
 
 Supported commands:
   exists ENTRY
@@ -208,16 +236,151 @@ struct CpioHeader {
 }
 
 pub(crate) struct Cpio {
-    pub(crate) entries: BTreeMap<String, Box<CpioEntry>>,
+    pub(crate) entries: BTreeMap<CpioPath, CpioEntry>,
 }
 
+#[derive(Clone, PartialEq)]
 pub(crate) struct CpioEntry {
     pub(crate) mode: mode_t,
     pub(crate) uid: uid_t,
     pub(crate) gid: gid_t,
     pub(crate) rdevmajor: dev_t,
     pub(crate) rdevminor: dev_t,
-    pub(crate) data: Vec<u8>,
+    pub(crate) data: CpioData,
+}
+
+// The raw archive entries are loaded from: either the mapped file, or its
+// decompressed content if the file is compressed
+pub(crate) enum CpioBuf {
+    Mapped(MappedFile),
+    Decoded(Vec<u8>),
+}
+
+impl AsRef<[u8]> for CpioBuf {
+    fn as_ref(&self) -> &[u8] {
+        match self {
+            CpioBuf::Mapped(m) => m.as_ref(),
+            CpioBuf::Decoded(v) => v,
+        }
+    }
+}
+
+// Bytes borrowed from the archive they were loaded from, only copied
+// once they are modified
+#[derive(Clone)]
+pub(crate) enum CpioData {
+    Mapped(Arc<CpioBuf>, Range<usize>),
+    Owned(Vec<u8>),
+}
+
+impl CpioData {
+    pub(crate) fn to_mut(&mut self) -> &mut Vec<u8> {
+        if let CpioData::Mapped(..) = self {
+            *self = CpioData::Owned(self.to_vec());
+        }
+        match self {
+            CpioData::Owned(v) => v,
+            CpioData::Mapped(..) => unreachable!(),
+        }
+    }
+}
+
+impl Deref for CpioData {
+    type Target = [u8];
+
+    fn deref(&self) -> &[u8] {
+        match self {
+            CpioData::Mapped(buf, range) => &buf.as_ref().as_ref()[range.clone()],
+            CpioData::Owned(v) => v,
+        }
+    }
+}
+
+impl PartialEq for CpioData {
+    fn eq(&self, other: &Self) -> bool {
+        **self == **other
+    }
+}
+
+impl Default for CpioData {
+    fn default() -> Self {
+        CpioData::Owned(Vec::new())
+    }
+}
+
+impl From<Vec<u8>> for CpioData {
+    fn from(v: Vec<u8>) -> Self {
+        CpioData::Owned(v)
+    }
+}
+
+// Entry path without the terminating NUL, always valid UTF-8
+#[derive(Clone)]
+pub(crate) struct CpioPath(CpioData);
+
+impl CpioPath {
+    pub(crate) fn as_str(&self) -> &str {
+        // SAFETY: validated when loaded, or constructed from a str
+        unsafe { str::from_utf8_unchecked(&self.0) }
+    }
+}
+
+impl Deref for CpioPath {
+    type Target = str;
+
+    fn deref(&self) -> &str {
+        self.as_str()
+    }
+}
+
+impl Borrow<str> for CpioPath {
+    fn borrow(&self) -> &str {
+        self.as_str()
+    }
+}
+
+impl PartialEq for CpioPath {
+    fn eq(&self, other: &Self) -> bool {
+        self.as_str() == other.as_str()
+    }
+}
+
+impl Eq for CpioPath {}
+
+impl PartialOrd for CpioPath {
+    fn partial_cmp(&self, other: &Self) -> Option<Ordering> {
+        Some(self.cmp(other))
+    }
+}
+
+impl Ord for CpioPath {
+    fn cmp(&self, other: &Self) -> Ordering {
+        self.as_str().cmp(other.as_str())
+    }
+}
+
+impl PartialEq<str> for CpioPath {
+    fn eq(&self, other: &str) -> bool {
+        self.as_str() == other
+    }
+}
+
+impl PartialEq<&str> for CpioPath {
+    fn eq(&self, other: &&str) -> bool {
+        self.as_str() == *other
+    }
+}
+
+impl Display for CpioPath {
+    fn fmt(&self, f: &mut Formatter<'_>) -> std::fmt::Result {
+        f.write_str(self.as_str())
+    }
+}
+
+impl From<String> for CpioPath {
+    fn from(s: String) -> Self {
+        CpioPath(CpioData::Owned(s.into_bytes()))
+    }
 }
 
 impl Cpio {
@@ -227,8 +390,11 @@ impl Cpio {
         }
     }
 
-    fn load_from_data(data: &[u8]) -> LoggedResult<Self> {
+    // Entries keep a reference to the archive instead of copying their name and data
+    fn load_from_buf(map: Arc<CpioBuf>) -> LoggedResult<Self> {
+        let data = map.as_ref().as_ref();
         let mut cpio = Cpio::new();
+        let mut links = HashMap::new();
         let mut pos = 0_usize;
         while pos < data.len() {
             let hdr_sz = size_of::<CpioHeader>();
@@ -238,13 +404,16 @@ impl Cpio {
             }
             pos += hdr_sz;
             let name_sz = x8u(&hdr.namesize)? as usize;
-            let name = Utf8CStr::from_bytes(&data[pos..(pos + name_sz)])?.to_string();
+            let name = Utf8CStr::from_bytes(&data[pos..(pos + name_sz)])?;
+            let name_range = pos..(pos + name.len());
             pos += name_sz;
             pos = align_4(pos);
             if name == "." || name == ".." {
                 continue;
             }
             if name == "TRAILER!!!" {
+                // Inode numbers are only unique within one archive
+                cpio.resolve_links(&mut links);
                 match data[pos..].windows(6).position(|x| x == b"070701") {
                     Some(x) => pos += x,
                     None => break,
@@ -252,73 +421,162 @@ impl Cpio {
                 continue;
             }
             let file_sz = x8u(&hdr.filesize)? as usize;
-            let entry = Box::new(CpioEntry {
+            if pos + file_sz > data.len() {
+                return Err(log_err!("truncated cpio entry"));
+            }
+            let entry = CpioEntry {
                 mode: x8u(&hdr.mode)?.as_(),
                 uid: x8u(&hdr.uid)?.as_(),
                 gid: x8u(&hdr.gid)?.as_(),
                 rdevmajor: x8u(&hdr.rdevmajor)?.as_(),
                 rdevminor: x8u(&hdr.rdevminor)?.as_(),
-                data: data[pos..(pos + file_sz)].to_vec(),
-            });
+                data: CpioData::Mapped(map.clone(), pos..(pos + file_sz)),
+            };
             pos += file_sz;
+            let name = CpioPath(CpioData::Mapped(map.clone(), name_range));
+            if entry.mode & S_IFMT == S_IFREG && x8u(&hdr.nlink)? > 1 {
+                let ino = [x8u(&hdr.devmajor)?, x8u(&hdr.devminor)?, x8u(&hdr.ino)?];
+                links.entry(ino).or_insert_with(Vec::new).push(name.clone());
+            }
             cpio.entries.insert(name, entry);
             pos = align_4(pos);
         }
+        cpio.resolve_links(&mut links);
         Ok(cpio)
     }
 
+    // The data of a hardlinked file is only stored in one of its links, usually
+    // the last one. Share it with all links, so they are written back as links.
+    fn resolve_links(&mut self, links: &mut HashMap<[u32; 3], Vec<CpioPath>>) {
+        for (_, names) in links.drain() {
+            let data = names
+                .iter()
+                .filter_map(|name| self.entries.get(name))
+                .find(|entry| !entry.data.is_empty())
+                .map(|entry| entry.data.clone());
+            let Some(data) = data else {
+                continue;
+            };
+            for name in &names {
+                if let Some(entry) = self.entries.get_mut(name) {
+                    entry.data = data.clone();
+                }
+            }
+        }
+    }
+
+    // Assigns inode numbers to entries in order, and returns the next free one.
+    // Regular files are written as hardlinks of each other if they still share
+    // the data they were loaded with as hardlinks or, with dedup, if they have
+    // identical content and attributes. Only the last link stores the data.
+    fn inodes(&self, dedup: bool) -> (Vec<CpioInode>, u32) {
+        let mut keys = HashMap::new();
+        let mut groups = Vec::with_capacity(self.entries.len());
+        // Link count and last entry of each group
+        let mut links: Vec<(u32, usize)> = Vec::new();
+        for (i, entry) in self.entries.values().enumerate() {
+            let key = if entry.mode & S_IFMT != S_IFREG || entry.data.is_empty() {
+                None
+            } else if dedup {
+                Some(LinkKey::Content(
+                    entry.mode,
+                    entry.uid,
+                    entry.gid,
+                    &entry.data,
+                ))
+            } else if let CpioData::Mapped(buf, range) = &entry.data {
+                let buf = Arc::as_ptr(buf) as usize;
+                Some(LinkKey::Shared(
+                    entry.mode,
+                    entry.uid,
+                    entry.gid,
+                    buf,
+                    range.clone(),
+                ))
+            } else {
+                None
+            };
+            let group = match key {
+                Some(key) => *keys.entry(key).or_insert(links.len()),
+                None => links.len(),
+            };
+            if group == links.len() {
+                links.push((0, 0));
+            }
+            links[group].0 += 1;
+            links[group].1 = i;
+            groups.push(group);
+        }
+        let inodes = groups
+            .into_iter()
+            .enumerate()
+            .map(|(i, group)| CpioInode {
+                ino: 300000 + group as u32,
+                nlink: links[group].0,
+                data: links[group].1 == i,
+            })
+            .collect();
+        (inodes, 300000 + links.len() as u32)
+    }
+
     pub(crate) fn load_from_file(path: &Utf8CStr) -> LoggedResult<Self> {
+        Self::load_with_format(path).map(|(cpio, _)| cpio)
+    }
+
+    // Also returns the compression format of the file, if it is compressed
+    fn load_with_format(path: &Utf8CStr) -> LoggedResult<(Self, Option<&'static str>)> {
         eprintln!("Loading cpio: [{}]", path);
         let file = MappedFile::open(path)?;
-        Self::load_from_data(file.as_ref())
+        let format = compress_format(file.as_ref());
+        if format.is_empty() {
+            let cpio = Self::load_from_buf(Arc::new(CpioBuf::Mapped(file)))?;
+            return Ok((cpio, None));
+        }
+        eprintln!("Detected format: [{}]", format);
+        let mut data = Vec::new();
+        if !decompress_to_vec(file.as_ref(), &mut data) {
+            return Err(log_err!("failed to decompress cpio"));
+        }
+        let cpio = Self::load_from_buf(Arc::new(CpioBuf::Decoded(data)))?;
+        Ok((cpio, Some(format)))
     }
 
-    fn dump(&self, path: &str) -> LoggedResult<()> {
+    fn dump(&self, path: &str, format: Option<&str>, dedup: bool) -> LoggedResult<()> {
         eprintln!("Dumping cpio: [{}]", path);
-        let mut file = File::create(path)?;
-        let mut pos = 0usize;
-        let mut inode = 300000i64;
-        for (name, entry) in &self.entries {
-            pos += file.write(
-                format!(
-                    "070701{:08x}{:08x}{:08x}{:08x}{:08x}{:08x}{:08x}{:08x}{:08x}{:08x}{:08x}{:08x}{:08x}",
-                    inode,
-                    entry.mode,
-                    entry.uid,
-                    entry.gid,
-                    1,
-                    0,
-                    entry.data.len(),
-                    0,
-                    0,
-                    entry.rdevmajor,
-                    entry.rdevminor,
-                    name.len() + 1,
-                    0
-                ).as_bytes(),
-            )?;
-            pos += file.write(name.as_bytes())?;
-            pos += file.write(&[0])?;
-            file.write_zeros(align_4(pos) - pos)?;
-            pos = align_4(pos);
-            pos += file.write(&entry.data)?;
-            file.write_zeros(align_4(pos) - pos)?;
-            pos = align_4(pos);
-            inode += 1;
-        }
-        pos += file.write(
-            format!("070701{:08x}{:08x}{:08x}{:08x}{:08x}{:08x}{:08x}{:08x}{:08x}{:08x}{:08x}{:08x}{:08x}",
-                inode, 0o755, 0, 0, 1, 0, 0, 0, 0, 0, 0, 11, 0
-            ).as_bytes()
-        )?;
-        pos += file.write("TRAILER!!!\0".as_bytes())?;
-        file.write_zeros(align_4(pos) - pos)?;
+        // Entries may still be backed by the mapping of the file we are about to overwrite
+        replace_file(Path::new(path), |file| self.dump_file(file, format, dedup))
+    }
+
+    fn dump_file(&self, file: &File, format: Option<&str>, dedup: bool) -> LoggedResult<()> {
+        match format {
+            None => {
+                self.dump_to(file, dedup)?;
+            }
+            Some(format) => {
+                let encoder = get_fd_encoder(format, file.as_raw_fd());
+                if encoder.is_null() {
+                    return Err(log_err!("unsupported compression format: {}", format));
+                }
+                // The encoder is finalized when dropped, before the file is closed
+                self.dump_to(EncoderWriter(encoder), dedup)?;
+            }
+        }
         Ok(())
     }
 
+    fn dump_to<W: Write>(&self, out: W, dedup: bool) -> LoggedResult<W> {
+        let mut w = CpioWriter::new(out);
+        let (inodes, next_ino) = self.inodes(dedup);
+        for ((name, entry), inode) in self.entries.iter().zip(inodes) {
+            w.write_entry(&inode, name, entry)?;
+        }
+        let out = w.finish(next_ino)?;
+        Ok(out)
+    }
+
     pub(crate) fn rm(&mut self, path: &str, recursive: bool) {
         let path = norm_path(path);
-        if self.entries.remove(&path).is_some() {
+        if self.entries.remove(path.as_str()).is_some() {
             eprintln!("Removed entry [{}]", path);
         }
         if recursive {
@@ -358,7 +616,7 @@ impl Cpio {
                 file.write_all(&entry.data)?;
             }
             S_IFLNK => {
-                symlink(Path::new(&str::from_utf8(entry.data.as_slice())?), out)?;
+                symlink(Path::new(&str::from_utf8(&entry.data)?), out)?;
             }
             S_IFBLK | S_IFCHR => {
                 let dev = makedev(entry.rdevmajor.try_into()?, entry.rdevminor.try_into()?);
@@ -387,14 +645,14 @@ impl Cpio {
                 if path == "." || path == ".." {
                     continue;
                 }
-                self.extract_entry(path, Path::new(path))?;
+                self.extract_entry(path, Path::new(path.as_str()))?;
             }
         }
         Ok(())
     }
 
     pub(crate) fn exists(&self, path: &str) -> bool {
-        self.entries.contains_key(&norm_path(path))
+        self.entries.contains_key(norm_path(path).as_str())
     }
 
     fn add(&mut self, mode: &mode_t, path: &str, file: &str) -> LoggedResult<()> {
@@ -420,15 +678,15 @@ impl Cpio {
             }
         };
         self.entries.insert(
-            norm_path(path),
-            Box::new(CpioEntry {
+            norm_path(path).into(),
+            CpioEntry {
                 mode,
                 uid: 0,
                 gid: 0,
                 rdevmajor,
                 rdevminor,
-                data: content,
-            }),
+                data: content.into(),
+            },
         );
         eprintln!("Add file [{}] ({:04o})", path, mode);
         Ok(())
@@ -436,30 +694,30 @@ impl Cpio {
 
     fn mkdir(&mut self, mode: &mode_t, dir: &str) {
         self.entries.insert(
-            norm_path(dir),
-            Box::new(CpioEntry {
+            norm_path(dir).into(),
+            CpioEntry {
                 mode: *mode | S_IFDIR,
                 uid: 0,
                 gid: 0,
                 rdevmajor: 0,
                 rdevminor: 0,
-                data: vec![],
-            }),
+                data: CpioData::default(),
+            },
         );
         eprintln!("Create directory [{}] ({:04o})", dir, mode);
     }
 
     fn ln(&mut self, src: &str, dst: &str) {
         self.entries.insert(
-            norm_path(dst),
-            Box::new(CpioEntry {
+            norm_path(dst).into(),
+            CpioEntry {
                 mode: S_IFLNK,
                 uid: 0,
                 gid: 0,
                 rdevmajor: 0,
                 rdevminor: 0,
-                data: norm_path(src).as_bytes().to_vec(),
-            }),
+                data: norm_path(src).into_bytes().into(),
+            },
         );
         eprintln!("Create symlink [{}] -> [{}]", dst, src);
     }
@@ -467,9 +725,9 @@ impl Cpio {
     fn mv(&mut self, from: &str, to: &str) -> LoggedResult<()> {
         let entry = self
             .entries
-            .remove(&norm_path(from))
+            .remove(norm_path(from).as_str())
             .ok_or_else(|| log_err!("no such entry {}", from))?;
-        self.entries.insert(norm_path(to), entry);
+        self.entries.insert(norm_path(to).into(), entry);
         eprintln!("Move [{}] -> [{}]", from, to);
         Ok(())
     }
@@ -498,6 +756,231 @@ impl Cpio {
     }
 }
 
+struct CpioInode {
+    ino: u32,
+    nlink: u32,
+    // Whether the data is stored in this entry
+    data: bool,
+}
+
+// Identity of regular files that can be written as hardlinks of each other
+#[derive(PartialEq, Eq, Hash)]
+enum LinkKey<'a> {
+    Shared(mode_t, uid_t, gid_t, usize, Range<usize>),
+    Content(mode_t, uid_t, gid_t, &'a [u8]),
+}
+
+// Size of the buffer collecting headers, names and small files between writes
+const CPIO_WRITE_BUF_SZ: usize = 256 * 1024;
+
+// Serializes entries in the newc format. Headers are encoded into a reusable
+// buffer, and large file data is written along with it in one vectored write.
+struct CpioWriter<W: Write> {
+    out: W,
+    buf: Vec<u8>,
+    pos: usize,
+}
+
+impl<W: Write> CpioWriter<W> {
+    fn new(out: W) -> Self {
+        CpioWriter {
+            out,
+            buf: Vec::with_capacity(CPIO_WRITE_BUF_SZ),
+            pos: 0,
+        }
+    }
+
+    fn put(&mut self, data: &[u8]) {
+        self.buf.extend_from_slice(data);
+        self.pos += data.len();
+    }
+
+    fn pad(&mut self) {
+        let pad = align_4(self.pos) - self.pos;
+        self.put(&[0; 3][..pad]);
+    }
+
+    fn put_header(&mut self, fields: [u32; 13]) {
+        const HEX: &[u8; 16] = b"0123456789abcdef";
+        let mut hdr = [0_u8; size_of::<CpioHeader>()];
+        hdr[..6].copy_from_slice(b"070701");
+        for (field, v) in hdr[6..].chunks_exact_mut(8).zip(fields) {
+            for (i, c) in field.iter_mut().enumerate() {
+                *c = HEX[((v >> (28 - i * 4)) & 0xf) as usize];
+            }
+        }
+        self.put(&hdr);
+    }
+
+    fn put_name(&mut self, name: &str) {
+        self.put(name.as_bytes());
+        self.put(&[0]);
+        self.pad();
+    }
+
+    fn write_entry(&mut self, inode: &CpioInode, name: &str, entry: &CpioEntry) -> io::Result<()> {
+        let data: &[u8] = if inode.data { &entry.data } else { &[] };
+        self.put_header([
+            inode.ino,
+            entry.mode,
+            entry.uid,
+            entry.gid,
+            inode.nlink,
+            0,
+            data.len() as u32,
+            0,
+            0,
+            entry.rdevmajor as u32,
+            entry.rdevminor as u32,
+            name.len() as u32 + 1,
+            0,
+        ]);
+        self.put_name(name);
+        if self.buf.len() + data.len() <= CPIO_WRITE_BUF_SZ {
+            self.put(data);
+            self.pad();
+        } else {
+            // Write the pending buffer and the data together without copying
+            let pad = align_4(self.pos + data.len()) - self.pos - data.len();
+            let mut bufs = [
+                IoSlice::new(&self.buf),
+                IoSlice::new(data),
+                IoSlice::new(&[0; 3][..pad]),
+            ];
+            write_all_vectored(&mut self.out, &mut bufs)?;
+            self.pos += data.len() + pad;
+            self.buf.clear();
+        }
+        if self.buf.len() >= CPIO_WRITE_BUF_SZ / 2 {
+            self.flush()?;
+        }
+        Ok(())
+    }
+
+    fn flush(&mut self) -> io::Result<()> {
+        self.out.write_all(&self.buf)?;
+        self.buf.clear();
+        Ok(())
+    }
+
+    fn finish(mut self, inode: u32) -> io::Result<W> {
+        self.put_header([inode, 0o755, 0, 0, 1, 0, 0, 0, 0, 0, 0, 11, 0]);
+        self.put_name("TRAILER!!!");
+        self.flush()?;
+        Ok(self.out)
+    }
+}
+
+fn write_all_vectored<W: Write>(out: &mut W, mut bufs: &mut [IoSlice]) -> io::Result<()> {
+    IoSlice::advance_slices(&mut bufs, 0);
+    while !bufs.is_empty() {
+        match out.write_vectored(bufs) {
+            Ok(0) => return Err(io::ErrorKind::WriteZero.into()),
+            Ok(n) => IoSlice::advance_slices(&mut bufs, n),
+            Err(e) if e.kind() == io::ErrorKind::Interrupted => {}
+            Err(e) => return Err(e),
+        }
+    }
+    Ok(())
+}
+
+struct EncoderWriter(UniquePtr<Encoder>);
+
+impl Write for EncoderWriter {
+    fn write(&mut self, buf: &[u8]) -> io::Result<usize> {
+        if self.0.pin_mut().write(buf) {
+            Ok(buf.len())
+        } else {
+            Err(io::Error::new(io::ErrorKind::Other, "compression failed"))
+        }
+    }
+
+    fn flush(&mut self) -> io::Result<()> {
+        Ok(())
+    }
+}
+
+// Follow symlinks so the link is kept and the file it points to gets replaced
+fn resolve_link(path: &Path) -> PathBuf {
+    let mut path = path.to_path_buf();
+    // Same limit as the kernel, in case of symlink loops
+    for _ in 0..40 {
+        match path.read_link() {
+            Ok(link) => {
+                path = match path.parent() {
+                    Some(dir) => dir.join(link),
+                    None => link,
+                }
+            }
+            Err(_) => break,
+        }
+    }
+    path
+}
+
+fn tmp_path(target: &Path) -> PathBuf {
+    let mut name = OsString::from(".");
+    name.push(target.file_name().unwrap_or_default());
+    name.push(format!(".{}.tmp", process::id()));
+    target.with_file_name(name)
+}
+
+const XATTR_NAME_SELINUX: &[u8] = b"security.selinux\0";
+
+// Carry the mode, owner and SELinux context of an existing target over to its replacement
+fn copy_metadata(target: &Path, file: &File) -> LoggedResult<()> {
+    let Ok(st) = metadata(target) else {
+        return Ok(());
+    };
+    file.set_permissions(Permissions::from_mode(st.mode() & 0o7777))?;
+    // Changing the owner requires privileges, keep ours if it is not possible
+    let _ = fchown(file, Some(st.uid()), Some(st.gid()));
+    let mut con = [0_u8; 256];
+    let target = CString::new(target.as_os_str().as_bytes())?;
+    unsafe {
+        let len = getxattr(
+            target.as_ptr(),
+            XATTR_NAME_SELINUX.as_ptr().cast(),
+            con.as_mut_ptr().cast(),
+            con.len(),
+        );
+        if len > 0 {
+            fsetxattr(
+                file.as_raw_fd(),
+                XATTR_NAME_SELINUX.as_ptr().cast(),
+                con.as_ptr().cast(),
+                len as usize,
+                0,
+            );
+        }
+    }
+    Ok(())
+}
+
+// Write a new inode and rename it over path, so mappings of the old file stay valid
+// and a failure halfway never leaves a truncated file behind
+pub(crate) fn replace_file(
+    path: &Path,
+    write: impl FnOnce(&File) -> LoggedResult<()>,
+) -> LoggedResult<()> {
+    let target = resolve_link(path);
+    let tmp = tmp_path(&target);
+    let file = OpenOptions::new()
+        .write(true)
+        .create_new(true)
+        .mode(0o644)
+        .open(&tmp)?;
+    let result = write(&file).and_then(|_| {
+        copy_metadata(&target, &file)?;
+        rename(&tmp, &target)?;
+        Ok(())
+    });
+    if result.is_err() {
+        let _ = remove_file(&tmp);
+    }
+    result
+}
+
 impl CpioEntry {
     pub(crate) fn compress(&mut self) -> bool {
         if self.mode & S_IFMT != S_IFREG {
@@ -508,7 +991,7 @@ impl CpioEntry {
             eprintln!("xz compression failed");
             return false;
         }
-        self.data = compressed;
+        self.data = compressed.into();
         true
     }
 
@@ -521,7 +1004,7 @@ impl CpioEntry {
             eprintln!("xz decompression failed");
             return false;
         }
-        self.data = decompressed;
+        self.data = decompressed.into();
         true
     }
 }
@@ -572,15 +1055,31 @@ pub fn cpio_commands(argc: i32, argv: *const *const c_char) -> bool {
         let mut cli =
             CpioCli::from_args(&["magiskboot", "cpio"], &cmds).on_early_exit(print_cpio_usage);
 
+        if cli.compress.is_some() && cli.keep_format {
+            return Err(log_err!("-c and -k cannot be used together"));
+        }
+
+        if let Some(script) = &cli.script {
+            let script = if script == "-" {
+                io::read_to_string(io::stdin())?
+            } else {
+                read_to_string(script)?
+            };
+            cli.commands
+                .extend(script.lines().map(|x| x.trim().to_owned()));
+        }
+
         let file = Utf8CStr::from_string(&mut cli.file);
-        let mut cpio = if Path::new(file).exists() {
-            Cpio::load_from_file(file)?
+        let (mut cpio, format) = if Path::new(file).exists() {
+            Cpio::load_with_format(file)?
         } else {
-            Cpio::new()
+            (Cpio::new(), None)
         };
+        // The archive is only written back if a command modified it, or to create it
+        let mut dirty = !Path::new(file).exists();
 
         for cmd in cli.commands {
-            if cmd.starts_with('#') {
+            if cmd.is_empty() || cmd.starts_with('#') {
                 continue;
             }
             let mut cli = CpioCommand::from_args(
@@ -594,8 +1093,14 @@ pub fn cpio_commands(argc: i32, argv: *const *const c_char) -> bool {
 
             match &mut cli.command {
                 CpioSubCommand::Test(_) => exit(cpio.test()),
-                CpioSubCommand::Restore(_) => cpio.restore()?,
-                CpioSubCommand::Patch(_) => cpio.patch(),
+                CpioSubCommand::Restore(_) => {
+                    cpio.restore()?;
+                    dirty = true;
+                }
+                CpioSubCommand::Patch(_) => {
+                    cpio.patch();
+                    dirty = true;
+                }
                 CpioSubCommand::Exists(Exists { path }) => {
                     if cpio.exists(path) {
                         exit(0);
@@ -606,12 +1111,31 @@ pub fn cpio_commands(argc: i32, argv: *const *const c_char) -> bool {
                 CpioSubCommand::Backup(Backup {
                     origin,
                     skip_compress,
-                }) => cpio.backup(Utf8CStr::from_string(origin), *skip_compress)?,
-                CpioSubCommand::Remove(Remove { path, recursive }) => cpio.rm(path, *recursive),
-                CpioSubCommand::Move(Move { from, to }) => cpio.mv(from, to)?,
-                CpioSubCommand::MakeDir(MakeDir { mode, dir }) => cpio.mkdir(mode, dir),
-                CpioSubCommand::Link(Link { src, dst }) => cpio.ln(src, dst),
-                CpioSubCommand::Add(Add { mode, path, file }) => cpio.add(mode, path, file)?,
+                }) => {
+                    if cpio.backup(Utf8CStr::from_string(origin), *skip_compress)? {
+                        dirty = true;
+                    }
+                }
+                CpioSubCommand::Remove(Remove { path, recursive }) => {
+                    cpio.rm(path, *recursive);
+                    dirty = true;
+                }
+                CpioSubCommand::Move(Move { from, to }) => {
+                    cpio.mv(from, to)?;
+                    dirty = true;
+                }
+                CpioSubCommand::MakeDir(MakeDir { mode, dir }) => {
+                    cpio.mkdir(mode, dir);
+                    dirty = true;
+                }
+                CpioSubCommand::Link(Link { src, dst }) => {
+                    cpio.ln(src, dst);
+                    dirty = true;
+                }
+                CpioSubCommand::Add(Add { mode, path, file }) => {
+                    cpio.add(mode, path, file)?;
+                    dirty = true;
+                }
                 CpioSubCommand::Extract(Extract { paths }) => {
                     if !paths.is_empty() && paths.len() != 2 {
                         return Err(log_err!("invalid arguments"));
@@ -627,7 +1151,12 @@ pub fn cpio_commands(argc: i32, argv: *const *const c_char) -> bool {
                 }
             };
         }
-        cpio.dump(file)?;
+        // Keep the format of the input unless another one is requested
+        let format = cli.compress.as_deref().or(format);
+        // Recompressing or deduplicating rewrites the archive even without changes
+        if dirty || cli.compress.is_some() || cli.dedup {
+            cpio.dump(file, format, cli.dedup)?;
+        }
         Ok(())
     }
     inner(argc, argv)
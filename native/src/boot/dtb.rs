@@ -1,6 +1,7 @@
-use std::{cell::UnsafeCell, process::exit};
+use std::{cell::UnsafeCell, io::Write, ops::Range, path::Path, process::exit};
 
 use argh::FromArgs;
+use byteorder::{BigEndian, ByteOrder};
 use fdt::{
     node::{FdtNode, NodeProperty},
     Fdt,
@@ -10,7 +11,7 @@ use base::{
     libc::c_char, log_err, map_args, EarlyExitExt, LoggedResult, MappedFile, ResultExt, Utf8CStr,
 };
 
-use crate::{check_env, patch::patch_verity};
+use crate::{check_env, cpio::replace_file, patch::patch_verity};
 
 #[derive(FromArgs)]
 struct DtbCli {
@@ -26,6 +27,8 @@ enum DtbAction {
     Print(Print),
     Patch(Patch),
     Test(Test),
+    Set(Set),
+    Remove(Remove),
 }
 
 #[derive(FromArgs)]
@@ -43,6 +46,26 @@ struct Patch {}
 #[argh(subcommand, name = "test")]
 struct Test {}
 
+#[derive(FromArgs)]
+#[argh(subcommand, name = "set")]
+struct Set {
+    #[argh(positional)]
+    node: String,
+    #[argh(positional)]
+    prop: String,
+    #[argh(positional)]
+    value: String,
+}
+
+#[derive(FromArgs)]
+#[argh(subcommand, name = "rm")]
+struct Remove {
+    #[argh(positional)]
+    node: String,
+    #[argh(positional)]
+    prop: String,
+}
+
 fn print_dtb_usage() {
     eprintln!(
         r#"Usage: magiskboot dtb <file> <action> [args...]
@@ -59,7 +82,17 @@ Supported actions:
   test
     Test the fstab's status
     Return values:
-    0:valid    1:error"#
+    0:valid    1:error
+  set <node> <prop> <value>
+    Set <prop> of <node> (e.g. /chosen) in all dtbs containing <node>,
+    adding <prop> if it does not exist. Dtbs are resized as needed,
+    updating the entries of an Android dt_table (dtb.img/dtbo.img).
+    Resizing dtbs in other containers (e.g. QCDT) is refused
+    <value> is a string, "<cells...>" of 32-bit numbers, or "[hex bytes]"
+    Return 1 if <node> is not found
+  rm <node> <prop>
+    Remove <prop> of <node> in all dtbs
+    Return 1 if <prop> is not found"#
     );
 }
 
@@ -149,6 +182,134 @@ fn print_node(node: &FdtNode) {
     do_print_node(node, &mut vec![]);
 }
 
+const FDT_MAGIC: &[u8; 4] = b"\xd0\x0d\xfe\xed";
+const FDT_HEADER_SIZE: usize = 40;
+
+// Android dt_table used by dtb.img and dtbo.img, all fields are big endian.
+// Every entry starts with the dt_size and dt_offset of its dtb.
+const DT_TABLE_MAGIC: &[u8; 4] = b"\xd7\xb7\xab\x1e";
+const DT_TABLE_HEADER_SIZE: usize = 32;
+const DT_TABLE_ENTRY_MIN_SIZE: usize = 8;
+
+const FDT_BEGIN_NODE: u32 = 1;
+const FDT_END_NODE: u32 = 2;
+const FDT_PROP: u32 = 3;
+const FDT_NOP: u32 = 4;
+
+// Locations of all dtbs within a file, found in a single scan. The bytes
+// around and between dtbs are kept as is when the file is repacked.
+struct DtbIndex<'a> {
+    data: &'a [u8],
+    dtbs: Vec<Range<usize>>,
+}
+
+impl<'a> DtbIndex<'a> {
+    fn new(data: &'a [u8]) -> LoggedResult<Self> {
+        let mut dtbs = Vec::new();
+        let mut pos = 0;
+        while let Some(off) = data[pos..].windows(4).position(|w| w == FDT_MAGIC) {
+            let start = pos + off;
+            let slice = &data[start..];
+            if slice.len() < FDT_HEADER_SIZE {
+                break;
+            }
+            let size = Fdt::new(slice)?.total_size();
+            if size > slice.len() {
+                eprintln!("dtb.{:04} is truncated", dtbs.len());
+                break;
+            }
+            dtbs.push(start..(start + size));
+            pos = start + size;
+        }
+        Ok(DtbIndex { data, dtbs })
+    }
+
+    fn dtb(&self, n: usize) -> &'a [u8] {
+        &self.data[self.dtbs[n].clone()]
+    }
+
+    // Rebuilds the file with the dtbs that have a replacement swapped out.
+    // When dtbs move or change size, the offsets and sizes recorded in an
+    // Android dt_table (dtb.img/dtbo.img) are updated. Other containers may
+    // have tables of their own that would be left stale, so those are refused.
+    fn repack(&self, replacements: &[Option<Vec<u8>>]) -> LoggedResult<Vec<u8>> {
+        let mut out = Vec::with_capacity(self.data.len());
+        let mut moved = Vec::with_capacity(self.dtbs.len());
+        let mut pos = 0;
+        for (range, replacement) in self.dtbs.iter().zip(replacements) {
+            out.extend_from_slice(&self.data[pos..range.start]);
+            let start = out.len();
+            match replacement {
+                Some(dtb) => out.extend_from_slice(dtb),
+                None => out.extend_from_slice(&self.data[range.clone()]),
+            }
+            moved.push(start..out.len());
+            pos = range.end;
+        }
+        out.extend_from_slice(&self.data[pos..]);
+        if moved == self.dtbs {
+            return Ok(out);
+        }
+        if self.data.starts_with(DT_TABLE_MAGIC) {
+            self.update_dt_table(&mut out, &moved)?;
+        } else if !self.is_plain() {
+            return Err(log_err!(
+                "Unknown container around the dtbs, cannot change the size of dtbs"
+            ));
+        }
+        Ok(out)
+    }
+
+    // Nothing but padding before and between the dtbs
+    fn is_plain(&self) -> bool {
+        let mut pos = 0;
+        for range in &self.dtbs {
+            if self.data[pos..range.start].iter().any(|b| *b != 0) {
+                return false;
+            }
+            pos = range.end;
+        }
+        true
+    }
+
+    fn update_dt_table(&self, out: &mut [u8], moved: &[Range<usize>]) -> LoggedResult<()> {
+        if self.data.len() < DT_TABLE_HEADER_SIZE {
+            return Err(log_err!("Invalid dt_table header"));
+        }
+        let header = &self.data[..DT_TABLE_HEADER_SIZE];
+        let total_size = BigEndian::read_u32(&header[4..]) as usize;
+        let entry_size = BigEndian::read_u32(&header[12..]) as usize;
+        let entry_count = BigEndian::read_u32(&header[16..]) as usize;
+        let entries = BigEndian::read_u32(&header[20..]) as usize;
+        // The table itself has to sit before the first dtb to stay in place
+        let table_end = self.dtbs.first().map_or(0, |r| r.start);
+        if entry_size < DT_TABLE_ENTRY_MIN_SIZE
+            || entries + entry_count * entry_size > table_end
+            || total_size > self.data.len()
+        {
+            return Err(log_err!("Invalid dt_table header"));
+        }
+        for i in 0..entry_count {
+            let entry = &mut out[(entries + i * entry_size)..];
+            let size = BigEndian::read_u32(entry) as usize;
+            let offset = BigEndian::read_u32(&entry[4..]) as usize;
+            let Some(n) = self
+                .dtbs
+                .iter()
+                .position(|r| r.start == offset && r.len() == size)
+            else {
+                return Err(log_err!("dt_table entry {} does not point to a dtb", i));
+            };
+            BigEndian::write_u32(entry, moved[n].len() as u32);
+            BigEndian::write_u32(&mut entry[4..], moved[n].start as u32);
+        }
+        // Anything after total_size is not part of the table and is kept as is
+        let total_size = total_size + out.len() - self.data.len();
+        BigEndian::write_u32(&mut out[4..], total_size as u32);
+        Ok(())
+    }
+}
+
 fn for_each_fdt<F: FnMut(usize, Fdt) -> LoggedResult<()>>(
     file: &Utf8CStr,
     rw: bool,
@@ -160,32 +321,238 @@ fn for_each_fdt<F: FnMut(usize, Fdt) -> LoggedResult<()>>(
     } else {
         MappedFile::open(file)?
     };
-    let mut buf = Some(file.as_ref());
-    let mut dtb_num = 0usize;
-    while let Some(slice) = buf {
-        let slice = if let Some(pos) = slice.windows(4).position(|w| w == b"\xd0\x0d\xfe\xed") {
-            &slice[pos..]
-        } else {
-            break;
+    let index = DtbIndex::new(file.as_ref())?;
+    for n in 0..index.dtbs.len() {
+        f(n, Fdt::new(index.dtb(n))?)?;
+    }
+    Ok(())
+}
+
+// A dtb split into its memory reservation, structure and strings blocks, so
+// that properties can be added, resized and removed. Blocks are laid out
+// again in the standard order when the dtb is rebuilt.
+struct FdtEditor {
+    version: u32,
+    last_comp_version: u32,
+    boot_cpuid_phys: u32,
+    mem_rsvmap: Vec<u8>,
+    structs: Vec<u8>,
+    strings: Vec<u8>,
+}
+
+impl FdtEditor {
+    fn new(dtb: &[u8]) -> LoggedResult<Self> {
+        let hdr = |i: usize| BigEndian::read_u32(&dtb[(i * 4)..]) as usize;
+        let block = |off: usize, size: usize| {
+            dtb.get(off..(off + size))
+                .ok_or_else(|| log_err!("invalid dtb block"))
         };
-        if slice.len() < 40 {
-            break;
+        if dtb.len() < FDT_HEADER_SIZE {
+            return Err(log_err!("invalid dtb"));
+        }
+        let version = hdr(5) as u32;
+        if version < 17 {
+            return Err(log_err!("unsupported dtb version {}", version));
+        }
+        // The reservation map ends with an all zero entry
+        let mut rsvmap_end = hdr(4);
+        loop {
+            let entry = block(rsvmap_end, 16)?;
+            rsvmap_end += 16;
+            if entry.iter().all(|b| *b == 0) {
+                break;
+            }
         }
-        let fdt = Fdt::new(slice)?;
+        Ok(FdtEditor {
+            version,
+            last_comp_version: hdr(6) as u32,
+            boot_cpuid_phys: hdr(7) as u32,
+            mem_rsvmap: dtb[hdr(4)..rsvmap_end].to_vec(),
+            structs: block(hdr(2), hdr(9))?.to_vec(),
+            strings: block(hdr(3), hdr(8))?.to_vec(),
+        })
+    }
 
-        let size = fdt.total_size();
+    fn token(&self, pos: usize) -> Option<u32> {
+        self.structs.get(pos..(pos + 4)).map(BigEndian::read_u32)
+    }
 
-        if size > slice.len() {
-            eprintln!("dtb.{:04} is truncated", dtb_num);
-            break;
+    // Offset of the first token after the FDT_BEGIN_NODE of the node at path.
+    // Path components match either the full node name, or the name without
+    // its unit address.
+    fn find_node(&self, path: &str) -> Option<usize> {
+        let path: Vec<&str> = path.split('/').filter(|x| !x.is_empty()).collect();
+        let mut depth = 0;
+        let mut matched = 0;
+        let mut pos = 0;
+        loop {
+            let token = self.token(pos)?;
+            pos += 4;
+            match token {
+                FDT_BEGIN_NODE => {
+                    let len = self.structs[pos..].iter().position(|c| *c == 0)?;
+                    let name = std::str::from_utf8(&self.structs[pos..(pos + len)]).ok()?;
+                    pos = align_4(pos + len + 1);
+                    depth += 1;
+                    // The node is a match if all of its ancestors are
+                    if depth >= 2 && matched == depth - 2 && matched < path.len() {
+                        let want = path[matched];
+                        if name == want
+                            || (!want.contains('@') && name.split('@').next() == Some(want))
+                        {
+                            matched += 1;
+                        }
+                    }
+                    if matched == path.len() && depth == matched + 1 {
+                        return Some(pos);
+                    }
+                }
+                FDT_END_NODE => {
+                    if depth >= 2 && matched == depth - 1 {
+                        matched -= 1;
+                    }
+                    depth -= 1;
+                }
+                FDT_PROP => {
+                    let len = self.token(pos)? as usize;
+                    pos += 8 + align_4(len);
+                }
+                FDT_NOP => {}
+                _ => return None,
+            }
         }
+    }
 
-        f(dtb_num, fdt)?;
+    // Looks up name within the properties of the node starting at pos. Returns
+    // the range of its FDT_PROP token if found, and the end of the properties.
+    fn find_prop(&self, mut pos: usize, name: &str) -> Option<(Option<Range<usize>>, usize)> {
+        let mut found = None;
+        loop {
+            match self.token(pos)? {
+                FDT_PROP => {
+                    let len = self.token(pos + 4)? as usize;
+                    let name_off = self.token(pos + 8)? as usize;
+                    let end = pos + 12 + align_4(len);
+                    if self.strings.get(name_off..)?.split(|c| *c == 0).next()? == name.as_bytes() {
+                        found = Some(pos..end);
+                    }
+                    pos = end;
+                }
+                FDT_NOP => pos += 4,
+                _ => return Some((found, pos)),
+            }
+        }
+    }
 
-        dtb_num += 1;
-        buf = Some(&slice[size..]);
+    // Offset of name in the strings block, appended if not present
+    fn string_offset(&mut self, name: &str) -> u32 {
+        let mut s = name.as_bytes().to_vec();
+        s.push(0);
+        let off = self.strings.windows(s.len()).position(|w| w == s);
+        off.unwrap_or_else(|| {
+            let off = self.strings.len();
+            self.strings.extend_from_slice(&s);
+            off
+        }) as u32
+    }
+
+    // Returns false if the node does not exist
+    fn set_prop(&mut self, path: &str, name: &str, value: &[u8]) -> LoggedResult<bool> {
+        let Some(node) = self.find_node(path) else {
+            return Ok(false);
+        };
+        let (prop, end) = self
+            .find_prop(node, name)
+            .ok_or_else(|| log_err!("invalid dtb structure"))?;
+        let name_off = self.string_offset(name);
+        let mut token = Vec::with_capacity(12 + align_4(value.len()));
+        token.extend_from_slice(&FDT_PROP.to_be_bytes());
+        token.extend_from_slice(&(value.len() as u32).to_be_bytes());
+        token.extend_from_slice(&name_off.to_be_bytes());
+        token.extend_from_slice(value);
+        token.resize(12 + align_4(value.len()), 0);
+        self.structs.splice(prop.unwrap_or(end..end), token);
+        Ok(true)
+    }
+
+    // Returns false if the property does not exist
+    fn remove_prop(&mut self, path: &str, name: &str) -> bool {
+        let Some(node) = self.find_node(path) else {
+            return false;
+        };
+        let Some((Some(prop), _)) = self.find_prop(node, name) else {
+            return false;
+        };
+        self.structs.drain(prop);
+        true
+    }
+
+    fn to_vec(&self) -> Vec<u8> {
+        let off_rsvmap = FDT_HEADER_SIZE;
+        let off_struct = off_rsvmap + self.mem_rsvmap.len();
+        let off_strings = off_struct + self.structs.len();
+        let end = off_strings + self.strings.len();
+        // Keep the following dtbs 8 bytes aligned
+        let total_size = (end + 7) & !7;
+        let mut dtb = Vec::with_capacity(total_size);
+        dtb.extend_from_slice(FDT_MAGIC);
+        for v in [
+            total_size as u32,
+            off_struct as u32,
+            off_strings as u32,
+            off_rsvmap as u32,
+            self.version,
+            self.last_comp_version,
+            self.boot_cpuid_phys,
+            self.strings.len() as u32,
+            self.structs.len() as u32,
+        ] {
+            dtb.extend_from_slice(&v.to_be_bytes());
+        }
+        dtb.extend_from_slice(&self.mem_rsvmap);
+        dtb.extend_from_slice(&self.structs);
+        dtb.extend_from_slice(&self.strings);
+        dtb.resize(total_size, 0);
+        dtb
+    }
+}
+
+#[inline(always)]
+fn align_4(x: usize) -> usize {
+    (x + 3) & !3
+}
+
+// "<cells...>" are 32-bit numbers, "[hex bytes]" are raw bytes, and anything
+// else is a string
+fn parse_prop_value(s: &str) -> LoggedResult<Vec<u8>> {
+    if let Some(cells) = s.strip_prefix('<').and_then(|s| s.strip_suffix('>')) {
+        let mut v = Vec::new();
+        for cell in cells.split_whitespace() {
+            let cell = match cell.strip_prefix("0x") {
+                Some(hex) => u32::from_str_radix(hex, 16),
+                None => cell.parse::<u32>(),
+            }
+            .map_err(|_| log_err!("invalid cell: {}", cell))?;
+            v.extend_from_slice(&cell.to_be_bytes());
+        }
+        Ok(v)
+    } else if let Some(bytes) = s.strip_prefix('[').and_then(|s| s.strip_suffix(']')) {
+        let hex: String = bytes.split_whitespace().collect();
+        if hex.len() % 2 != 0 {
+            return Err(log_err!("invalid bytes: {}", bytes));
+        }
+        (0..hex.len())
+            .step_by(2)
+            .map(|i| {
+                u8::from_str_radix(&hex[i..(i + 2)], 16)
+                    .map_err(|_| log_err!("invalid bytes: {}", bytes))
+            })
+            .collect()
+    } else {
+        let mut v = s.as_bytes().to_vec();
+        v.push(0);
+        Ok(v)
     }
-    Ok(())
 }
 
 fn find_fstab<'b, 'a: 'b>(fdt: &'b Fdt<'a>) -> Option<FdtNode<'b, 'a>> {
@@ -272,6 +639,40 @@ fn dtb_patch(file: &Utf8CStr) -> LoggedResult<bool> {
     Ok(patched)
 }
 
+// Sets the property if value is Some, removes it otherwise. Only the dtbs that
+// changed are rebuilt, then the whole file is written back.
+fn dtb_edit(file: &Utf8CStr, node: &str, prop: &str, value: Option<&[u8]>) -> LoggedResult<bool> {
+    eprintln!("Loading dtbs from [{}]", file);
+    let map = MappedFile::open(file)?;
+    let index = DtbIndex::new(map.as_ref())?;
+    let mut replacements = Vec::with_capacity(index.dtbs.len());
+    let mut edited = false;
+    for n in 0..index.dtbs.len() {
+        let mut fdt = FdtEditor::new(index.dtb(n))?;
+        let changed = match value {
+            Some(value) => fdt.set_prop(node, prop, value)?,
+            None => fdt.remove_prop(node, prop),
+        };
+        if changed {
+            let node = node.trim_end_matches('/');
+            match value {
+                Some(_) => eprintln!("Set [{}/{}] in dtb.{:04}", node, prop, n),
+                None => eprintln!("Remove [{}/{}] in dtb.{:04}", node, prop, n),
+            }
+            edited = true;
+            replacements.push(Some(fdt.to_vec()));
+        } else {
+            replacements.push(None);
+        }
+    }
+    if edited {
+        let out = index.repack(&replacements)?;
+        drop(map);
+        replace_file(Path::new(file.as_str()), |mut f| Ok(f.write_all(&out)?))?;
+    }
+    Ok(edited)
+}
+
 pub fn dtb_commands(argc: i32, argv: *const *const c_char) -> bool {
     fn inner(argc: i32, argv: *const *const c_char) -> LoggedResult<()> {
         if argc < 1 {
@@ -298,6 +699,17 @@ pub fn dtb_commands(argc: i32, argv: *const *const c_char) -> bool {
                     exit(1);
                 }
             }
+            DtbAction::Set(Set { node, prop, value }) => {
+                let value = parse_prop_value(&value)?;
+                if !dtb_edit(file, &node, &prop, Some(&value))? {
+                    exit(1);
+                }
+            }
+            DtbAction::Remove(Remove { node, prop }) => {
+                if !dtb_edit(file, &node, &prop, None)? {
+                    exit(1);
+                }
+            }
         }
         Ok(())
     }
@@ -1,3 +1,13 @@
+#include <cstring>
+#include <algorithm>
+#include <iterator>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #include "format.hpp"
 
 Name2Fmt name2fmt;
@@ -108,3 +118,173 @@ format_t Name2Fmt::operator[](std::string_view name) {
     CHECK("lz4_lg", LZ4_LG)
     else return UNKNOWN;
 }
+
+/******************
+ * Magic scanning
+ ******************/
+
+struct scan_magic {
+    format_t fmt;
+    std::string_view magic;
+};
+
+#define MAGIC(f, s) { f, std::string_view(s, sizeof(s) - 1) }
+
+static constexpr scan_magic scan_magics[] = {
+    MAGIC(CHROMEOS, CHROMEOS_MAGIC),
+    MAGIC(AOSP, BOOT_MAGIC),
+    MAGIC(AOSP_VENDOR, VENDOR_BOOT_MAGIC),
+    MAGIC(DHTB, DHTB_MAGIC),
+    MAGIC(BLOB, TEGRABLOB_MAGIC),
+    MAGIC(DTB, DTB_MAGIC),
+    MAGIC(GZIP, GZIP1_MAGIC "\x08\x00"),
+};
+
+#undef MAGIC
+
+static constexpr int NUM_MAGICS = std::size(scan_magics);
+static constexpr size_t MAX_MAGIC_LEN = 20;
+
+static_assert(NUM_MAGICS <= 8);
+static_assert([] {
+    for (auto &m : scan_magics) {
+        if (m.magic.size() < 2 || m.magic.size() > MAX_MAGIC_LEN)
+            return false;
+    }
+    return true;
+}());
+
+using magic_offsets = std::vector<std::vector<size_t>>;
+
+// Verify a candidate, the first and last byte are already matched
+static inline void check_magic(const uint8_t *buf, size_t off, int i, magic_offsets &offs) {
+    auto m = scan_magics[i].magic;
+    if (memcmp(buf + off + 1, m.data() + 1, m.size() - 2) == 0)
+        offs[i].push_back(off);
+}
+
+// Byte by byte, only magics starting with the current byte are checked
+static void scan_scalar(const uint8_t *buf, size_t start, size_t len, magic_offsets &offs) {
+    uint8_t table[256] = {};
+    for (int i = 0; i < NUM_MAGICS; ++i)
+        table[(uint8_t) scan_magics[i].magic[0]] |= 1 << i;
+    for (size_t off = start; off < len; ++off) {
+        for (uint32_t m = table[buf[off]]; m; m &= m - 1) {
+            int i = __builtin_ctz(m);
+            auto magic = scan_magics[i].magic;
+            if (len - off >= magic.size() && buf[off + magic.size() - 1] == (uint8_t) magic.back())
+                check_magic(buf, off, i, offs);
+        }
+    }
+}
+
+// Vectorized candidate filter: compare the first and the last byte of every magic
+// against a whole vector of positions, and only verify positions where both match.
+// Returns the offset where scalar scanning has to continue.
+
+#if defined(__x86_64__) || defined(__i386__)
+
+__attribute__((target("avx2")))
+static size_t scan_avx2(const uint8_t *buf, size_t len, magic_offsets &offs) {
+    __m256i first[NUM_MAGICS], last[NUM_MAGICS];
+    for (int i = 0; i < NUM_MAGICS; ++i) {
+        first[i] = _mm256_set1_epi8(scan_magics[i].magic.front());
+        last[i] = _mm256_set1_epi8(scan_magics[i].magic.back());
+    }
+    size_t off = 0;
+    for (; off + 32 + MAX_MAGIC_LEN <= len; off += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *) (buf + off));
+        for (int i = 0; i < NUM_MAGICS; ++i) {
+            __m256i tail = _mm256_loadu_si256(
+                    (const __m256i *) (buf + off + scan_magics[i].magic.size() - 1));
+            uint32_t mask = _mm256_movemask_epi8(_mm256_and_si256(
+                    _mm256_cmpeq_epi8(block, first[i]), _mm256_cmpeq_epi8(tail, last[i])));
+            for (; mask; mask &= mask - 1)
+                check_magic(buf, off + __builtin_ctz(mask), i, offs);
+        }
+    }
+    return off;
+}
+
+static size_t scan_sse2(const uint8_t *buf, size_t len, magic_offsets &offs) {
+    __m128i first[NUM_MAGICS], last[NUM_MAGICS];
+    for (int i = 0; i < NUM_MAGICS; ++i) {
+        first[i] = _mm_set1_epi8(scan_magics[i].magic.front());
+        last[i] = _mm_set1_epi8(scan_magics[i].magic.back());
+    }
+    size_t off = 0;
+    for (; off + 16 + MAX_MAGIC_LEN <= len; off += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *) (buf + off));
+        for (int i = 0; i < NUM_MAGICS; ++i) {
+            __m128i tail = _mm_loadu_si128(
+                    (const __m128i *) (buf + off + scan_magics[i].magic.size() - 1));
+            uint32_t mask = _mm_movemask_epi8(_mm_and_si128(
+                    _mm_cmpeq_epi8(block, first[i]), _mm_cmpeq_epi8(tail, last[i])));
+            for (; mask; mask &= mask - 1)
+                check_magic(buf, off + __builtin_ctz(mask), i, offs);
+        }
+    }
+    return off;
+}
+
+static size_t scan_simd(const uint8_t *buf, size_t len, magic_offsets &offs) {
+    if (__builtin_cpu_supports("avx2"))
+        return scan_avx2(buf, len, offs);
+    return scan_sse2(buf, len, offs);
+}
+
+#elif defined(__ARM_NEON)
+
+static size_t scan_simd(const uint8_t *buf, size_t len, magic_offsets &offs) {
+    uint8x16_t first[NUM_MAGICS], last[NUM_MAGICS];
+    for (int i = 0; i < NUM_MAGICS; ++i) {
+        first[i] = vdupq_n_u8(scan_magics[i].magic.front());
+        last[i] = vdupq_n_u8(scan_magics[i].magic.back());
+    }
+    size_t off = 0;
+    for (; off + 16 + MAX_MAGIC_LEN <= len; off += 16) {
+        uint8x16_t block = vld1q_u8(buf + off);
+        for (int i = 0; i < NUM_MAGICS; ++i) {
+            uint8x16_t tail = vld1q_u8(buf + off + scan_magics[i].magic.size() - 1);
+            uint8x16_t eq = vandq_u8(vceqq_u8(block, first[i]), vceqq_u8(tail, last[i]));
+            // NEON has no movemask, narrow to 4 bits per byte and keep one bit of each
+            uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(
+                    vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0) & 0x8888888888888888ULL;
+            for (; mask; mask &= mask - 1)
+                check_magic(buf, off + __builtin_ctzll(mask) / 4, i, offs);
+        }
+    }
+    return off;
+}
+
+#else
+
+static size_t scan_simd(const uint8_t *, size_t, magic_offsets &) {
+    return 0;
+}
+
+#endif
+
+magic_index::magic_index(const void *buf, size_t len) :
+base(static_cast<const uint8_t *>(buf)), sz(len), offsets(NUM_MAGICS) {
+    size_t off = scan_simd(base, sz, offsets);
+    scan_scalar(base, off, sz, offsets);
+}
+
+const uint8_t *magic_index::find(format_t fmt, const void *buf, size_t len) const {
+    auto p = static_cast<const uint8_t *>(buf);
+    for (int i = 0; i < NUM_MAGICS; ++i) {
+        if (scan_magics[i].fmt != fmt)
+            continue;
+        auto magic = scan_magics[i].magic;
+        if (p < base || p + len > base + sz)
+            return static_cast<const uint8_t *>(memmem(p, len, magic.data(), magic.size()));
+        auto &offs = offsets[i];
+        size_t start = p - base;
+        auto it = std::lower_bound(offs.begin(), offs.end(), start);
+        if (it == offs.end() || *it + magic.size() > start + len)
+            return nullptr;
+        return base + *it;
+    }
+    return nullptr;
+}
@@ -3,13 +3,18 @@
 #![feature(iter_intersperse)]
 
 pub use base;
+use avb::{get_vbmeta, VBMeta};
 use cpio::cpio_commands;
 use dtb::dtb_commands;
 use patch::hexpatch;
 use payload::extract_boot_from_payload;
-use sign::{get_sha, sha1_hash, sha256_hash, sign_boot_image, verify_boot_image, SHA};
+use sign::{
+    get_boot_signer, get_boot_verifier, get_sha, sha1_hash, sha256_hash, sign_boot_image,
+    BootSigner, BootVerifier, SHA,
+};
 use std::env;
 
+mod avb;
 mod cpio;
 mod dtb;
 mod patch;
@@ -25,16 +30,16 @@ pub mod ffi {
     unsafe extern "C++" {
         include!("compress.hpp");
         fn decompress(buf: &[u8], fd: i32) -> bool;
+        fn decompress_to_vec(buf: &[u8], out: &mut Vec<u8>) -> bool;
+        fn compress_format(buf: &[u8]) -> &'static str;
+        fn decompress_threads() -> i32;
         fn xz(buf: &[u8], out: &mut Vec<u8>) -> bool;
         fn unxz(buf: &[u8], out: &mut Vec<u8>) -> bool;
 
-        include!("bootimg.hpp");
-        #[cxx_name = "boot_img"]
-        type BootImage;
-        #[cxx_name = "get_payload"]
-        fn payload(self: &BootImage) -> &[u8];
-        #[cxx_name = "get_tail"]
-        fn tail(self: &BootImage) -> &[u8];
+        #[cxx_name = "stream_encoder"]
+        type Encoder;
+        fn get_fd_encoder(format: &str, fd: i32) -> UniquePtr<Encoder>;
+        fn write(self: Pin<&mut Encoder>, buf: &[u8]) -> bool;
     }
 
     extern "Rust" {
@@ -45,8 +50,6 @@ pub mod ffi {
         fn output_size(self: &SHA) -> usize;
         fn sha1_hash(data: &[u8], out: &mut [u8]);
         fn sha256_hash(data: &[u8], out: &mut [u8]);
-
-        fn hexpatch(file: &[u8], from: &[u8], to: &[u8]) -> bool;
     }
 
     #[namespace = "rust"]
@@ -55,9 +58,10 @@ pub mod ffi {
             partition: *const c_char,
             in_path: *const c_char,
             out_path: *const c_char,
+            src_path: *const c_char,
         ) -> bool;
         unsafe fn cpio_commands(argc: i32, argv: *const *const c_char) -> bool;
-        unsafe fn verify_boot_image(img: &BootImage, cert: *const c_char) -> bool;
+        unsafe fn hexpatch(argc: i32, argv: *const *const c_char) -> bool;
         unsafe fn sign_boot_image(
             payload: &[u8],
             name: *const c_char,
@@ -65,6 +69,26 @@ pub mod ffi {
             key: *const c_char,
         ) -> Vec<u8>;
         unsafe fn dtb_commands(argc: i32, argv: *const *const c_char) -> bool;
+
+        type BootSigner;
+        unsafe fn get_boot_signer(
+            name: *const c_char,
+            cert: *const c_char,
+            key: *const c_char,
+        ) -> Box<BootSigner>;
+        fn update(self: &mut BootSigner, data: &[u8]);
+        fn finalize(self: &mut BootSigner) -> Vec<u8>;
+
+        type BootVerifier;
+        unsafe fn get_boot_verifier(tail: &[u8], cert: *const c_char) -> Box<BootVerifier>;
+        fn update(self: &mut BootVerifier, data: &[u8]);
+        fn finalize(self: &mut BootVerifier) -> bool;
+
+        type VBMeta;
+        unsafe fn get_vbmeta(vbmeta: &[u8], key: *const c_char) -> Box<VBMeta>;
+        fn data(self: &VBMeta) -> &[u8];
+        fn update(self: &mut VBMeta, data: &[u8]);
+        fn finalize(self: &mut VBMeta, image_size: u64, vbmeta: &mut [u8]) -> bool;
     }
 }
 
@@ -30,6 +30,7 @@ Supported actions:
     If '-h' is provided, the boot image header information will be
     dumped to the file 'header', which can be used to modify header
     configurations during repacking.
+    Hashes of decompressed components are recorded to 'comp_hash'.
     Return values:
     0:valid    1:error    2:chromeos
 
@@ -41,9 +42,21 @@ Supported actions:
     corresponding format detected in <origbootimg>. If a component file
     in the current directory is already compressed, then no addition
     compression will be performed for that specific component.
+    Components that are unchanged since unpack (according to 'comp_hash')
+    reuse the original compressed data from <origbootimg> as is, unless
+    any of the compression env variables below is set.
     If '-n' is provided, all compression operations will be skipped.
     If env variable PATCHVBMETAFLAG is set to true, all disable flags in
     the boot image's vbmeta header will be set.
+    The hash descriptor in the AVB 2.0 vbmeta is updated for the new image.
+    If env variable AVBKEY is set to an RSA private key (PEM or PKCS#8 DER),
+    the vbmeta is re-signed with it.
+    If env variable COMPRESSLEVEL is set, it is used as the compression
+    level of all components, see 'compress' for details.
+    Env variables COMPRESSWINDOW and COMPRESSBLOCK set the window and
+    block size of all components, see 'compress' for details.
+    If env variable COMPRESSTHREADS is set, components are compressed
+    in parallel blocks, see 'compress' for details.
 
   verify <bootimg> [x509.pem]
     Check whether the boot image is signed with AVB 1.0 signature.
@@ -59,19 +72,42 @@ Supported actions:
     If the certificate/private key pair is not provided, the AOSP
     verity key bundled in the executable will be used.
 
-  extract <payload.bin> [partition] [outfile]
+  extract <payload.bin> [partition] [outfile] [srcfile]
+  extract <payload.bin> <partition1,partition2,...|all> [outdir] [srcdir]
     Extract [partition] from <payload.bin> to [outfile].
     If [outfile] is not specified, then output to '[partition].img'.
     If [partition] is not specified, then attempt to extract either
     'init_boot' or 'boot'. Which partition was chosen can be determined
     by whichever 'init_boot.img' or 'boot.img' exists.
+    A comma separated list of partitions, or 'all', extracts all of them
+    in a single pass to '[outdir]/<partition>.img' (default outdir: '.').
+    Delta payloads are applied on top of the old partition image [srcfile],
+    or '[srcdir]/<partition>.img' for multiple partitions, and the results
+    are verified with the hashes in the payload.
+    Supported operations: REPLACE, REPLACE_BZ, REPLACE_XZ, ZERO, DISCARD,
+    SOURCE_COPY, and SOURCE_BSDIFF whose bsdiff streams are bzip2
+    compressed or uncompressed. BROTLI_BSDIFF, brotli compressed bsdiff
+    streams, PUFFDIFF, ZUCCHINI and LZ4DIFF are not supported; such
+    payloads are rejected before any output is written (for STDIN input,
+    the bsdiff compressors are only checked when the patch is reached).
     <payload.bin> can be '-' to be STDIN.
 
-  hexpatch <file> <hexpattern1> <hexpattern2>
+  hexpatch <file> <hexpattern1> <hexpattern2> [<hexpattern1> <hexpattern2>...]
+  hexpatch <file> -f <patchfile> [<hexpattern1> <hexpattern2>...]
     Search <hexpattern1> in <file>, and replace it with <hexpattern2>
+    Multiple pairs are applied in a single pass over the original content,
+    and the number of hits for each pair is reported.
+    <patchfile> contains one '<hexpattern1> <hexpattern2>' pair per line,
+    lines starting with '#' are ignored.
 
-  cpio <incpio> [commands...]
+  cpio [-c <format>|-k] [-d] [-f <script>] <incpio> [commands...]
     Do cpio commands to <incpio> (modifications are done in-place).
+    With -f, commands are also read from <script> ('-' for STDIN), one
+    per line. <incpio> is loaded and written back only once.
+    A compressed <incpio> is decompressed on load.
+    With -c, the result is compressed with <format> while being written.
+    With -k, the result is compressed with the format of <incpio>.
+    With -d, identical regular files are stored once as hardlinks.
     Each command is a single argument; add quotes for each command.
     See "cpio --help" for supported commands.
 
@@ -88,12 +124,27 @@ Supported actions:
   cleanup
     Cleanup the current working directory
 
-  compress[=format] <infile> [outfile]
+  compress[=format[:level[:window[:block]]]] <infile> [outfile]
     Compress <infile> with [format] to [outfile].
     <infile>/[outfile] can be '-' to be STDIN/STDOUT.
     If [format] is not specified, then gzip will be used.
+    If [level] is not specified, env variable COMPRESSLEVEL is used, or
+    the best compression of the format by default. Levels are format
+    specific: gzip 0-9, zopfli 1-15 (iterations), xz/lzma 0-9,
+    bzip2 1-9, lz4/lz4_legacy/lz4_lg 0-12.
+    [window] is the deflate window (gzip/zopfli, up to 32K) or the
+    dictionary size (xz/lzma). [block] is the input block size of
+    the multi-threaded mode (gzip, zopfli, xz, lz4, lz4_legacy, lz4_lg).
+    Sizes take an optional K/M/G suffix, and default to env variables
+    COMPRESSWINDOW and COMPRESSBLOCK, or the format defaults.
+    Empty fields keep their defaults, e.g. 'xz::64M'.
     If [outfile] is not specified, then <infile> will be replaced
     with another file suffixed with a matching file extension.
+    If env variable COMPRESSTHREADS is set to a number > 1 (or 0 for all
+    online CPUs), gzip, zopfli, xz, lz4, lz4_legacy and lz4_lg input is
+    split into independent blocks and compressed by multiple threads.
+    The output is a valid single stream, but differs from the default
+    single-threaded output.
     Supported formats: )EOF", arg0);
 
     print_formats();
@@ -105,6 +156,9 @@ Supported actions:
     <infile>/[outfile] can be '-' to be STDIN/STDOUT.
     If [outfile] is not specified, then <infile> will be replaced
     with another file removing its archive format file extension.
+    If <infile> is a regular file, multi-member gzip, multi-block xz and
+    lz4 input is decoded by all online CPUs; set env variable
+    COMPRESSTHREADS to limit the threads. Other input is streamed.
     Supported formats: )EOF");
 
     print_formats();
@@ -135,6 +189,7 @@ int main(int argc, char *argv[]) {
         unlink(EXTRA_FILE);
         unlink(RECV_DTBO_FILE);
         unlink(DTB_FILE);
+        unlink(COMP_HASH_FILE);
     } else if (argc > 2 && action == "sha1") {
         uint8_t sha1[20];
         {
@@ -188,7 +243,7 @@ int main(int argc, char *argv[]) {
     } else if (argc > 2 && str_starts(action, "compress")) {
         compress(action[8] == '=' ? &action[9] : "gzip", argv[2], argv[3]);
     } else if (argc > 4 && action == "hexpatch") {
-        return hexpatch(byte_view(argv[2]), byte_view(argv[3]), byte_view(argv[4])) ? 0 : 1;
+        return rust::hexpatch(argc - 2, argv + 2) ? 0 : 1;
     } else if (argc > 2 && action == "cpio") {
         return rust::cpio_commands(argc - 2, argv + 2) ? 0 : 1;
     } else if (argc > 2 && action == "dtb") {
@@ -197,7 +252,8 @@ int main(int argc, char *argv[]) {
         return rust::extract_boot_from_payload(
                 argv[2],
                 argc > 3 ? argv[3] : nullptr,
-                argc > 4 ? argv[4] : nullptr
+                argc > 4 ? argv[4] : nullptr,
+                argc > 5 ? argv[5] : nullptr
                 ) ? 0 : 1;
     } else {
         usage(argv[0]);
@@ -1,88 +1,140 @@
-use base::{LoggedResult, MappedFile, MutBytesExt, Utf8CStr};
-
-// SAFETY: assert(buf.len() >= 1) && assert(len <= buf.len())
-macro_rules! match_patterns {
-    ($buf:ident, $($str:literal), *) => {{
-        let mut len = if *$buf.get_unchecked(0) == b',' { 1 } else { 0 };
-        let b = $buf.get_unchecked(len..);
-        let found = if b.is_empty() {
-            false
+use std::collections::VecDeque;
+use std::fs::read_to_string;
+
+use base::libc::c_char;
+use base::{log_err, map_args, LoggedResult, MappedFile, Utf8CStr};
+
+// A dense Aho-Corasick automaton, used to find any number of patterns
+// in a single pass over the buffer.
+struct Matcher {
+    // 256 transitions per state, state 0 is the root
+    delta: Vec<u32>,
+    // Indices of all patterns ending at each state
+    out: Vec<Vec<u32>>,
+    lens: Vec<usize>,
+}
+
+impl Matcher {
+    // Empty patterns are not allowed
+    fn new<T: AsRef<[u8]>>(patterns: &[T]) -> Matcher {
+        let mut delta = vec![0_u32; 256];
+        let mut out: Vec<Vec<u32>> = vec![Vec::new()];
+        let mut lens = Vec::with_capacity(patterns.len());
+
+        // Build the trie, 0 means no edge as nothing ever goes back to root
+        for (i, p) in patterns.iter().enumerate() {
+            let p = p.as_ref();
+            let mut s = 0_usize;
+            for b in p {
+                let t = s * 256 + *b as usize;
+                if delta[t] == 0 {
+                    delta[t] = out.len() as u32;
+                    delta.resize(delta.len() + 256, 0);
+                    out.push(Vec::new());
+                }
+                s = delta[t] as usize;
+            }
+            out[s].push(i as u32);
+            lens.push(p.len());
         }
-        $(
-        else if b.starts_with($str) {
-            len += $str.len();
-            true
+
+        // Resolve failure links breadth first and fill in the missing
+        // transitions, turning the trie into a DFA
+        let mut fail = vec![0_u32; out.len()];
+        let mut queue: VecDeque<u32> = delta[..256].iter().filter(|t| **t != 0).copied().collect();
+        while let Some(s) = queue.pop_front() {
+            let s = s as usize;
+            let f = fail[s] as usize;
+            if !out[f].is_empty() {
+                let inherited = out[f].clone();
+                out[s].extend(inherited);
+            }
+            for b in 0..256 {
+                let t = delta[s * 256 + b];
+                if t != 0 {
+                    fail[t as usize] = delta[f * 256 + b];
+                    queue.push_back(t);
+                } else {
+                    delta[s * 256 + b] = delta[f * 256 + b];
+                }
+            }
         }
-        )*
-        else {
-            false
-        };
-        if found {
-            let b = $buf.get_unchecked(len..);
-            if !b.is_empty() && b[0] == b'=' {
-                for c in b.iter() {
-                    if b" \n\0".contains(c) {
-                        break;
-                    }
-                    len += 1;
+
+        Matcher { delta, out, lens }
+    }
+
+    fn len(&self, idx: usize) -> usize {
+        self.lens[idx]
+    }
+
+    // Returns all (possibly overlapping) matches as (offset, pattern index),
+    // ordered by offset, then longest pattern first, then pattern index.
+    fn find_all(&self, buf: &[u8]) -> Vec<(usize, usize)> {
+        let mut v = Vec::new();
+        let mut s = 0_usize;
+        for (i, b) in buf.iter().enumerate() {
+            s = self.delta[s * 256 + *b as usize] as usize;
+            let out = &self.out[s];
+            if !out.is_empty() {
+                for idx in out {
+                    let idx = *idx as usize;
+                    v.push((i + 1 - self.lens[idx], idx));
                 }
             }
-            Some(len)
-        } else {
-            None
         }
-    }};
+        v.sort_unstable_by_key(|(off, idx)| (*off, usize::MAX - self.lens[*idx], *idx));
+        v
+    }
 }
 
-fn remove_pattern(buf: &mut [u8], pattern_matcher: unsafe fn(&[u8]) -> Option<usize>) -> usize {
+// Remove every keyword along with an optional leading ',' and trailing '=value'
+fn remove_pattern(buf: &mut [u8], matcher: &Matcher) -> usize {
     let mut write = 0_usize;
     let mut read = 0_usize;
-    let mut sz = buf.len();
-    // SAFETY: assert(write <= read) && assert(read <= buf.len())
-    unsafe {
-        while read < buf.len() {
-            if let Some(len) = pattern_matcher(buf.get_unchecked(read..)) {
-                let skipped = buf.get_unchecked(read..(read + len));
-                // SAFETY: all matching patterns are ASCII bytes
-                let skipped = std::str::from_utf8_unchecked(skipped);
-                eprintln!("Remove pattern [{}]", skipped);
-                sz -= len;
-                read += len;
-            } else {
-                *buf.get_unchecked_mut(write) = *buf.get_unchecked(read);
-                write += 1;
-                read += 1;
+    for (off, idx) in matcher.find_all(buf) {
+        if off < read {
+            continue;
+        }
+        let start = if off > read && buf[off - 1] == b',' {
+            off - 1
+        } else {
+            off
+        };
+        let mut end = off + matcher.len(idx);
+        if end < buf.len() && buf[end] == b'=' {
+            while end < buf.len() && !b" \n\0".contains(&buf[end]) {
+                end += 1;
             }
         }
+        eprintln!(
+            "Remove pattern [{}]",
+            String::from_utf8_lossy(&buf[start..end])
+        );
+        buf.copy_within(read..start, write);
+        write += start - read;
+        read = end;
     }
-    if let Some(buf) = buf.get_mut(write..) {
-        buf.fill(0);
-    }
-    sz
+    buf.copy_within(read.., write);
+    write += buf.len() - read;
+    buf[write..].fill(0);
+    write
 }
 
 pub fn patch_verity(buf: &mut [u8]) -> usize {
-    unsafe fn match_verity_pattern(buf: &[u8]) -> Option<usize> {
-        match_patterns!(
-            buf,
-            b"verifyatboot",
-            b"verify",
-            b"avb_keys",
-            b"avb",
-            b"support_scfs",
-            b"fsverity"
-        )
-    }
-
-    remove_pattern(buf, match_verity_pattern)
+    let matcher = Matcher::new(&[
+        "verifyatboot",
+        "verify",
+        "avb_keys",
+        "avb",
+        "support_scfs",
+        "fsverity",
+    ]);
+    remove_pattern(buf, &matcher)
 }
 
 pub fn patch_encryption(buf: &mut [u8]) -> usize {
-    unsafe fn match_encryption_pattern(buf: &[u8]) -> Option<usize> {
-        match_patterns!(buf, b"forceencrypt", b"forcefdeorfbe", b"fileencryption")
-    }
-
-    remove_pattern(buf, match_encryption_pattern)
+    let matcher = Matcher::new(&["forceencrypt", "forcefdeorfbe", "fileencryption"]);
+    remove_pattern(buf, &matcher)
 }
 
 fn hex2byte(hex: &[u8]) -> Vec<u8> {
@@ -100,22 +152,93 @@ fn hex2byte(hex: &[u8]) -> Vec<u8> {
     v
 }
 
-pub fn hexpatch(file: &[u8], from: &[u8], to: &[u8]) -> bool {
-    fn inner(file: &[u8], from: &[u8], to: &[u8]) -> LoggedResult<bool> {
-        let file = Utf8CStr::from_bytes(file)?;
-        let from = Utf8CStr::from_bytes(from)?;
-        let to = Utf8CStr::from_bytes(to)?;
-
-        let mut map = MappedFile::open_rw(file)?;
+// Apply all patches in a single pass over the file. Every pattern is matched
+// against the original content; at each offset the longest pattern wins.
+fn patch_all(buf: &mut [u8], pairs: &[(&str, &str)]) -> LoggedResult<Vec<usize>> {
+    let mut patterns = Vec::with_capacity(pairs.len());
+    let mut patches = Vec::with_capacity(pairs.len());
+    for (from, to) in pairs {
         let pattern = hex2byte(from.as_bytes());
-        let patch = hex2byte(to.as_bytes());
+        if pattern.is_empty() {
+            return Err(log_err!("Invalid hex pattern: {}", from));
+        }
+        patterns.push(pattern);
+        patches.push(hex2byte(to.as_bytes()));
+    }
 
-        let v = map.patch(pattern.as_slice(), patch.as_slice());
-        for off in &v {
-            eprintln!("Patch @ {:#010X} [{}] -> [{}]", off, from, to);
+    let matcher = Matcher::new(&patterns);
+    let mut hits = vec![0_usize; pairs.len()];
+    let mut next = 0_usize;
+    for (off, idx) in matcher.find_all(buf) {
+        if off < next {
+            continue;
+        }
+        let (from, to) = pairs[idx];
+        let end = off + patterns[idx].len();
+        let patch = &patches[idx];
+        let len = patch.len().min(buf.len() - off);
+        buf[off..end].fill(0);
+        buf[off..off + len].copy_from_slice(&patch[..len]);
+        eprintln!("Patch @ {:#010X} [{}] -> [{}]", off, from, to);
+        hits[idx] += 1;
+        next = end;
+    }
+    Ok(hits)
+}
+
+fn parse_patch_file(file: &str) -> LoggedResult<Vec<(String, String)>> {
+    let content = read_to_string(file)?;
+    let mut pairs = Vec::new();
+    for line in content.lines() {
+        let line = line.trim();
+        if line.is_empty() || line.starts_with('#') {
+            continue;
+        }
+        let mut it = line.split_whitespace();
+        match (it.next(), it.next(), it.next()) {
+            (Some(from), Some(to), None) => pairs.push((from.to_string(), to.to_string())),
+            _ => return Err(log_err!("Invalid patch line: {}", line)),
+        }
+    }
+    Ok(pairs)
+}
+
+pub fn hexpatch(argc: i32, argv: *const *const c_char) -> bool {
+    fn inner(argc: i32, argv: *const *const c_char) -> LoggedResult<bool> {
+        let args = map_args(argc, argv)?;
+        let Some((file, mut args)) = args.split_first() else {
+            return Err(log_err!("No arguments"));
+        };
+
+        let mut owned = Vec::new();
+        if let [flag, patch_file, rest @ ..] = args {
+            if *flag == "-f" {
+                owned = parse_patch_file(patch_file)?;
+                args = rest;
+            }
+        }
+        if args.len() % 2 != 0 {
+            return Err(log_err!("Unpaired hex pattern: {}", args[args.len() - 1]));
+        }
+        let mut pairs: Vec<(&str, &str)> = owned
+            .iter()
+            .map(|(from, to)| (from.as_str(), to.as_str()))
+            .collect();
+        pairs.extend(args.chunks(2).map(|p| (p[0], p[1])));
+        if pairs.is_empty() {
+            return Err(log_err!("No patterns"));
+        }
+
+        let mut file = file.to_string();
+        let mut map = MappedFile::open_rw(Utf8CStr::from_string(&mut file))?;
+        let hits = patch_all(map.as_mut(), &pairs)?;
+        if pairs.len() > 1 {
+            for ((from, to), n) in pairs.iter().zip(&hits) {
+                eprintln!("[{}] -> [{}]: {} hit(s)", from, to, n);
+            }
         }
 
-        Ok(!v.is_empty())
+        Ok(hits.iter().any(|n| *n > 0))
     }
-    inner(file, from, to).unwrap_or(false)
+    inner(argc, argv).unwrap_or(false)
 }
@@ -1,17 +1,24 @@
-use std::fs::File;
-use std::io::{BufReader, Read, Seek, SeekFrom, Write};
-use std::os::fd::{AsRawFd, FromRawFd};
+use std::fs::{create_dir_all, File};
+use std::io::{BufReader, Read};
+use std::os::fd::FromRawFd;
+use std::os::unix::fs::FileExt;
+use std::path::Path;
+use std::sync::atomic::{AtomicBool, AtomicUsize, Ordering};
+use std::thread;
 
 use byteorder::{BigEndian, ReadBytesExt};
 use quick_protobuf::{BytesReader, MessageRead};
+use sha2::{Digest, Sha256};
 
 use base::libc::c_char;
+use base::ResultExt;
 use base::{error, LoggedError, LoggedResult, ReadSeekExt, StrErr, Utf8CStr};
-use base::{ResultExt, WriteExt};
 
 use crate::ffi;
 use crate::proto::update_metadata::mod_InstallOperation::Type;
-use crate::proto::update_metadata::DeltaArchiveManifest;
+use crate::proto::update_metadata::{
+    DeltaArchiveManifest, Extent, InstallOperation, PartitionUpdate,
+};
 
 macro_rules! bad_payload {
     ($msg:literal) => {{
@@ -26,16 +33,34 @@ macro_rules! bad_payload {
 
 const PAYLOAD_MAGIC: &str = "CrAU";
 
+// Everything an install operation needs to produce one partition
+struct Target<'a> {
+    partition: &'a PartitionUpdate,
+    out: File,
+    // Old partition image, only required by delta operations
+    src: Option<File>,
+}
+
+#[derive(Default)]
+struct OpBuffers {
+    src: Vec<u8>,
+    out: Vec<u8>,
+}
+
 fn do_extract_boot_from_payload(
     in_path: &Utf8CStr,
     partition_name: Option<&Utf8CStr>,
     out_path: Option<&Utf8CStr>,
+    src_path: Option<&Utf8CStr>,
 ) -> LoggedResult<()> {
-    let mut reader = BufReader::new(if in_path == "-" {
+    let in_file = if in_path == "-" {
         unsafe { File::from_raw_fd(0) }
     } else {
         File::open(in_path).log_with_msg(|w| write!(w, "Cannot open '{}'", in_path))?
-    });
+    };
+    // Only regular files can be read at random offsets by multiple threads
+    let seekable = in_file.metadata().map_or(false, |m| m.is_file());
+    let mut reader = BufReader::new(in_file);
 
     let buf = &mut [0u8; 4];
     reader.read_exact(buf)?;
@@ -67,15 +92,18 @@ fn do_extract_boot_from_payload(
         let mut br = BytesReader::from_bytes(manifest);
         DeltaArchiveManifest::from_reader(&mut br, manifest)?
     };
-    if manifest.get_minor_version() != 0 {
+    if manifest.get_minor_version() != 0 && src_path.is_none() {
         return Err(bad_payload!(
-            "delta payloads are not supported, please use a full payload file"
+            "delta payloads require the source image, or use a full payload file"
         ));
     }
 
     let block_size = manifest.get_block_size() as u64;
 
-    let partition = match partition_name {
+    // A comma separated list or 'all' extracts multiple partitions into a directory
+    let multiple = partition_name.map_or(false, |n| n == "all" || n.contains(','));
+
+    let partitions: Vec<&PartitionUpdate> = match partition_name {
         None => {
             let boot = manifest
                 .partitions
@@ -88,91 +116,501 @@ fn do_extract_boot_from_payload(
                     .iter()
                     .find(|p| p.partition_name == "boot"),
             };
-            boot.ok_or_else(|| bad_payload!("boot partition not found"))?
+            vec![boot.ok_or_else(|| bad_payload!("boot partition not found"))?]
         }
-        Some(name) => manifest
-            .partitions
-            .iter()
-            .find(|p| p.partition_name.as_str() == name)
-            .ok_or_else(|| bad_payload!("partition '{}' not found", name))?,
-    };
-
-    let out_str: String;
-    let out_path = match out_path {
-        None => {
-            out_str = format!("{}.img", partition.partition_name);
-            out_str.as_str()
+        Some(names) if names == "all" => manifest.partitions.iter().collect(),
+        Some(names) => {
+            let mut v: Vec<&PartitionUpdate> = Vec::new();
+            for name in names.split(',').filter(|n| !n.is_empty()) {
+                let partition = manifest
+                    .partitions
+                    .iter()
+                    .find(|p| p.partition_name.as_str() == name)
+                    .ok_or_else(|| bad_payload!("partition '{}' not found", name))?;
+                if !v
+                    .iter()
+                    .any(|p| p.partition_name == partition.partition_name)
+                {
+                    v.push(partition);
+                }
+            }
+            v
         }
-        Some(s) => s,
     };
+    if partitions.is_empty() {
+        return Err(bad_payload!("no partitions to extract"));
+    }
 
-    let mut out_file =
-        File::create(out_path).log_with_msg(|w| write!(w, "Cannot write to '{}'", out_path))?;
+    let data_start = 24 + manifest_len as u64 + manifest_sig_len as u64;
+    check_operations(&partitions, seekable.then(|| reader.get_ref()), data_start)?;
+
+    let mut targets = Vec::with_capacity(partitions.len());
+    if multiple {
+        let out_dir = Path::new(out_path.map_or(".", |s| s));
+        create_dir_all(out_dir)
+            .log_with_msg(|w| write!(w, "Cannot create directory '{}'", out_dir.display()))?;
+        for &partition in &partitions {
+            let name = format!("{}.img", partition.partition_name);
+            // Missing source images only matter if the partition has delta operations
+            let src = match src_path {
+                Some(dir) => File::open(Path::new(dir).join(&name)).ok(),
+                None => None,
+            };
+            targets.push(Target {
+                partition,
+                out: create_output(&out_dir.join(&name))?,
+                src,
+            });
+        }
+    } else {
+        let out_str: String;
+        let out_path = match out_path {
+            None => {
+                out_str = format!("{}.img", partitions[0].partition_name);
+                out_str.as_str()
+            }
+            Some(s) => s,
+        };
+        let src = match src_path {
+            Some(s) => Some(File::open(s).log_with_msg(|w| write!(w, "Cannot open '{}'", s))?),
+            None => None,
+        };
+        targets.push(Target {
+            partition: partitions[0],
+            out: create_output(Path::new(out_path))?,
+            src,
+        });
+    }
 
     // Skip the manifest signature
     reader.skip(manifest_sig_len as usize)?;
 
-    // Sort the install operations with data_offset so we will only ever need to seek forward
+    // Merge the install operations of all partitions and sort them with data_offset so the
+    // data section is visited once and we will only ever need to seek forward.
     // This makes it possible to support non-seekable input file descriptors
-    let mut operations = partition.operations.clone();
-    operations.sort_by_key(|e| e.data_offset.unwrap_or(0));
-    let mut curr_data_offset: u64 = 0;
-
-    for operation in operations.iter() {
-        let data_len = operation
-            .data_length
-            .ok_or_else(|| bad_payload!("data length not found"))? as usize;
+    let mut operations: Vec<(usize, &InstallOperation)> = partitions
+        .iter()
+        .enumerate()
+        .flat_map(|(i, p)| p.operations.iter().map(move |op| (i, op)))
+        .collect();
+    operations.sort_by_key(|(_, e)| e.data_offset.unwrap_or(0));
 
-        let data_offset = operation
-            .data_offset
-            .ok_or_else(|| bad_payload!("data offset not found"))?;
+    if seekable {
+        extract_parallel(
+            reader.get_ref(),
+            data_start,
+            &operations,
+            block_size,
+            &targets,
+        )?;
+        return verify_targets(&targets);
+    }
 
-        let data_type = operation.type_pb;
+    let mut bufs = OpBuffers::default();
+    let mut curr_data_offset: u64 = 0;
 
+    for (i, operation) in operations.iter() {
+        let data_len = operation.data_length.unwrap_or(0) as usize;
         buf.resize(data_len, 0u8);
         let data = &mut buf[..data_len];
 
-        // Skip to the next offset and read data
-        let skip = data_offset - curr_data_offset;
-        reader.skip(skip as usize)?;
-        reader.read_exact(data)?;
-        curr_data_offset = data_offset + data_len as u64;
+        if data_len > 0 {
+            let data_offset = operation
+                .data_offset
+                .ok_or_else(|| bad_payload!("data offset not found"))?;
+
+            // Skip to the next offset and read data
+            let skip = data_offset - curr_data_offset;
+            reader.skip(skip as usize)?;
+            reader.read_exact(data)?;
+            curr_data_offset = data_offset + data_len as u64;
+        }
+
+        apply_operation(operation, data, block_size, &targets[*i], &mut bufs)?;
+    }
+
+    verify_targets(&targets)
+}
+
+fn create_output(path: &Path) -> LoggedResult<File> {
+    // Also opened for reading to verify the final image of delta updates
+    File::options()
+        .read(true)
+        .write(true)
+        .create(true)
+        .truncate(true)
+        .open(path)
+        .log_with_msg(|w| write!(w, "Cannot write to '{}'", path.display()))
+}
 
-        let out_offset = operation
-            .dst_extents
-            .get(0)
-            .ok_or_else(|| bad_payload!("dst extents not found"))?
+// Only partitions rebuilt from a source image are checked, full payloads are
+// authenticated as a whole by their signature
+fn verify_targets(targets: &[Target]) -> LoggedResult<()> {
+    for target in targets.iter().filter(|t| t.src.is_some()) {
+        let Some(info) = &target.partition.new_partition_info else {
+            continue;
+        };
+        let (Some(size), Some(hash)) = (info.size, &info.hash) else {
+            continue;
+        };
+        let mut sha = Sha256::new();
+        let mut buf = vec![0_u8; 1024 * 1024];
+        let mut off = 0_u64;
+        while off < size {
+            let len = buf.len().min((size - off) as usize);
+            target.out.read_exact_at(&mut buf[..len], off)?;
+            sha.update(&buf[..len]);
+            off += len as u64;
+        }
+        if sha.finalize().as_slice() != hash.as_slice() {
+            return Err(bad_payload!(
+                "hash mismatch of partition '{}'",
+                target.partition.partition_name
+            ));
+        }
+    }
+    Ok(())
+}
+
+// Each worker reads the data blob of an operation with pread and writes its
+// extents with pwrite, so operations can be processed in any order.
+fn extract_parallel(
+    in_file: &File,
+    data_start: u64,
+    operations: &[(usize, &InstallOperation)],
+    block_size: u64,
+    targets: &[Target],
+) -> LoggedResult<()> {
+    let threads = (ffi::decompress_threads().max(1) as usize).min(operations.len().max(1));
+    let next = AtomicUsize::new(0);
+    let failed = AtomicBool::new(false);
+
+    let worker = || -> LoggedResult<()> {
+        let mut data = Vec::new();
+        let mut bufs = OpBuffers::default();
+        while !failed.load(Ordering::Relaxed) {
+            let Some((i, operation)) = operations.get(next.fetch_add(1, Ordering::Relaxed)) else {
+                break;
+            };
+            let result = (|| -> LoggedResult<()> {
+                let data_len = operation.data_length.unwrap_or(0) as usize;
+                data.resize(data_len, 0u8);
+                if data_len > 0 {
+                    let data_offset = operation
+                        .data_offset
+                        .ok_or_else(|| bad_payload!("data offset not found"))?;
+                    in_file.read_exact_at(&mut data, data_start + data_offset)?;
+                }
+                apply_operation(operation, &data, block_size, &targets[*i], &mut bufs)
+            })();
+            if result.is_err() {
+                failed.store(true, Ordering::Relaxed);
+                return result;
+            }
+        }
+        Ok(())
+    };
+
+    thread::scope(|s| {
+        let handles: Vec<_> = (1..threads).map(|_| s.spawn(worker)).collect();
+        let mut result = worker();
+        for h in handles {
+            let r = h.join().unwrap_or_else(|_| Err(LoggedError::default()));
+            result = result.and(r);
+        }
+        result
+    })
+}
+
+fn write_extents(
+    extents: &[Extent],
+    mut data: &[u8],
+    block_size: u64,
+    out_file: &File,
+) -> LoggedResult<()> {
+    for ext in extents {
+        if data.is_empty() {
+            break;
+        }
+        let offset = ext
+            .start_block
+            .ok_or_else(|| bad_payload!("start block not found"))?
+            * block_size;
+        let len = ext
+            .num_blocks
+            .ok_or_else(|| bad_payload!("num blocks not found"))?
+            * block_size;
+        let len = data.len().min(len as usize);
+        out_file.write_all_at(&data[..len], offset)?;
+        data = &data[len..];
+    }
+    Ok(())
+}
+
+fn read_extents(
+    extents: &[Extent],
+    len: Option<u64>,
+    block_size: u64,
+    src_file: &File,
+    buf: &mut Vec<u8>,
+) -> LoggedResult<()> {
+    buf.clear();
+    for ext in extents {
+        let offset = ext
             .start_block
             .ok_or_else(|| bad_payload!("start block not found"))?
             * block_size;
+        let num_blocks = ext
+            .num_blocks
+            .ok_or_else(|| bad_payload!("num blocks not found"))?;
+        let start = buf.len();
+        buf.resize(start + (num_blocks * block_size) as usize, 0);
+        src_file.read_exact_at(&mut buf[start..], offset)?;
+    }
+    if let Some(len) = len {
+        if len as usize > buf.len() {
+            return Err(bad_payload!("src length exceeds src extents"));
+        }
+        buf.truncate(len as usize);
+    }
+    Ok(())
+}
+
+// Negative numbers are stored as sign and magnitude
+fn offtin(buf: &[u8]) -> i64 {
+    let v = u64::from_le_bytes(buf[..8].try_into().unwrap());
+    let mag = (v & !(1 << 63)) as i64;
+    if v & (1 << 63) != 0 {
+        -mag
+    } else {
+        mag
+    }
+}
+
+// Reject payloads with anything we cannot apply before any output is created.
+// The compressors of bsdiff patches are only known from the patch data, which can
+// be peeked at if the payload is a regular file.
+fn check_operations(
+    partitions: &[&PartitionUpdate],
+    payload: Option<&File>,
+    data_start: u64,
+) -> LoggedResult<()> {
+    for partition in partitions {
+        for op in partition.operations.iter() {
+            match op.type_pb {
+                Type::REPLACE
+                | Type::REPLACE_BZ
+                | Type::REPLACE_XZ
+                | Type::ZERO
+                | Type::DISCARD
+                | Type::SOURCE_COPY => continue,
+                Type::SOURCE_BSDIFF => {}
+                t => {
+                    return Err(bad_payload!(
+                        "operation {:?} of partition '{}' is not supported",
+                        t,
+                        partition.partition_name
+                    ))
+                }
+            }
+            let (Some(file), Some(offset)) = (payload, op.data_offset) else {
+                continue;
+            };
+            let mut header = [0u8; 8];
+            file.read_exact_at(&mut header, data_start + offset)?;
+            if header.starts_with(b"BSDF2") && header[5..].iter().any(|&alg| alg == 2) {
+                return Err(bad_payload!(
+                    "brotli compressed bsdiff of partition '{}' is not supported",
+                    partition.partition_name
+                ));
+            }
+        }
+    }
+    Ok(())
+}
+
+fn bsdiff_stream<'a>(alg: u8, data: &'a [u8], buf: &'a mut Vec<u8>) -> LoggedResult<&'a [u8]> {
+    match alg {
+        0 => Ok(data),
+        1 => {
+            buf.clear();
+            if !data.starts_with(b"BZh") || !ffi::decompress_to_vec(data, buf) {
+                return Err(bad_payload!("corrupted bsdiff bzip2 stream"));
+            }
+            Ok(buf.as_slice())
+        }
+        2 => Err(bad_payload!("brotli compressed bsdiff is not supported")),
+        _ => Err(bad_payload!("unknown bsdiff compressor: {}", alg)),
+    }
+}
+
+// Apply either a legacy BSDIFF40 patch (all streams bzip2) or a BSDF2 patch,
+// which records the compressor of its control, diff and extra streams.
+fn bspatch(patch: &[u8], old: &[u8], new: &mut Vec<u8>) -> LoggedResult<()> {
+    if patch.len() < 32 {
+        return Err(bad_payload!("bsdiff patch too short"));
+    }
+    let algs = if patch.starts_with(b"BSDIFF40") {
+        [1, 1, 1]
+    } else if patch.starts_with(b"BSDF2") {
+        [patch[5], patch[6], patch[7]]
+    } else {
+        return Err(bad_payload!("invalid bsdiff magic"));
+    };
+    let ctrl_len = offtin(&patch[8..]);
+    let diff_len = offtin(&patch[16..]);
+    let new_size = offtin(&patch[24..]);
+    if ctrl_len < 0 || diff_len < 0 || new_size < 0 {
+        return Err(bad_payload!("invalid bsdiff header"));
+    }
+    let (ctrl_len, diff_len, new_size) = (ctrl_len as usize, diff_len as usize, new_size as usize);
+    let body = &patch[32..];
+    if ctrl_len > body.len() || diff_len > body.len() - ctrl_len {
+        return Err(bad_payload!("bsdiff patch too short"));
+    }
+
+    let mut bufs: [Vec<u8>; 3] = Default::default();
+    let [ctrl_buf, diff_buf, extra_buf] = &mut bufs;
+    let ctrl = bsdiff_stream(algs[0], &body[..ctrl_len], ctrl_buf)?;
+    let diff = bsdiff_stream(algs[1], &body[ctrl_len..ctrl_len + diff_len], diff_buf)?;
+    let extra = bsdiff_stream(algs[2], &body[ctrl_len + diff_len..], extra_buf)?;
+
+    new.clear();
+    new.resize(new_size, 0);
+    let (mut new_pos, mut old_pos) = (0_usize, 0_i64);
+    let (mut diff_pos, mut extra_pos) = (0_usize, 0_usize);
+    for triple in ctrl.chunks_exact(24) {
+        if new_pos >= new_size {
+            break;
+        }
+        let x = offtin(&triple[0..]);
+        let y = offtin(&triple[8..]);
+        let z = offtin(&triple[16..]);
+        if x < 0 || y < 0 {
+            return Err(bad_payload!("corrupted bsdiff control stream"));
+        }
+        let (x, y) = (x as usize, y as usize);
+        if x > new_size - new_pos || x > diff.len() - diff_pos {
+            return Err(bad_payload!("corrupted bsdiff diff stream"));
+        }
 
-        match data_type {
-            Type::REPLACE => {
-                out_file.seek(SeekFrom::Start(out_offset))?;
-                out_file.write_all(data)?;
+        // Add old data to the diff
+        let out = &mut new[new_pos..new_pos + x];
+        out.copy_from_slice(&diff[diff_pos..diff_pos + x]);
+        let lo = old_pos.clamp(0, old.len() as i64) as usize;
+        let hi = (old_pos + x as i64).clamp(0, old.len() as i64) as usize;
+        if lo < hi {
+            let skip = (lo as i64 - old_pos) as usize;
+            for (o, b) in out[skip..skip + hi - lo].iter_mut().zip(&old[lo..hi]) {
+                *o = o.wrapping_add(*b);
             }
-            Type::ZERO => {
-                for ext in operation.dst_extents.iter() {
-                    let out_seek = ext
-                        .start_block
-                        .ok_or_else(|| bad_payload!("start block not found"))?
-                        * block_size;
-                    let num_blocks = ext
-                        .num_blocks
-                        .ok_or_else(|| bad_payload!("num blocks not found"))?;
-                    out_file.seek(SeekFrom::Start(out_seek))?;
-                    out_file.write_zeros(num_blocks as usize)?;
+        }
+        new_pos += x;
+        diff_pos += x;
+        old_pos += x as i64;
+
+        // Copy the extra data
+        if y > new_size - new_pos || y > extra.len() - extra_pos {
+            return Err(bad_payload!("corrupted bsdiff extra stream"));
+        }
+        new[new_pos..new_pos + y].copy_from_slice(&extra[extra_pos..extra_pos + y]);
+        new_pos += y;
+        extra_pos += y;
+        old_pos += z;
+    }
+    if new_pos != new_size {
+        return Err(bad_payload!("corrupted bsdiff control stream"));
+    }
+    Ok(())
+}
+
+fn check_sha256(data: &[u8], hash: &Option<Vec<u8>>, what: &str) -> LoggedResult<()> {
+    if let Some(hash) = hash {
+        if Sha256::digest(data).as_slice() != hash.as_slice() {
+            return Err(bad_payload!("{} hash mismatch", what));
+        }
+    }
+    Ok(())
+}
+
+fn apply_operation(
+    operation: &InstallOperation,
+    data: &[u8],
+    block_size: u64,
+    target: &Target,
+    bufs: &mut OpBuffers,
+) -> LoggedResult<()> {
+    if operation.dst_extents.is_empty() {
+        return Err(bad_payload!("dst extents not found"));
+    }
+    let out_file = &target.out;
+
+    // Read and verify the source data of delta operations
+    if matches!(operation.type_pb, Type::SOURCE_COPY | Type::SOURCE_BSDIFF) {
+        let src_file = target.src.as_ref().ok_or_else(|| {
+            bad_payload!(
+                "source image of '{}' is required",
+                target.partition.partition_name
+            )
+        })?;
+        check_sha256(data, &operation.data_sha256_hash, "data")?;
+        read_extents(
+            &operation.src_extents,
+            operation.src_length,
+            block_size,
+            src_file,
+            &mut bufs.src,
+        )?;
+        check_sha256(&bufs.src, &operation.src_sha256_hash, "source")?;
+    }
+
+    match operation.type_pb {
+        Type::REPLACE => {
+            write_extents(&operation.dst_extents, data, block_size, out_file)?;
+        }
+        Type::ZERO => {
+            let zeros = [0_u8; 4096];
+            for ext in operation.dst_extents.iter() {
+                let mut offset = ext
+                    .start_block
+                    .ok_or_else(|| bad_payload!("start block not found"))?
+                    * block_size;
+                let mut len = ext
+                    .num_blocks
+                    .ok_or_else(|| bad_payload!("num blocks not found"))?
+                    * block_size;
+                while len > 0 {
+                    let l = len.min(zeros.len() as u64);
+                    out_file.write_all_at(&zeros[..l as usize], offset)?;
+                    offset += l;
+                    len -= l;
                 }
             }
-            Type::REPLACE_BZ | Type::REPLACE_XZ => {
-                out_file.seek(SeekFrom::Start(out_offset))?;
-                if !ffi::decompress(data, out_file.as_raw_fd()) {
-                    return Err(bad_payload!("decompression failed"));
+        }
+        Type::REPLACE_BZ | Type::REPLACE_XZ => {
+            bufs.out.clear();
+            if !ffi::decompress_to_vec(data, &mut bufs.out) {
+                return Err(bad_payload!("decompression failed"));
+            }
+            write_extents(&operation.dst_extents, &bufs.out, block_size, out_file)?;
+        }
+        Type::DISCARD => {
+            // The destination blocks read as undefined, leave them untouched
+        }
+        Type::SOURCE_COPY => {
+            write_extents(&operation.dst_extents, &bufs.src, block_size, out_file)?;
+        }
+        Type::SOURCE_BSDIFF => {
+            bspatch(data, &bufs.src, &mut bufs.out)?;
+            if let Some(len) = operation.dst_length {
+                if len as usize != bufs.out.len() {
+                    return Err(bad_payload!("dst length mismatch"));
                 }
             }
-            _ => return Err(bad_payload!("unsupported operation type")),
-        };
-    }
+            write_extents(&operation.dst_extents, &bufs.out, block_size, out_file)?;
+        }
+        t => return Err(bad_payload!("unsupported operation type: {:?}", t)),
+    };
 
     Ok(())
 }
@@ -181,11 +619,13 @@ pub fn extract_boot_from_payload(
     in_path: *const c_char,
     partition: *const c_char,
     out_path: *const c_char,
+    src_path: *const c_char,
 ) -> bool {
     fn inner(
         in_path: *const c_char,
         partition: *const c_char,
         out_path: *const c_char,
+        src_path: *const c_char,
     ) -> LoggedResult<()> {
         let in_path = unsafe { Utf8CStr::from_ptr(in_path) }?;
         let partition = match unsafe { Utf8CStr::from_ptr(partition) } {
@@ -198,8 +638,13 @@ pub fn extract_boot_from_payload(
             Err(StrErr::NullPointerError) => None,
             Err(e) => Err(e)?,
         };
-        do_extract_boot_from_payload(in_path, partition, out_path)
+        let src_path = match unsafe { Utf8CStr::from_ptr(src_path) } {
+            Ok(s) => Some(s),
+            Err(StrErr::NullPointerError) => None,
+            Err(e) => Err(e)?,
+        };
+        do_extract_boot_from_payload(in_path, partition, out_path, src_path)
             .log_with_msg(|w| w.write_str("Failed to extract from payload"))
     }
-    inner(in_path, partition, out_path).is_ok()
+    inner(in_path, partition, out_path, src_path).is_ok()
 }
@@ -1,19 +1,25 @@
 use std::cmp::Ordering;
-use std::collections::HashMap;
+use std::collections::{BTreeMap, HashMap};
 use std::str::from_utf8;
+use std::sync::atomic::{self, AtomicUsize};
+use std::sync::Mutex;
+use std::thread;
 
 use base::libc::{S_IFDIR, S_IFMT, S_IFREG};
 use base::{LoggedResult, Utf8CStr};
+use sha2::{Digest, Sha256};
 
 use crate::check_env;
-use crate::cpio::{Cpio, CpioEntry};
+use crate::cpio::{Cpio, CpioData, CpioEntry, CpioPath};
+use crate::ffi::{compress_format, decompress_threads};
 use crate::patch::{patch_encryption, patch_verity};
 
 pub trait MagiskCpio {
     fn patch(&mut self);
     fn test(&self) -> i32;
     fn restore(&mut self) -> LoggedResult<()>;
-    fn backup(&mut self, origin: &Utf8CStr, skip_compress: bool) -> LoggedResult<()>;
+    // Returns whether the backups differ from the ones already in the archive
+    fn backup(&mut self, origin: &Utf8CStr, skip_compress: bool) -> LoggedResult<bool>;
 }
 
 const MAGISK_PATCHED: i32 = 1 << 0;
@@ -38,18 +44,20 @@ impl MagiskCpio for Cpio {
             if !keep_verity {
                 if fstab {
                     eprintln!("Found fstab file [{}]", name);
-                    let len = patch_verity(entry.data.as_mut_slice());
-                    if len != entry.data.len() {
-                        entry.data.resize(len, 0);
+                    let data = entry.data.to_mut();
+                    let len = patch_verity(data.as_mut_slice());
+                    if len != data.len() {
+                        data.resize(len, 0);
                     }
                 } else if name == "verity_key" {
                     return false;
                 }
             }
             if !keep_force_encrypt && fstab {
-                let len = patch_encryption(entry.data.as_mut_slice());
-                if len != entry.data.len() {
-                    entry.data.resize(len, 0);
+                let data = entry.data.to_mut();
+                let len = patch_encryption(data.as_mut_slice());
+                if len != data.len() {
+                    data.resize(len, 0);
                 }
             }
             true
@@ -85,25 +93,32 @@ impl MagiskCpio for Cpio {
     }
 
     fn restore(&mut self) -> LoggedResult<()> {
-        let mut backups = HashMap::<String, Box<CpioEntry>>::new();
+        let mut backups = BTreeMap::<CpioPath, CpioEntry>::new();
         let mut rm_list = String::new();
+        let mut jobs = Vec::new();
         self.entries
             .extract_if(|name, _| name.starts_with(".backup/"))
-            .for_each(|(name, mut entry)| {
+            .for_each(|(name, entry)| {
                 if name == ".backup/.rmlist" {
                     if let Ok(data) = from_utf8(&entry.data) {
                         rm_list.push_str(data);
                     }
-                } else if name != ".backup/.magisk" {
-                    let new_name = if name.ends_with(".xz") && entry.decompress() {
-                        &name[8..name.len() - 3]
-                    } else {
-                        &name[8..]
-                    };
-                    eprintln!("Restore [{}] -> [{}]", name, new_name);
-                    backups.insert(new_name.to_string(), entry);
+                } else if name != ".backup/.magisk" && name != ".backup/.sha256" {
+                    jobs.push((name, entry, false));
                 }
             });
+        par_for_each(&mut jobs, |(name, entry, xz)| {
+            *xz = name.ends_with(".xz") && entry.decompress();
+        });
+        for (name, entry, xz) in jobs {
+            let new_name = if xz {
+                &name[8..name.len() - 3]
+            } else {
+                &name[8..]
+            };
+            eprintln!("Restore [{}] -> [{}]", name, new_name);
+            backups.insert(new_name.to_string().into(), entry);
+        }
         self.rm(".backup", false);
         if rm_list.is_empty() && backups.is_empty() {
             self.entries.clear();
@@ -119,31 +134,49 @@ impl MagiskCpio for Cpio {
         Ok(())
     }
 
-    fn backup(&mut self, origin: &Utf8CStr, skip_compress: bool) -> LoggedResult<()> {
-        let mut backups = HashMap::<String, Box<CpioEntry>>::new();
+    fn backup(&mut self, origin: &Utf8CStr, skip_compress: bool) -> LoggedResult<bool> {
+        let mut backups = BTreeMap::<CpioPath, CpioEntry>::new();
         let mut rm_list = String::new();
         backups.insert(
-            ".backup".to_string(),
-            Box::new(CpioEntry {
+            ".backup".to_string().into(),
+            CpioEntry {
                 mode: S_IFDIR,
                 uid: 0,
                 gid: 0,
                 rdevmajor: 0,
                 rdevminor: 0,
-                data: vec![],
-            }),
+                data: CpioData::default(),
+            },
         );
         let mut o = Cpio::load_from_file(origin)?;
         o.rm(".backup", true);
+        let prev: BTreeMap<_, _> = self
+            .entries
+            .iter()
+            .filter(|(name, _)| name.as_str() == ".backup" || name.starts_with(".backup/"))
+            .map(|(name, entry)| (name.clone(), entry.clone()))
+            .collect();
+        // Existing compressed backups are reused if the digest of their content is unchanged
+        let mut digests = self
+            .entries
+            .get(".backup/.sha256")
+            .map(|e| parse_digests(&e.data))
+            .unwrap_or_default();
+        let mut old: BTreeMap<_, _> = self
+            .entries
+            .extract_if(|name, _| name.starts_with(".backup/") && name.ends_with(".xz"))
+            .collect();
         self.rm(".backup", true);
 
+        let mut jobs = Vec::new();
+
         let mut lhs = o.entries.into_iter().peekable();
         let mut rhs = self.entries.iter().peekable();
 
         loop {
             enum Action<'a> {
-                Backup(String, Box<CpioEntry>),
-                Record(&'a String),
+                Backup(CpioPath, CpioEntry),
+                Record(&'a CpioPath),
                 Noop,
             }
             let action = match (lhs.peek(), rhs.peek()) {
@@ -155,7 +188,7 @@ impl MagiskCpio for Cpio {
                     Ordering::Greater => Action::Record(rhs.next().unwrap().0),
                     Ordering::Equal => {
                         let (l, le) = lhs.next().unwrap();
-                        let action = if re.data != le.data {
+                        let action = if *re.data != *le.data {
                             Action::Backup(l, le)
                         } else {
                             Action::Noop
@@ -174,14 +207,18 @@ impl MagiskCpio for Cpio {
                 }
             };
             match action {
-                Action::Backup(name, mut entry) => {
-                    let backup = if !skip_compress && entry.compress() {
-                        format!(".backup/{}.xz", name)
-                    } else {
-                        format!(".backup/{}", name)
-                    };
-                    eprintln!("Backup [{}] -> [{}]", name, backup);
-                    backups.insert(backup, entry);
+                Action::Backup(name, entry) => {
+                    let old = old
+                        .remove(format!(".backup/{}.xz", name).as_str())
+                        .filter(|old| compress_format(&old.data) == "xz")
+                        .zip(digests.remove(name.as_str()));
+                    jobs.push(BackupJob {
+                        name,
+                        entry,
+                        old,
+                        digest: None,
+                        xz: false,
+                    });
                 }
                 Action::Record(name) => {
                     eprintln!("Record new entry: [{}] -> [.backup/.rmlist]", name);
@@ -190,21 +227,120 @@ impl MagiskCpio for Cpio {
                 Action::Noop => {}
             }
         }
+        if !skip_compress {
+            par_for_each(&mut jobs, BackupJob::compress);
+        }
+        let mut digest_list = Vec::new();
+        for job in jobs {
+            if let (true, Some(digest)) = (job.xz, job.digest) {
+                digest_list.extend_from_slice(&digest);
+                digest_list.extend_from_slice(job.name.as_bytes());
+                digest_list.push(0);
+            }
+            let backup = if job.xz {
+                format!(".backup/{}.xz", job.name)
+            } else {
+                format!(".backup/{}", job.name)
+            };
+            eprintln!("Backup [{}] -> [{}]", job.name, backup);
+            backups.insert(backup.into(), job.entry);
+        }
+        if !digest_list.is_empty() {
+            backups.insert(
+                ".backup/.sha256".to_string().into(),
+                CpioEntry {
+                    mode: S_IFREG,
+                    uid: 0,
+                    gid: 0,
+                    rdevmajor: 0,
+                    rdevminor: 0,
+                    data: digest_list.into(),
+                },
+            );
+        }
         if !rm_list.is_empty() {
             backups.insert(
-                ".backup/.rmlist".to_string(),
-                Box::new(CpioEntry {
+                ".backup/.rmlist".to_string().into(),
+                CpioEntry {
                     mode: S_IFREG,
                     uid: 0,
                     gid: 0,
                     rdevmajor: 0,
                     rdevminor: 0,
-                    data: rm_list.as_bytes().to_vec(),
-                }),
+                    data: rm_list.into_bytes().into(),
+                },
             );
         }
+        let changed = backups.len() != prev.len()
+            || backups
+                .iter()
+                .zip(prev.iter())
+                .any(|((n1, e1), (n2, e2))| n1 != n2 || e1 != e2);
         self.entries.extend(backups);
 
-        Ok(())
+        Ok(changed)
+    }
+}
+
+struct BackupJob {
+    name: CpioPath,
+    entry: CpioEntry,
+    // The existing xz backup of the entry, and the digest of its content
+    old: Option<(CpioEntry, [u8; 32])>,
+    // Digest of the entry content, recorded in .backup/.sha256 for the next backup
+    digest: Option<[u8; 32]>,
+    xz: bool,
+}
+
+impl BackupJob {
+    fn compress(&mut self) {
+        if self.entry.mode & S_IFMT == S_IFREG {
+            let digest: [u8; 32] = Sha256::digest(&*self.entry.data).into();
+            self.digest = Some(digest);
+            if let Some((old, old_digest)) = self.old.take() {
+                if old_digest == digest {
+                    self.entry.data = old.data;
+                    self.xz = true;
+                    return;
+                }
+            }
+        }
+        self.xz = self.entry.compress();
     }
 }
+
+// .backup/.sha256 is a list of the sha256 digest of an xz backup's content,
+// followed by the NUL terminated name of the backed up entry
+fn parse_digests(mut data: &[u8]) -> HashMap<String, [u8; 32]> {
+    let mut digests = HashMap::new();
+    while data.len() > 32 {
+        let (digest, rest) = data.split_at(32);
+        let Some(end) = rest.iter().position(|&b| b == 0) else {
+            break;
+        };
+        if let Ok(name) = from_utf8(&rest[..end]) {
+            digests.insert(name.to_owned(), digest.try_into().unwrap());
+        }
+        data = &rest[end + 1..];
+    }
+    digests
+}
+
+// Runs f on each item on a pool of worker threads. Each item is independent,
+// so the results do not depend on the number of threads.
+fn par_for_each<T: Send>(items: &mut [T], f: impl Fn(&mut T) + Sync) {
+    let threads = (decompress_threads().max(1) as usize).min(items.len());
+    let items: Vec<_> = items.iter_mut().map(Mutex::new).collect();
+    let next = AtomicUsize::new(0);
+    let worker = || {
+        while let Some(item) = items.get(next.fetch_add(1, atomic::Ordering::Relaxed)) {
+            f(&mut item.lock().unwrap());
+        }
+    };
+    thread::scope(|s| {
+        for _ in 1..threads {
+            s.spawn(worker);
+        }
+        worker();
+    });
+}
@@ -25,8 +25,6 @@ use x509_cert::Certificate;
 use base::libc::c_char;
 use base::{log_err, LoggedResult, MappedFile, ResultExt, StrErr, Utf8CStr};
 
-use crate::ffi::BootImage;
-
 #[allow(clippy::upper_case_acronyms)]
 pub enum SHA {
     SHA1(Sha1),
@@ -215,28 +213,14 @@ struct BootSignature {
     signature: OctetString,
 }
 
-impl BootSignature {
-    fn verify(self, payload: &[u8]) -> LoggedResult<()> {
-        if self.authenticated_attributes.length as usize != payload.len() {
-            return Err(log_err!("Invalid image size"));
-        }
-        let mut verifier = Verifier::from_public_key(
-            self.certificate
-                .tbs_certificate
-                .subject_public_key_info
-                .owned_to_ref(),
-        )?;
-        verifier.update(payload);
-        let attr = self.authenticated_attributes.to_der()?;
-        verifier.update(attr.as_slice());
-        verifier.verify(self.signature.as_bytes())?;
-        Ok(())
-    }
+struct BootVerifierState {
+    verifier: Verifier,
+    attr: AuthenticatedAttributes,
+    signature: OctetString,
 }
 
-pub fn verify_boot_image(img: &BootImage, cert: *const c_char) -> bool {
-    fn inner(img: &BootImage, cert: *const c_char) -> LoggedResult<()> {
-        let tail = img.tail();
+impl BootVerifierState {
+    fn new(tail: &[u8], cert: *const c_char) -> LoggedResult<Self> {
         // Don't use BootSignature::from_der because tail might have trailing zeros
         let mut reader = SliceReader::new(tail)?;
         let mut sig = BootSignature::decode(&mut reader)?;
@@ -248,10 +232,58 @@ pub fn verify_boot_image(img: &BootImage, cert: *const c_char) -> bool {
             Err(StrErr::NullPointerError) => {}
             Err(e) => Err(e)?,
         };
-        sig.verify(img.payload())?;
-        Ok(())
+        Ok(BootVerifierState {
+            verifier: Verifier::from_public_key(
+                sig.certificate
+                    .tbs_certificate
+                    .subject_public_key_info
+                    .owned_to_ref(),
+            )?,
+            attr: sig.authenticated_attributes,
+            signature: sig.signature,
+        })
+    }
+}
+
+// Verifies the AVB 1.0 signature of a boot image, with the payload fed in blocks
+pub struct BootVerifier {
+    state: Option<BootVerifierState>,
+    length: u64,
+}
+
+impl BootVerifier {
+    pub fn update(&mut self, data: &[u8]) {
+        if let Some(state) = &mut self.state {
+            state.verifier.update(data);
+        }
+        self.length += data.len() as u64;
+    }
+
+    pub fn finalize(&mut self) -> bool {
+        fn inner(state: BootVerifierState, length: u64) -> LoggedResult<()> {
+            let BootVerifierState {
+                mut verifier,
+                attr,
+                signature,
+            } = state;
+            if attr.length != length {
+                return Err(log_err!("Invalid image size"));
+            }
+            verifier.update(attr.to_der()?.as_slice());
+            verifier.verify(signature.as_bytes())
+        }
+        match self.state.take() {
+            Some(state) => inner(state, self.length).is_ok(),
+            None => false,
+        }
     }
-    inner(img, cert).is_ok()
+}
+
+pub fn get_boot_verifier(tail: &[u8], cert: *const c_char) -> Box<BootVerifier> {
+    Box::new(BootVerifier {
+        state: BootVerifierState::new(tail, cert).ok(),
+        length: 0,
+    })
 }
 
 enum Bytes {
@@ -271,18 +303,14 @@ impl AsRef<[u8]> for Bytes {
 const VERITY_PEM: &[u8] = include_bytes!("../../../tools/keys/verity.x509.pem");
 const VERITY_PK8: &[u8] = include_bytes!("../../../tools/keys/verity.pk8");
 
-pub fn sign_boot_image(
-    payload: &[u8],
-    name: *const c_char,
-    cert: *const c_char,
-    key: *const c_char,
-) -> Vec<u8> {
-    fn inner(
-        payload: &[u8],
-        name: *const c_char,
-        cert: *const c_char,
-        key: *const c_char,
-    ) -> LoggedResult<Vec<u8>> {
+struct BootSignerState {
+    signer: Signer,
+    cert: Certificate,
+    target: PrintableString,
+}
+
+impl BootSignerState {
+    fn new(name: *const c_char, cert: *const c_char, key: *const c_char) -> LoggedResult<Self> {
         // Process arguments
         let name = unsafe { Utf8CStr::from_ptr(name) }?;
         let cert = match unsafe { Utf8CStr::from_ptr(cert) } {
@@ -297,28 +325,78 @@ pub fn sign_boot_image(
         };
 
         // Parse cert and private key
-        let cert = Certificate::from_pem(cert)?;
-        let mut signer = Signer::from_private_key(key.as_ref())?;
-
-        // Sign image
-        let attr = AuthenticatedAttributes {
+        Ok(BootSignerState {
+            signer: Signer::from_private_key(key.as_ref())?,
+            cert: Certificate::from_pem(cert)?,
             target: PrintableString::new(name.as_bytes())?,
-            length: payload.len() as u64,
-        };
-        signer.update(payload);
-        signer.update(attr.to_der()?.as_slice());
-        let sig = signer.sign()?;
-
-        // Create BootSignature DER
-        let alg_id = cert.signature_algorithm.clone();
-        let sig = BootSignature {
-            format_version: 1,
-            certificate: cert,
-            algorithm_identifier: alg_id,
-            authenticated_attributes: attr,
-            signature: OctetString::new(sig)?,
-        };
-        sig.to_der().log()
+        })
+    }
+}
+
+// Signs a boot image with AVB 1.0 signature, with the payload fed in blocks
+pub struct BootSigner {
+    state: Option<BootSignerState>,
+    length: u64,
+}
+
+impl BootSigner {
+    pub fn update(&mut self, data: &[u8]) {
+        if let Some(state) = &mut self.state {
+            state.signer.update(data);
+        }
+        self.length += data.len() as u64;
+    }
+
+    // Returns the DER encoded BootSignature, or empty on error
+    pub fn finalize(&mut self) -> Vec<u8> {
+        fn inner(state: BootSignerState, length: u64) -> LoggedResult<Vec<u8>> {
+            let BootSignerState {
+                mut signer,
+                cert,
+                target,
+            } = state;
+
+            // Sign image
+            let attr = AuthenticatedAttributes { target, length };
+            signer.update(attr.to_der()?.as_slice());
+            let sig = signer.sign()?;
+
+            // Create BootSignature DER
+            let alg_id = cert.signature_algorithm.clone();
+            let sig = BootSignature {
+                format_version: 1,
+                certificate: cert,
+                algorithm_identifier: alg_id,
+                authenticated_attributes: attr,
+                signature: OctetString::new(sig)?,
+            };
+            sig.to_der().log()
+        }
+        match self.state.take() {
+            Some(state) => inner(state, self.length).unwrap_or_default(),
+            None => Vec::new(),
+        }
     }
-    inner(payload, name, cert, key).unwrap_or_default()
+}
+
+pub fn get_boot_signer(
+    name: *const c_char,
+    cert: *const c_char,
+    key: *const c_char,
+) -> Box<BootSigner> {
+    Box::new(BootSigner {
+        state: BootSignerState::new(name, cert, key).ok(),
+        length: 0,
+    })
+}
+
+pub fn sign_boot_image(
+    payload: &[u8],
+    name: *const c_char,
+    cert: *const c_char,
+    key: *const c_char,
+) -> Vec<u8> {
+    let mut signer = get_boot_signer(name, cert, key);
+    signer.update(payload);
+    signer.finalize()
 }
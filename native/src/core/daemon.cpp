@@ -2,6 +2,12 @@
 #include <libgen.h>
 #include <sys/un.h>
 #include <sys/mount.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
 
 #include <consts.hpp>
 #include <base.hpp>
@@ -16,28 +22,64 @@ int SDK_INT = -1;
 
 static struct stat self_st;
 
-static map<int, poll_callback> *poll_map;
-static vector<pollfd> *poll_fds;
-static int poll_ctrl;
-
 int magisktmpfs_fd = -1;
 bool HAVE_32 = false;
 
-enum {
-    POLL_CTRL_NEW,
-    POLL_CTRL_RM,
+/*
+ * Event loop
+ *
+ * All fds are watched by one epoll instance, and each registration carries its own
+ * poll_entry as the epoll user data, so an event is dispatched without any lookup.
+ * epoll_ctl is thread safe, so fds can be registered from any thread directly.
+ * Unregistered entries are retired and only freed (and closed if requested) by the
+ * event loop after it has dispatched the current batch of events, so a pending
+ * event can never refer to a freed entry or to a recycled fd.
+ */
+
+struct poll_entry {
+    pollfd pfd;
+    poll_callback callback;
+    atomic<bool> active;
+    bool auto_close;
 };
 
-void register_poll(const pollfd *pfd, poll_callback callback) {
-    if (gettid() == getpid()) {
-        // On main thread, directly modify
-        poll_map->try_emplace(pfd->fd, callback);
-        poll_fds->emplace_back(*pfd);
-    } else {
-        // Send it to poll_ctrl
-        write_int(poll_ctrl, POLL_CTRL_NEW);
-        xwrite(poll_ctrl, pfd, sizeof(*pfd));
-        xwrite(poll_ctrl, &callback, sizeof(callback));
+#define MAX_EVENTS 64
+
+static int epoll_fd = -1;
+// An eventfd to wake up the event loop when entries are retired on other threads
+static int poll_wake = -1;
+
+// The following variables should be guarded by poll_lock
+static pthread_mutex_t poll_lock = PTHREAD_MUTEX_INITIALIZER;
+static vector<poll_entry *> *poll_entries;  // Indexed by fd
+static vector<poll_entry *> *poll_retired;
+
+// poll_lock has to be held
+static void retire_entry(poll_entry *e, bool auto_close) {
+    e->active = false;
+    e->auto_close = auto_close;
+    poll_retired->push_back(e);
+}
+
+void register_poll(const pollfd *pfd, poll_callback callback, uint32_t epoll_flags) {
+    auto e = new poll_entry{ *pfd, callback, true, false };
+    epoll_event ev{};
+    ev.events = static_cast<uint16_t>(pfd->events) | epoll_flags;
+    ev.data.ptr = e;
+
+    mutex_guard g(poll_lock);
+    if (pfd->fd >= (int) poll_entries->size())
+        poll_entries->resize(pfd->fd + 1);
+    auto &slot = (*poll_entries)[pfd->fd];
+    if (slot) {
+        // The fd is either registered again or was closed without unregistering
+        retire_entry(slot, false);
+    }
+    slot = e;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, pfd->fd, &ev) < 0) {
+        if (errno != EEXIST || epoll_ctl(epoll_fd, EPOLL_CTL_MOD, pfd->fd, &ev) < 0) {
+            PLOGE("epoll_ctl");
+        }
     }
 }
 
@@ -45,89 +87,140 @@ void unregister_poll(int fd, bool auto_close) {
     if (fd < 0)
         return;
 
-    if (gettid() == getpid()) {
-        // On main thread, directly modify
-        poll_map->erase(fd);
-        for (auto &poll_fd : *poll_fds) {
-            if (poll_fd.fd == fd) {
-                if (auto_close) {
-                    close(poll_fd.fd);
-                }
-                // Cannot modify while iterating, invalidate it instead
-                // It will be removed in the next poll loop
-                poll_fd.fd = -1;
-                break;
-            }
-        }
-    } else {
-        // Send it to poll_ctrl
-        write_int(poll_ctrl, POLL_CTRL_RM);
-        write_int(poll_ctrl, fd);
-        write_int(poll_ctrl, auto_close);
+    mutex_guard g(poll_lock);
+    if (fd >= (int) poll_entries->size() || (*poll_entries)[fd] == nullptr)
+        return;
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+    retire_entry((*poll_entries)[fd], auto_close);
+    (*poll_entries)[fd] = nullptr;
+    if (gettid() != getpid()) {
+        // Let the event loop release the entry
+        eventfd_write(poll_wake, 1);
     }
 }
 
-void clear_poll() {
-    if (poll_fds) {
-        for (auto &poll_fd : *poll_fds) {
-            close(poll_fd.fd);
-        }
+int register_timer(const timespec &interval, poll_callback callback) {
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (fd < 0) {
+        PLOGE("timerfd_create");
+        return -1;
     }
-    delete poll_fds;
-    delete poll_map;
-    poll_fds = nullptr;
-    poll_map = nullptr;
+    itimerspec spec = { interval, interval };
+    timerfd_settime(fd, 0, &spec, nullptr);
+    pollfd pfd = { fd, POLLIN, 0 };
+    register_poll(&pfd, callback);
+    return fd;
 }
 
-static void poll_ctrl_handler(pollfd *pfd) {
-    int code = read_int(pfd->fd);
-    switch (code) {
-    case POLL_CTRL_NEW: {
-        pollfd new_fd{};
-        poll_callback cb;
-        xxread(pfd->fd, &new_fd, sizeof(new_fd));
-        xxread(pfd->fd, &cb, sizeof(cb));
-        register_poll(&new_fd, cb);
-        break;
+int register_signal(int sig, poll_callback callback) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, sig);
+    // The signal is only delivered through the signalfd if it is blocked
+    pthread_sigmask(SIG_BLOCK, &mask, nullptr);
+    int fd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+    if (fd < 0) {
+        PLOGE("signalfd");
+        return -1;
     }
-    case POLL_CTRL_RM: {
-        int fd = read_int(pfd->fd);
-        bool auto_close = read_int(pfd->fd);
-        unregister_poll(fd, auto_close);
-        break;
+    pollfd pfd = { fd, POLLIN, 0 };
+    register_poll(&pfd, callback);
+    return fd;
+}
+
+// Free retired entries, only called on the event loop
+static void release_retired() {
+    vector<poll_entry *> retired;
+    {
+        mutex_guard g(poll_lock);
+        retired.swap(*poll_retired);
     }
-    default:
-        __builtin_unreachable();
+    for (auto e : retired) {
+        if (e->auto_close)
+            close(e->pfd.fd);
+        delete e;
     }
 }
 
-[[noreturn]] static void poll_loop() {
-    // Register poll_ctrl
-    auto pipefd = array<int, 2>{-1, -1};
-    xpipe2(pipefd, O_CLOEXEC);
-    poll_ctrl = pipefd[1];
-    pollfd poll_ctrl_pfd = { pipefd[0], POLLIN, 0 };
-    register_poll(&poll_ctrl_pfd, poll_ctrl_handler);
+void clear_poll() {
+    // Called after fork, no other threads exist in the child
+    if (poll_entries) {
+        for (auto e : *poll_entries) {
+            if (e) {
+                close(e->pfd.fd);
+                delete e;
+            }
+        }
+        for (auto e : *poll_retired) {
+            if (e->auto_close)
+                close(e->pfd.fd);
+            delete e;
+        }
+    }
+    delete poll_entries;
+    delete poll_retired;
+    poll_entries = nullptr;
+    poll_retired = nullptr;
+    close(poll_wake);
+    close(epoll_fd);
+    poll_wake = -1;
+    epoll_fd = -1;
+    pthread_mutex_init(&poll_lock, nullptr);
+}
 
+[[noreturn]] static void poll_loop() {
+    epoll_event events[MAX_EVENTS];
     for (;;) {
-        if (poll(poll_fds->data(), poll_fds->size(), -1) <= 0)
-            continue;
-
-        // MUST iterate with index because any poll_callback could add new elements to poll_fds
-        for (int i = 0; i < poll_fds->size();) {
-            auto &pfd = (*poll_fds)[i];
-            if (pfd.revents) {
-                if (pfd.revents & POLLERR || pfd.revents & POLLNVAL) {
-                    poll_map->erase(pfd.fd);
-                    poll_fds->erase(poll_fds->begin() + i);
-                    continue;
-                }
-                if (auto it = poll_map->find(pfd.fd); it != poll_map->end()) {
-                    it->second(&pfd);
-                }
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            // Only possible with a broken epoll fd, nothing can be served anymore
+            PLOGE("epoll_wait");
+            exit(1);
+        }
+        uint64_t start = monotonic_ns();
+        for (int i = 0; i < n; ++i) {
+            auto e = static_cast<poll_entry *>(events[i].data.ptr);
+            if (e == nullptr) {
+                eventfd_t v;
+                eventfd_read(poll_wake, &v);
+                continue;
+            }
+            // The entry could be unregistered by a previous callback in this batch
+            if (!e->active)
+                continue;
+            if (events[i].events & EPOLLERR) {
+                unregister_poll(e->pfd.fd, false);
+                continue;
             }
-            ++i;
+            e->pfd.revents = static_cast<short>(events[i].events);
+            e->callback(&e->pfd);
         }
+        release_retired();
+        record_poll_batch(n, monotonic_ns() - start);
+    }
+}
+
+static void init_poll() {
+    default_new(poll_entries);
+    default_new(poll_retired);
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        PLOGE("epoll_create1");
+        exit(1);
+    }
+    poll_wake = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (poll_wake < 0) {
+        PLOGE("eventfd");
+        exit(1);
+    }
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.ptr = nullptr;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, poll_wake, &ev) < 0) {
+        PLOGE("epoll_ctl");
+        exit(1);
     }
 }
 
@@ -181,6 +274,9 @@ static void handle_request_async(int client, int code, const sock_cred &cred) {
     case +RequestCode::ZYGISK:
         zygisk_handler(client, &cred);
         break;
+    case +RequestCode::GET_STATS:
+        dump_stats(client);
+        break;
     default:
         __builtin_unreachable();
     }
@@ -232,15 +328,78 @@ static bool is_client(pid_t pid) {
     return !(stat(path, &st) || st.st_size != self_st.st_size);
 }
 
-static bool is_selinux_enforced() {
-    int fd = (selinux_enabled())? xopen("/sys/fs/selinux/enforce", O_RDONLY) : -1;
+/*
+ * SELinux enforcing state, only accessed on the event loop.
+ *
+ * The state is read from the kernel's status page, which the kernel updates on
+ * every setenforce. Without the status page, the enforce file is read once and
+ * then re-read whenever inotify reports a write to it.
+ */
+
+// struct selinux_kernel_status in the kernel
+struct selinux_status {
+    uint32_t version;
+    uint32_t sequence;
+    uint32_t enforcing;
+    uint32_t policyload;
+    uint32_t deny_unknown;
+};
+
+static const volatile selinux_status *se_status = nullptr;
+static bool se_enforced = false;
+
+static void read_enforce() {
+    char c = '0';
+    int fd = xopen("/sys/fs/selinux/enforce", O_RDONLY | O_CLOEXEC);
     if (fd >= 0) {
-        char c;
         read(fd, &c, sizeof(char));
         close(fd);
-        return c != '0';
     }
-    return false;
+    se_enforced = c != '0';
+}
+
+static void init_selinux_enforce() {
+    if (!selinux_enabled())
+        return;
+    int fd = open("/sys/fs/selinux/status", O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        void *p = mmap(nullptr, sizeof(selinux_status), PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (p != MAP_FAILED) {
+            se_status = static_cast<selinux_status *>(p);
+            return;
+        }
+    }
+
+    read_enforce();
+    fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (fd < 0 || inotify_add_watch(fd, "/sys/fs/selinux/enforce", IN_MODIFY) < 0) {
+        PLOGE("inotify enforce");
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+    pollfd pfd = { fd, POLLIN, 0 };
+    register_poll(&pfd, [](pollfd *pfd) {
+        char buf[512];
+        while (read(pfd->fd, buf, sizeof(buf)) > 0);
+        read_enforce();
+    });
+}
+
+static bool is_selinux_enforced() {
+    if (se_status) {
+        // The sequence is odd while the kernel is updating the page
+        uint32_t seq, enforcing;
+        do {
+            seq = se_status->sequence;
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            enforcing = se_status->enforcing;
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        } while ((seq & 1) || seq != se_status->sequence);
+        return enforcing != 0;
+    }
+    return se_enforced;
 }
 
 static void handle_request(pollfd *pfd) {
@@ -274,6 +433,7 @@ static void handle_request(pollfd *pfd) {
     }
 
     // Check client permissions
+    RespondCode res = RespondCode::OK;
     switch (code) {
     case +RequestCode::POST_FS_DATA:
     case +RequestCode::LATE_START:
@@ -282,38 +442,48 @@ static void handle_request(pollfd *pfd) {
     case +RequestCode::SQLITE_CMD:
     case +RequestCode::DENYLIST:
     case +RequestCode::STOP_DAEMON:
-        if (!is_root) {
-            write_int(client, +RespondCode::ROOT_REQUIRED);
-            return;
-        }
+        if (!is_root)
+            res = RespondCode::ROOT_REQUIRED;
         break;
     case +RequestCode::REMOVE_MODULES:
-        if (!is_root && cred.uid != AID_SHELL) {
-            write_int(client, +RespondCode::ACCESS_DENIED);
-            return;
-        }
+    case +RequestCode::GET_STATS:
+        if (!is_root && cred.uid != AID_SHELL)
+            res = RespondCode::ACCESS_DENIED;
         break;
     case +RequestCode::ZYGISK:
         if (!is_zygote) {
             // Invalid client context
-            write_int(client, +RespondCode::ACCESS_DENIED);
-            return;
+            res = RespondCode::ACCESS_DENIED;
         }
         break;
     default:
         break;
     }
 
-    write_int(client, +RespondCode::OK);
+    count_request(code, res != RespondCode::OK);
+    write_int(client, +res);
+    if (res != RespondCode::OK)
+        return;
 
+    uint64_t queued = monotonic_ns();
     if (code < +RequestCode::_SYNC_BARRIER_) {
+        request_timer t(code, queued);
         handle_request_sync(client, code);
     } else if (code < +RequestCode::_STAGE_BARRIER_) {
-        exec_task([=, fd = client.release()] { handle_request_async(fd, code, cred); });
+        TaskPriority prio = TaskPriority::DEFAULT;
+        if (code == +RequestCode::ZYGISK)
+            prio = TaskPriority::ZYGISK;
+        else if (code == +RequestCode::SUPERUSER)
+            prio = TaskPriority::SU;
+        exec_task([=, fd = client.release()] {
+            request_timer t(code, queued);
+            handle_request_async(fd, code, cred);
+        }, prio);
     } else {
         exec_task([=, fd = client.release()] {
+            request_timer t(code, queued);
             MagiskD::get()->boot_stage_handler(fd, code);
-        });
+        }, TaskPriority::BOOT_STAGE);
     }
 }
 
@@ -448,8 +618,8 @@ static void daemon_entry() {
     setfilecon(addr.sun_path, MAGISK_FILE_CON);
     xlisten(fd, 10);
 
-    default_new(poll_map);
-    default_new(poll_fds);
+    init_poll();
+    init_selinux_enforce();
     default_new(module_list);
 
     // Register handler for main socket
@@ -1,6 +1,8 @@
 #include <unistd.h>
 #include <dlfcn.h>
 #include <sys/stat.h>
+#include <sys/inotify.h>
+#include <unordered_map>
 
 #include <consts.hpp>
 #include <base.hpp>
@@ -38,6 +40,7 @@ static int (*sqlite3_exec)(
         int (*callback)(void*, int, char**, char**),
         void *v,
         char **errmsg);
+static int (*sqlite3_total_changes)(sqlite3 *db);
 
 // Internal Android linker APIs
 
@@ -95,6 +98,7 @@ static bool dload_sqlite() {
     DLOAD(sqlite, sqlite3_close);
     DLOAD(sqlite, sqlite3_exec);
     DLOAD(sqlite, sqlite3_free);
+    DLOAD(sqlite, sqlite3_total_changes);
 
     dl_init = 1;
     return true;
@@ -282,6 +286,179 @@ static char *open_and_init_db(sqlite3 *&db) {
     return nullptr;
 }
 
+/*
+ * In-memory cache
+ *
+ * The settings, strings and policies tables are mirrored in memory and loaded on first
+ * use. Statements going through db_exec(sql) or exec_sql reload the cached tables they
+ * mention right after they run, so lookups never have to go through SQLite. Changes made
+ * to the database by anyone else are picked up by an inotify watch on SECURE_DIR. The
+ * watch only flags a possible change, so the event loop never waits for cache_lock;
+ * the next lookup drops the whole cache if the database files no longer match the
+ * state recorded after our own last load or write. Until the watch could be set up,
+ * every lookup compares the state of the database files.
+ */
+
+enum {
+    CACHE_SETTINGS = (1 << 0),
+    CACHE_STRINGS  = (1 << 1),
+    CACHE_POLICIES = (1 << 2),
+};
+
+struct db_policy {
+    su_access access;
+    time_t until;
+};
+
+// Identity of the database and its WAL file
+struct db_file_state {
+    ino_t ino[2];
+    off_t size[2];
+    timespec mtime[2];
+
+    bool operator==(const db_file_state &o) const {
+        for (int i = 0; i < 2; ++i) {
+            if (ino[i] != o.ino[i] || size[i] != o.size[i] ||
+                mtime[i].tv_sec != o.mtime[i].tv_sec || mtime[i].tv_nsec != o.mtime[i].tv_nsec)
+                return false;
+        }
+        return true;
+    }
+};
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic<bool> db_touched = false;
+
+// The following variables should be guarded by cache_lock
+static int cache_valid = 0;
+static db_settings *cached_settings = nullptr;
+static db_strings *cached_strings = nullptr;
+static unordered_map<int, db_policy> *cached_policies = nullptr;
+static db_file_state db_state{};
+static bool db_watched = false;
+
+static db_file_state get_db_state() {
+    db_file_state state{};
+    const char *files[] = { MAGISKDB, MAGISKDB "-wal" };
+    for (int i = 0; i < 2; ++i) {
+        struct stat st{};
+        if (stat(files[i], &st) == 0) {
+            state.ino[i] = st.st_ino;
+            state.size[i] = st.st_size;
+            state.mtime[i] = st.st_mtim;
+        }
+    }
+    return state;
+}
+
+static void db_dir_changed(pollfd *pfd) {
+    alignas(inotify_event) char buf[1024];
+    bool changed = false;
+    ssize_t len;
+    while ((len = read(pfd->fd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + len;) {
+            auto event = reinterpret_cast<inotify_event *>(p);
+            if (event->len && str_starts(event->name, "magisk.db"))
+                changed = true;
+            p += sizeof(inotify_event) + event->len;
+        }
+    }
+    if (changed)
+        db_touched = true;
+}
+
+// Retried on every load until it succeeds
+static void watch_db() {
+    int fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (fd < 0 || inotify_add_watch(fd, SECURE_DIR,
+            IN_MODIFY | IN_CREATE | IN_DELETE | IN_MOVED_TO | IN_MOVED_FROM) < 0) {
+        PLOGE("inotify " SECURE_DIR);
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+    pollfd pfd = { fd, POLLIN, 0 };
+    register_poll(&pfd, db_dir_changed);
+    db_watched = true;
+}
+
+// Should be called with cache_lock held
+static bool load_cache(int tables) {
+    if ((db_touched.exchange(false) || !db_watched) && cache_valid &&
+            get_db_state() != db_state) {
+        DBLOGV("database changed externally\n");
+        cache_valid = 0;
+    }
+    tables &= ~cache_valid;
+    if (tables == 0)
+        return true;
+    if (!db_watched)
+        watch_db();
+
+    char *err;
+    if (tables & CACHE_SETTINGS) {
+        if (cached_settings == nullptr)
+            cached_settings = new db_settings();
+        else
+            *cached_settings = db_settings();
+        err = db_exec("SELECT key, value FROM settings", [](db_row &row) -> bool {
+            (*cached_settings)[row["key"]] = parse_int(row["value"]);
+            DBLOGV("query %s=[%s]\n", row["key"].data(), row["value"].data());
+            return true;
+        });
+        db_err_cmd(err, return false);
+    }
+    if (tables & CACHE_STRINGS) {
+        if (cached_strings == nullptr)
+            cached_strings = new db_strings();
+        else
+            *cached_strings = db_strings();
+        err = db_exec("SELECT key, value FROM strings", [](db_row &row) -> bool {
+            (*cached_strings)[row["key"]] = row["value"];
+            DBLOGV("query %s=[%s]\n", row["key"].data(), row["value"].data());
+            return true;
+        });
+        db_err_cmd(err, return false);
+    }
+    if (tables & CACHE_POLICIES) {
+        default_new(cached_policies);
+        cached_policies->clear();
+        err = db_exec("SELECT uid, policy, until, logging, notification FROM policies",
+                [](db_row &row) -> bool {
+            db_policy p;
+            p.access.policy = (policy_t) parse_int(row["policy"]);
+            p.access.log = parse_int(row["logging"]);
+            p.access.notify = parse_int(row["notification"]);
+            p.until = parse_int(row["until"]);
+            cached_policies->emplace(parse_int(row["uid"]), p);
+            return true;
+        });
+        db_err_cmd(err, return false);
+    }
+    cache_valid |= tables;
+    db_state = get_db_state();
+    return true;
+}
+
+// Reload the cached tables a statement could have modified
+static void write_through(const char *sql) {
+    int tables = 0;
+    if (strcasestr(sql, "settings"))
+        tables |= CACHE_SETTINGS;
+    if (strcasestr(sql, "strings"))
+        tables |= CACHE_STRINGS;
+    if (strcasestr(sql, "policies"))
+        tables |= CACHE_POLICIES;
+    mutex_guard g(cache_lock);
+    if (tables) {
+        cache_valid &= ~tables;
+        load_cache(tables);
+    } else if (cache_valid) {
+        // Still our own write, keep the watch from dropping the cache
+        db_state = get_db_state();
+    }
+}
+
 char *db_exec(const char *sql) {
     char *err = nullptr;
     if (mDB == nullptr) {
@@ -295,6 +472,7 @@ char *db_exec(const char *sql) {
     }
     if (mDB) {
         sqlite3_exec(mDB, sql, nullptr, nullptr, &err);
+        write_through(sql);
         return err;
     }
     return nullptr;
@@ -327,38 +505,40 @@ char *db_exec(const char *sql, const db_row_cb &fn) {
 }
 
 int get_db_settings(db_settings &cfg, int key) {
-    char *err = nullptr;
-    auto settings_cb = [&](db_row &row) -> bool {
-        cfg[row["key"]] = parse_int(row["value"]);
-        DBLOGV("query %s=[%s]\n", row["key"].data(), row["value"].data());
-        return true;
-    };
+    mutex_guard g(cache_lock);
+    if (!load_cache(CACHE_SETTINGS))
+        return 1;
     if (key >= 0) {
-        char query[128];
-        ssprintf(query, sizeof(query), "SELECT * FROM settings WHERE key='%s'", DB_SETTING_KEYS[key]);
-        err = db_exec(query, settings_cb);
+        cfg[key] = (*cached_settings)[key];
     } else {
-        err = db_exec("SELECT * FROM settings", settings_cb);
+        cfg = *cached_settings;
     }
-    db_err_cmd(err, return 1);
     return 0;
 }
 
 int get_db_strings(db_strings &str, int key) {
-    char *err = nullptr;
-    auto string_cb = [&](db_row &row) -> bool {
-        str[row["key"]] = row["value"];
-        DBLOGV("query %s=[%s]\n", row["key"].data(), row["value"].data());
-        return true;
-    };
+    mutex_guard g(cache_lock);
+    if (!load_cache(CACHE_STRINGS))
+        return 1;
     if (key >= 0) {
-        char query[128];
-        ssprintf(query, sizeof(query), "SELECT * FROM strings WHERE key='%s'", DB_STRING_KEYS[key]);
-        err = db_exec(query, string_cb);
+        str[key] = (*cached_strings)[key];
     } else {
-        err = db_exec("SELECT * FROM strings", string_cb);
+        str = *cached_strings;
+    }
+    return 0;
+}
+
+int get_db_policy(int uid, su_access &access) {
+    mutex_guard g(cache_lock);
+    if (!load_cache(CACHE_POLICIES))
+        return 1;
+    auto it = cached_policies->find(uid);
+    if (it != cached_policies->end() &&
+        (it->second.until == 0 || it->second.until > time(nullptr))) {
+        access = it->second.access;
+        LOGD("magiskdb: query policy=[%d] log=[%d] notify=[%d]\n",
+             access.policy, access.log, access.notify);
     }
-    db_err_cmd(err, return 1);
     return 0;
 }
 
@@ -370,9 +550,14 @@ void rm_db_strings(int key) {
     db_err_cmd(err, return);
 }
 
+static int db_total_changes() {
+    return mDB ? sqlite3_total_changes(mDB) : 0;
+}
+
 void exec_sql(int client) {
     run_finally f([=]{ close(client); });
     string sql = read_string(client);
+    int changes = db_total_changes();
     char *err = db_exec(sql.data(), [client](db_row &row) -> bool {
         string out;
         bool first = true;
@@ -386,6 +571,10 @@ void exec_sql(int client) {
         write_string(client, out);
         return true;
     });
+    // Reload the cache before the client is done, so its next request sees the change.
+    // Schema changes do not count as changes, the watch catches those.
+    if (db_total_changes() != changes)
+        write_through(sql.data());
     write_int(client, 0);
     db_err_cmd(err, return; );
 }
@@ -28,6 +28,27 @@ enum class RespondCode : int {
     END
 };
 
+// Thread pool task priorities, higher values are picked up first
+enum class TaskPriority : int {
+    DEFAULT = 0,
+    SU,
+    ZYGISK,
+    BOOT_STAGE,
+    END
+};
+
+struct thread_pool_stats {
+    int total_threads;
+    int idle_threads;
+    size_t queue_depth;
+    size_t max_queue_depth;
+    uint64_t submitted;
+    uint64_t completed;
+    // Time between submission and a worker picking up the task
+    uint64_t total_wait_ns;
+    uint64_t max_wait_ns;
+};
+
 struct module_info {
     std::string name;
     std::string buf;
@@ -54,13 +75,37 @@ void unlock_blocks();
 
 // Poll control
 using poll_callback = void(*)(pollfd*);
-void register_poll(const pollfd *pfd, poll_callback callback);
+// pfd->events are level triggered, unless EPOLLET is passed in epoll_flags
+void register_poll(const pollfd *pfd, poll_callback callback, uint32_t epoll_flags = 0);
 void unregister_poll(int fd, bool auto_close);
+// Periodic timer, the callback has to read the expiration count from the timerfd
+int register_timer(const timespec &interval, poll_callback callback);
+// The callback has to read signalfd_siginfo from the signalfd
+int register_signal(int sig, poll_callback callback);
 void clear_poll();
 
 // Thread pool
-void init_thread_pool();
-void exec_task(std::function<void()> &&task);
+// Non-positive core_size uses the default, non-positive max_size means no limit.
+// When limited, tasks queue up, but a full queue still gets extra threads.
+void init_thread_pool(int core_size = 0, int max_size = 0);
+// Never blocks
+void exec_task(std::function<void()> &&task, TaskPriority prio = TaskPriority::DEFAULT);
+thread_pool_stats get_thread_pool_stats();
+
+// Request metrics
+uint64_t monotonic_ns();
+void count_request(int code, bool denied);
+void record_poll_batch(int events, uint64_t dispatch_ns);
+void dump_stats(int client);
+
+// Records the queue wait on construction and the run time on destruction
+struct request_timer {
+    request_timer(int code, uint64_t queued_ns);
+    ~request_timer();
+private:
+    int code;
+    uint64_t start_ns;
+};
 
 // Daemon handlers
 void boot_stage_handler(int client, int code);
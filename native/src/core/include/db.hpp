@@ -136,6 +136,8 @@ using db_row_cb = std::function<bool(db_row&)>;
 
 int get_db_settings(db_settings &cfg, int key = -1);
 int get_db_strings(db_strings &str, int key = -1);
+// access is only updated if uid has a policy that has not expired
+int get_db_policy(int uid, su_access &access);
 void rm_db_strings(int key);
 void exec_sql(int client);
 char *db_exec(const char *sql);
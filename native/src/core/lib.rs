@@ -33,6 +33,7 @@ pub mod ffi {
         SQLITE_CMD,
         REMOVE_MODULES,
         ZYGISK,
+        GET_STATS,
 
         _STAGE_BARRIER_,
 
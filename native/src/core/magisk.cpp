@@ -37,6 +37,8 @@ Options:
    -V                        print running daemon version code
    --list                    list all available applets
    --remove-modules [-n]     remove all modules, reboot if -n is not provided
+   --stats [--json]          print request, thread pool and poll loop statistics
+                             of the running daemon
    --install-module ZIP      install a module zip file
 
 Advanced Options (Internal APIs):
@@ -193,6 +195,22 @@ int magisk_main(int argc, char *argv[]) {
         int fd = connect_daemon(+RequestCode::REMOVE_MODULES);
         write_int(fd, do_reboot);
         return read_int(fd);
+    } else if (argv[1] == "--stats"sv) {
+        int json;
+        if (argc == 3 && argv[2] == "--json"sv) {
+            json = 1;
+        } else if (argc == 2) {
+            json = 0;
+        } else {
+            usage();
+        }
+        int fd = connect_daemon(+RequestCode::GET_STATS);
+        if (fd < 0)
+            return 1;
+        write_int(fd, json);
+        string res = read_string(fd);
+        printf("%s", res.data());
+        return 0;
     } else if (argv[1] == "--path"sv) {
         const char *path = get_magisk_tmp();
         if (path[0] != '\0')  {
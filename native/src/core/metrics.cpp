@@ -0,0 +1,276 @@
+// Lock-free request metrics of magiskd
+
+#include <cinttypes>
+
+#include <base.hpp>
+
+#include <core.hpp>
+
+using namespace std;
+
+// Counters are spread over shards picked by tid, so concurrent handlers
+// rarely touch the same cache lines. Readers sum up all shards.
+#define METRICS_SHARDS 4
+
+// HDR-style log-linear buckets in microseconds: values below 4 are exact,
+// above that each power of 2 is split into 2 sub-buckets. The last bucket
+// covers everything from ~200 seconds up.
+#define HIST_SUB_BITS 1
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS 56
+
+struct histogram {
+    atomic<uint64_t> buckets[HIST_BUCKETS];
+    atomic<uint64_t> sum_us;
+    atomic<uint64_t> max_us;
+
+    void record(uint64_t us);
+};
+
+struct code_metrics {
+    atomic<uint64_t> requests;
+    atomic<uint64_t> denied;
+    // From exec_task submission to the handler starting
+    histogram wait;
+    // Handler run time
+    histogram run;
+};
+
+struct alignas(64) metrics_shard {
+    code_metrics codes[+RequestCode::END];
+    atomic<uint64_t> poll_wakeups;
+    atomic<uint64_t> poll_events;
+    atomic<uint64_t> poll_max_batch;
+    // Time spent in poll callbacks per epoll_wait batch
+    histogram poll_dispatch;
+};
+
+static metrics_shard shards[METRICS_SHARDS];
+
+static metrics_shard &local_shard() {
+    return shards[gettid() % METRICS_SHARDS];
+}
+
+static void atomic_max(atomic<uint64_t> &a, uint64_t v) {
+    uint64_t cur = a.load(memory_order_relaxed);
+    while (cur < v && !a.compare_exchange_weak(cur, v, memory_order_relaxed));
+}
+
+static int bucket_index(uint64_t v) {
+    if (v < 2 * HIST_SUB_COUNT)
+        return v;
+    int e = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+    int idx = e * HIST_SUB_COUNT + (v >> e);
+    return std::min(idx, HIST_BUCKETS - 1);
+}
+
+// Largest value falling into the bucket
+static uint64_t bucket_limit(int idx) {
+    if (idx < 2 * HIST_SUB_COUNT)
+        return idx;
+    int e = idx / HIST_SUB_COUNT - 1;
+    uint64_t m = idx - e * HIST_SUB_COUNT;
+    return ((m + 1) << e) - 1;
+}
+
+void histogram::record(uint64_t us) {
+    buckets[bucket_index(us)].fetch_add(1, memory_order_relaxed);
+    sum_us.fetch_add(us, memory_order_relaxed);
+    atomic_max(max_us, us);
+}
+
+uint64_t monotonic_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void count_request(int code, bool denied) {
+    auto &c = local_shard().codes[code];
+    c.requests.fetch_add(1, memory_order_relaxed);
+    if (denied)
+        c.denied.fetch_add(1, memory_order_relaxed);
+}
+
+request_timer::request_timer(int code, uint64_t queued_ns) : code(code), start_ns(monotonic_ns()) {
+    local_shard().codes[code].wait.record((start_ns - queued_ns) / 1000);
+}
+
+request_timer::~request_timer() {
+    // The handler could have moved to another thread's shard, it does not matter
+    local_shard().codes[code].run.record((monotonic_ns() - start_ns) / 1000);
+}
+
+void record_poll_batch(int events, uint64_t dispatch_ns) {
+    auto &s = local_shard();
+    s.poll_wakeups.fetch_add(1, memory_order_relaxed);
+    s.poll_events.fetch_add(events, memory_order_relaxed);
+    atomic_max(s.poll_max_batch, events);
+    s.poll_dispatch.record(dispatch_ns / 1000);
+}
+
+// Snapshot of a histogram merged over all shards
+struct hist_summary {
+    uint64_t count = 0;
+    uint64_t sum = 0;
+    uint64_t max = 0;
+    uint64_t buckets[HIST_BUCKETS] = {};
+
+    void merge(const histogram &h) {
+        for (int i = 0; i < HIST_BUCKETS; ++i) {
+            uint64_t n = h.buckets[i].load(memory_order_relaxed);
+            buckets[i] += n;
+            count += n;
+        }
+        sum += h.sum_us.load(memory_order_relaxed);
+        max = std::max(max, h.max_us.load(memory_order_relaxed));
+    }
+
+    uint64_t percentile(int p) const {
+        if (count == 0)
+            return 0;
+        uint64_t rank = (count * p + 99) / 100;
+        uint64_t seen = 0;
+        for (int i = 0; i < HIST_BUCKETS; ++i) {
+            seen += buckets[i];
+            if (seen >= rank)
+                return std::min(bucket_limit(i), max);
+        }
+        return max;
+    }
+
+    uint64_t avg() const { return count ? sum / count : 0; }
+};
+
+static const char *code_name(int code) {
+    switch (code) {
+    case +RequestCode::START_DAEMON: return "START_DAEMON";
+    case +RequestCode::CHECK_VERSION: return "CHECK_VERSION";
+    case +RequestCode::CHECK_VERSION_CODE: return "CHECK_VERSION_CODE";
+    case +RequestCode::STOP_DAEMON: return "STOP_DAEMON";
+    case +RequestCode::GET_STATS: return "GET_STATS";
+    case +RequestCode::SUPERUSER: return "SUPERUSER";
+    case +RequestCode::ZYGOTE_RESTART: return "ZYGOTE_RESTART";
+    case +RequestCode::DENYLIST: return "DENYLIST";
+    case +RequestCode::SQLITE_CMD: return "SQLITE_CMD";
+    case +RequestCode::REMOVE_MODULES: return "REMOVE_MODULES";
+    case +RequestCode::ZYGISK: return "ZYGISK";
+    case +RequestCode::POST_FS_DATA: return "POST_FS_DATA";
+    case +RequestCode::LATE_START: return "LATE_START";
+    case +RequestCode::BOOT_COMPLETE: return "BOOT_COMPLETE";
+    default: return nullptr;
+    }
+}
+
+__printflike(2, 3)
+static void append(string &out, const char *fmt, ...) {
+    char buf[256];
+    va_list argv;
+    va_start(argv, fmt);
+    int len = vssprintf(buf, sizeof(buf), fmt, argv);
+    va_end(argv);
+    if (len > 0)
+        out.append(buf, len);
+}
+
+static void append_hist(string &out, const char *name, const hist_summary &h, bool json) {
+    if (json) {
+        append(out, R"("%s":{"count":%)" PRIu64 R"(,"avg_us":%)" PRIu64 R"(,"p50_us":%)" PRIu64
+               R"(,"p90_us":%)" PRIu64 R"(,"p99_us":%)" PRIu64 R"(,"max_us":%)" PRIu64 "}",
+               name, h.count, h.avg(), h.percentile(50), h.percentile(90),
+               h.percentile(99), h.max);
+    } else {
+        append(out, " %8" PRIu64 " %8" PRIu64 " %8" PRIu64 " %8" PRIu64,
+               h.percentile(50), h.percentile(90), h.percentile(99), h.max);
+    }
+}
+
+static string format_stats(bool json) {
+    string out;
+
+    if (json) {
+        out += R"({"requests":{)";
+    } else {
+        append(out, "%-20s %8s %8s %36s %36s\n", "", "", "",
+               "wait (us) p50/p90/p99/max", "run (us) p50/p90/p99/max");
+        append(out, "%-20s %8s %8s\n", "request", "count", "denied");
+    }
+    bool first = true;
+    for (int code = 0; code < +RequestCode::END; ++code) {
+        const char *name = code_name(code);
+        if (name == nullptr)
+            continue;
+        uint64_t requests = 0;
+        uint64_t denied = 0;
+        hist_summary wait, run;
+        for (auto &s : shards) {
+            auto &c = s.codes[code];
+            requests += c.requests.load(memory_order_relaxed);
+            denied += c.denied.load(memory_order_relaxed);
+            wait.merge(c.wait);
+            run.merge(c.run);
+        }
+        if (json) {
+            append(out, R"(%s"%s":{"count":%)" PRIu64 R"(,"denied":%)" PRIu64 ",",
+                   first ? "" : ",", name, requests, denied);
+            append_hist(out, "wait", wait, true);
+            out += ',';
+            append_hist(out, "run", run, true);
+            out += '}';
+            first = false;
+        } else if (requests) {
+            append(out, "%-20s %8" PRIu64 " %8" PRIu64, name, requests, denied);
+            append_hist(out, "wait", wait, false);
+            append_hist(out, "run", run, false);
+            out += '\n';
+        }
+    }
+
+    auto pool = get_thread_pool_stats();
+    uint64_t picked = pool.submitted - pool.queue_depth;
+    uint64_t avg_wait_us = picked ? pool.total_wait_ns / picked / 1000 : 0;
+    if (json) {
+        append(out, R"(},"thread_pool":{"threads":%d,"idle":%d,"queue_depth":%zu,)"
+               R"("max_queue_depth":%zu,"submitted":%)" PRIu64 R"(,"completed":%)" PRIu64
+               R"(,"avg_wait_us":%)" PRIu64 R"(,"max_wait_us":%)" PRIu64 "}",
+               pool.total_threads, pool.idle_threads, pool.queue_depth,
+               pool.max_queue_depth, pool.submitted, pool.completed,
+               avg_wait_us, pool.max_wait_ns / 1000);
+    } else {
+        append(out, "\nthread pool: %d threads (%d idle), queue depth %zu (peak %zu)\n",
+               pool.total_threads, pool.idle_threads, pool.queue_depth, pool.max_queue_depth);
+        append(out, "  submitted %" PRIu64 ", completed %" PRIu64
+               ", wait avg %" PRIu64 " us, max %" PRIu64 " us\n",
+               pool.submitted, pool.completed, avg_wait_us, pool.max_wait_ns / 1000);
+    }
+
+    uint64_t wakeups = 0;
+    uint64_t events = 0;
+    uint64_t max_batch = 0;
+    hist_summary dispatch;
+    for (auto &s : shards) {
+        wakeups += s.poll_wakeups.load(memory_order_relaxed);
+        events += s.poll_events.load(memory_order_relaxed);
+        max_batch = std::max(max_batch, s.poll_max_batch.load(memory_order_relaxed));
+        dispatch.merge(s.poll_dispatch);
+    }
+    if (json) {
+        append(out, R"(,"poll":{"wakeups":%)" PRIu64 R"(,"events":%)" PRIu64
+               R"(,"max_batch":%)" PRIu64 ",", wakeups, events, max_batch);
+        append_hist(out, "dispatch", dispatch, true);
+        out += "}}\n";
+    } else {
+        append(out, "\npoll loop: %" PRIu64 " wakeups, %" PRIu64 " events, max batch %" PRIu64 "\n",
+               wakeups, events, max_batch);
+        out += "  dispatch (us) p50/p90/p99/max";
+        append_hist(out, "dispatch", dispatch, false);
+        out += '\n';
+    }
+    return out;
+}
+
+void dump_stats(int client) {
+    bool json = read_int(client) != 0;
+    write_string(client, format_stats(json));
+    close(client);
+}
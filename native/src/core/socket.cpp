@@ -10,12 +10,19 @@ bool get_client_cred(int fd, sock_cred *cred) {
     socklen_t len = sizeof(ucred);
     if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, cred, &len) != 0)
         return false;
-    char buf[4096];
-    len = sizeof(buf);
-    if (getsockopt(fd, SOL_SOCKET, SO_PEERSEC, buf, &len) != 0)
-        len = 0;
-    buf[len] = '\0';
-    cred->context = buf;
+    // Contexts are short, only retry with the reported size if it does not fit
+    cred->context.resize(64);
+    len = cred->context.size();
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERSEC, cred->context.data(), &len) != 0) {
+        if (errno == ERANGE) {
+            cred->context.resize(len);
+            if (getsockopt(fd, SOL_SOCKET, SO_PEERSEC, cred->context.data(), &len) != 0)
+                len = 0;
+        } else {
+            len = 0;
+        }
+    }
+    cred->context.resize(strnlen(cred->context.data(), len));
     return true;
 }
 
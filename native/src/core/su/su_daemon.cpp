@@ -63,21 +63,8 @@ void su_info::check_db() {
         break;
     }
 
-    if (eval_uid > 0) {
-        char query[256], *err;
-        ssprintf(query, sizeof(query),
-            "SELECT policy, logging, notification FROM policies "
-            "WHERE uid=%d AND (until=0 OR until>%li)", eval_uid, time(nullptr));
-        err = db_exec(query, [&](db_row &row) -> bool {
-            access.policy = (policy_t) parse_int(row["policy"]);
-            access.log = parse_int(row["logging"]);
-            access.notify = parse_int(row["notification"]);
-            LOGD("magiskdb: query policy=[%d] log=[%d] notify=[%d]\n",
-                 access.policy, access.log, access.notify);
-            return true;
-        });
-        db_err_cmd(err, return);
-    }
+    if (eval_uid > 0 && get_db_policy(eval_uid, access))
+        return;
 
     // We need to check our manager
     if (access.log || access.notify) {
@@ -128,19 +115,10 @@ bool uid_granted_root(int uid) {
         break;
     }
 
-    bool granted = false;
-
-    char query[256], *err;
-    ssprintf(query, sizeof(query),
-        "SELECT policy FROM policies WHERE uid=%d AND (until=0 OR until>%li)",
-        uid, time(nullptr));
-    err = db_exec(query, [&](db_row &row) -> bool {
-        granted = parse_int(row["policy"]) == ALLOW;
-        return true;
-    });
-    db_err_cmd(err, return false);
-
-    return granted;
+    su_access access = NO_SU_ACCESS;
+    if (get_db_policy(uid, access))
+        return false;
+    return access.policy == ALLOW;
 }
 
 void prune_su_access() {
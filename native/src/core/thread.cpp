@@ -1,4 +1,6 @@
-// Cached thread pool implementation
+// Cached thread pool implementation with a priority task queue
+
+#include <deque>
 
 #include <base.hpp>
 
@@ -8,15 +10,27 @@ using namespace std;
 
 #define THREAD_IDLE_MAX_SEC 60
 #define CORE_POOL_SIZE 3
+// With a thread limit set, tasks past this queue depth get a thread anyway
+#define TASK_QUEUE_SIZE 256
+
+struct pool_task {
+    function<void()> fn;
+    uint64_t queued_ns;
+};
 
 static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+// Signaled when a task is queued
 static pthread_cond_t send_task = PTHREAD_COND_INITIALIZER_MONOTONIC_NP;
-static pthread_cond_t recv_task = PTHREAD_COND_INITIALIZER_MONOTONIC_NP;
 
 // The following variables should be guarded by lock
+static int core_pool_size = CORE_POOL_SIZE;
+// No limit if non-positive
+static int max_pool_size = 0;
 static int idle_threads = 0;
 static int total_threads = 0;
-static function<void()> pending_task;
+static size_t queued_tasks = 0;
+static deque<pool_task> task_queue[+TaskPriority::END];
+static thread_pool_stats stats{};
 
 static void operator+=(timespec &a, const timespec &b) {
     a.tv_sec += b.tv_sec;
@@ -34,11 +48,30 @@ static void reset_pool() {
     pthread_mutex_init(&lock, nullptr);
     pthread_cond_destroy(&send_task);
     send_task = PTHREAD_COND_INITIALIZER_MONOTONIC_NP;
-    pthread_cond_destroy(&recv_task);
-    recv_task = PTHREAD_COND_INITIALIZER_MONOTONIC_NP;
     idle_threads = 0;
     total_threads = 0;
-    pending_task = nullptr;
+    queued_tasks = 0;
+    for (auto &q : task_queue)
+        q.clear();
+    stats = {};
+}
+
+// Should be called with lock held and a non-empty queue
+static pool_task pop_task() {
+    // Higher priorities always go first
+    for (int i = +TaskPriority::END - 1; i >= 0; --i) {
+        auto &q = task_queue[i];
+        if (q.empty())
+            continue;
+        pool_task task = std::move(q.front());
+        q.pop_front();
+        --queued_tasks;
+        uint64_t wait_ns = monotonic_ns() - task.queued_ns;
+        stats.total_wait_ns += wait_ns;
+        stats.max_wait_ns = std::max(stats.max_wait_ns, wait_ns);
+        return task;
+    }
+    __builtin_unreachable();
 }
 
 static void *thread_pool_loop(void * const is_core_pool) {
@@ -49,18 +82,19 @@ static void *thread_pool_loop(void * const is_core_pool) {
     for (;;) {
         // Restore sigmask
         pthread_sigmask(SIG_SETMASK, &mask, nullptr);
-        function<void()> local_task;
+        pool_task local_task;
         {
             mutex_guard g(lock);
             ++idle_threads;
-            if (!pending_task) {
+            while (queued_tasks == 0) {
                 if (is_core_pool) {
                     pthread_cond_wait(&send_task, &lock);
                 } else {
                     timespec ts;
                     clock_gettime(CLOCK_MONOTONIC, &ts);
                     ts += { THREAD_IDLE_MAX_SEC, 0 };
-                    if (pthread_cond_timedwait(&send_task, &lock, &ts) == ETIMEDOUT) {
+                    if (pthread_cond_timedwait(&send_task, &lock, &ts) == ETIMEDOUT &&
+                        queued_tasks == 0) {
                         // Terminate thread after max idle time
                         --idle_threads;
                         --total_threads;
@@ -68,32 +102,54 @@ static void *thread_pool_loop(void * const is_core_pool) {
                     }
                 }
             }
-            if (pending_task) {
-                local_task.swap(pending_task);
-                pthread_cond_signal(&recv_task);
-            }
             --idle_threads;
+            local_task = pop_task();
+        }
+        local_task.fn();
+        local_task.fn = nullptr;
+        {
+            mutex_guard g(lock);
+            ++stats.completed;
         }
-        if (local_task)
-            local_task();
         if (getpid() == gettid())
             exit(0);
     }
 }
 
-void init_thread_pool() {
+void init_thread_pool(int core_size, int max_size) {
+    {
+        mutex_guard g(lock);
+        core_pool_size = core_size > 0 ? core_size : CORE_POOL_SIZE;
+        max_pool_size = max_size > 0 ? std::max(max_size, core_pool_size) : 0;
+    }
     pthread_atfork(nullptr, nullptr, &reset_pool);
 }
 
-void exec_task(function<void()> &&task) {
+void exec_task(function<void()> &&task, TaskPriority prio) {
     mutex_guard g(lock);
-    pending_task.swap(task);
-    if (idle_threads == 0) {
+    task_queue[+prio].push_back({ std::move(task), monotonic_ns() });
+    ++queued_tasks;
+    ++stats.submitted;
+    stats.max_queue_depth = std::max(stats.max_queue_depth, queued_tasks);
+    // Every idle thread will take exactly one task, spawn another if not enough.
+    // Callers such as the poll loop must never block, so a full queue goes past
+    // the thread limit instead of waiting for a busy thread.
+    bool can_spawn = max_pool_size <= 0 || total_threads < max_pool_size ||
+            queued_tasks > TASK_QUEUE_SIZE;
+    if (idle_threads < (int) queued_tasks && can_spawn) {
         ++total_threads;
-        long is_core_pool = total_threads <= CORE_POOL_SIZE;
+        long is_core_pool = total_threads <= core_pool_size;
         new_daemon_thread(thread_pool_loop, (void *) is_core_pool);
     } else {
         pthread_cond_signal(&send_task);
     }
-    pthread_cond_wait(&recv_task, &lock);
+}
+
+thread_pool_stats get_thread_pool_stats() {
+    mutex_guard g(lock);
+    thread_pool_stats s = stats;
+    s.total_threads = total_threads;
+    s.idle_threads = idle_threads;
+    s.queue_depth = queued_tasks;
+    return s;
 }
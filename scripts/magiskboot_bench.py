@@ -0,0 +1,646 @@
+#!/usr/bin/env python3
+
+# Benchmark and golden corpus for magiskboot
+#
+# Generates a deterministic corpus of synthetic boot/vendor_boot images of every
+# header version, ramdisks in every compression format, multi-DTB containers and
+# payload.bin files, then runs each magiskboot action against it. For every run,
+# wall time, throughput, peak RSS and (optionally) syscall counts are recorded,
+# and the outputs are checked for round-trip byte identity.
+#
+# The magiskboot binary has to be runnable on the host, e.g. the static x86_64
+# build in native/out/x86_64 on a Linux machine.
+#
+# Usage: ./magiskboot_bench.py [options] [magiskboot]
+#   --save results.json      Save results as a baseline
+#   --compare results.json   Compare against a baseline, fail on regressions
+
+import argparse
+import bz2
+import hashlib
+import json
+import lzma
+import os
+import os.path as op
+import random
+import shutil
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+FORMATS = ["gzip", "zopfli", "xz", "lzma", "bzip2", "lz4", "lz4_legacy", "lz4_lg"]
+
+BOOT_MAGIC = b"ANDROID!"
+VENDOR_BOOT_MAGIC = b"VNDRBOOT"
+FDT_MAGIC = 0xD00DFEED
+
+is_ci = "CI" in os.environ and os.environ["CI"] == "true"
+use_color = not is_ci and sys.stdout.isatty()
+
+
+def print_title(s):
+    print(f"\n\033[44;39m{s}\033[0m\n" if use_color else f"\n{s}\n")
+
+
+def print_error(s):
+    print(f"\033[41;39m{s}\033[0m" if use_color else s)
+
+
+def align(x, a):
+    return (x + a - 1) // a * a
+
+
+def pad(data, page):
+    return data + b"\0" * (align(len(data), page) - len(data))
+
+
+###################
+# Corpus generators
+###################
+
+WORDS = [
+    b"android", b"kernel", b"ramdisk", b"init", b"system", b"vendor", b"boot",
+    b"selinux", b"service", b"property", b"mount", b"export", b"class", b"main",
+    b"\x00\x00\x00\x00", b"\xff\xfe\xfd", b"\x7fELF", b"on", b"setprop", b"/dev",
+]
+
+
+def gen_data(rng, size):
+    # Compressible, but not trivially so, like real kernel and ramdisk content
+    out = bytearray()
+    while len(out) < size:
+        if rng.random() < 0.2:
+            out += rng.randbytes(rng.randint(8, 64))
+        else:
+            out += rng.choice(WORDS) + b" "
+    return bytes(out[:size])
+
+
+def gen_cpio(rng, size):
+    entries = []
+    ino = 300000
+
+    def add(name, mode, data=b""):
+        nonlocal ino
+        ino += 1
+        name = name.encode() + b"\0"
+        hdr = b"070701" + b"".join(
+            b"%08x" % v
+            for v in [ino, mode, 0, 0, 1, 0, len(data), 0, 0, 0, 0, len(name), 0]
+        )
+        entries.append(pad(hdr + name, 4) + pad(data, 4))
+
+    add("dev", 0o40755)
+    add("system", 0o40755)
+    add("init", 0o100750, gen_data(rng, 256 * 1024))
+    add("init.rc", 0o100640, gen_data(rng, 16 * 1024))
+    add("sbin", 0o120777, b"/system/bin")
+    i = 0
+    remain = size
+    while remain > 0:
+        n = min(remain, rng.randint(1024, 1024 * 1024))
+        add(f"system/file{i:04}", 0o100644, gen_data(rng, n))
+        remain -= n
+        i += 1
+    add("TRAILER!!!", 0)
+    return b"".join(entries)
+
+
+def fdt_node(strings, name, props, children):
+    def string_off(k):
+        k = k.encode() + b"\0"
+        i = strings.find(k)
+        if i < 0:
+            i = len(strings)
+            strings.extend(k)
+        return i
+
+    b = struct.pack(">I", 1) + pad(name.encode() + b"\0", 4)
+    for k, v in props:
+        b += struct.pack(">III", 3, len(v), string_off(k)) + pad(v, 4)
+    for c in children:
+        b += c(strings)
+    return b + struct.pack(">I", 2)
+
+
+def gen_dtb(i):
+    strings = bytearray()
+
+    def node(name, props, children=()):
+        return lambda s: fdt_node(s, name, props, children)
+
+    root = node(
+        "",
+        [("model", b"bench%d\0" % i), ("#address-cells", struct.pack(">I", 1))],
+        [
+            node("chosen", [("bootargs", b"console=ttyS0 skip_initramfs\0")]),
+            node("firmware", [], [
+                node("android", [("compatible", b"android,firmware\0")], [
+                    node("fstab", [], [
+                        node("system", [("fsmgr_flags", b"wait,verify\0")]),
+                        node("vendor", [("fsmgr_flags", b"wait,avb\0")]),
+                    ])
+                ])
+            ]),
+            node("soc@0", [("reg", struct.pack(">II", 0, 0x100))]),
+        ],
+    )
+    st = root(strings) + struct.pack(">I", 9)
+    rsv = struct.pack(">QQ", 0x1000, 0x2000) + b"\0" * 16
+    off_st = 40 + len(rsv)
+    off_str = off_st + len(st)
+    total = off_str + len(strings)
+    hdr = struct.pack(
+        ">IIIIIIIIII", FDT_MAGIC, total, off_st, off_str, 40, 17, 16, 0, len(strings), len(st)
+    )
+    return hdr + rsv + st + bytes(strings)
+
+
+def gen_dtbs(n):
+    return b"".join(pad(gen_dtb(i), 8) for i in range(n))
+
+
+def boot_hdr_v0(ver, page, sizes, os_version, cmdline, pxa=False):
+    k, r, s = sizes["kernel"], sizes["ramdisk"], sizes["second"]
+    common = struct.pack("<8s6I", BOOT_MAGIC, k, 0x10008000, r, 0x11000000, s, 0x10F00000)
+    if pxa:
+        return common + struct.pack(
+            "<4I24s512s", sizes["extra"], 0x02000000, 0x10000100, page, b"pxa", cmdline
+        )
+    hdr = common + struct.pack(
+        "<4I16s512s", 0x10000100, page, ver, os_version, b"bench", cmdline
+    )
+    return hdr
+
+
+def boot_id(blocks, ver, pxa):
+    # Same as the id computed by magiskboot repack
+    h = hashlib.sha1()
+    order = ["kernel", "ramdisk", "second"]
+    if pxa:
+        order.append("extra")
+    if ver in (1, 2):
+        order.append("recovery_dtbo")
+    if ver == 2:
+        order.append("dtb")
+    for name in order:
+        data = blocks.get(name, b"")
+        if name == "extra" and not data:
+            continue
+        h.update(data)
+        h.update(struct.pack("<I", len(data)))
+    return h.digest()
+
+
+def gen_boot(ver, blocks, pxa=False):
+    page = 4096 if ver >= 3 else 2048
+    os_version = (14 << 25) | (0 << 18) | (0 << 11) | ((2024 - 2000) << 4) | 1
+    sizes = {n: len(blocks.get(n, b"")) for n in
+             ["kernel", "ramdisk", "second", "extra", "recovery_dtbo", "dtb"]}
+    cmdline = b"console=ttyMSM0 androidboot.hardware=bench"
+
+    if ver >= 3:
+        hdr_size = 1580 if ver == 3 else 1584
+        hdr = struct.pack(
+            "<8s4I4I I1536s", BOOT_MAGIC, sizes["kernel"], sizes["ramdisk"], os_version,
+            hdr_size, 0, 0, 0, 0, ver, cmdline
+        )
+        if ver == 4:
+            hdr += struct.pack("<I", 0)
+        return pad(hdr, page) + pad(blocks["kernel"], page) + pad(blocks["ramdisk"], page)
+
+    # Offsets of the blocks after the header
+    off = page + align(sizes["kernel"], page) + align(sizes["ramdisk"], page)
+    off += align(sizes["second"], page) + align(sizes["extra"], page)
+    hdr = boot_hdr_v0(ver, page, sizes, os_version, cmdline, pxa)
+    hdr += boot_id(blocks, ver, pxa).ljust(32, b"\0") + b"\0" * 1024
+    if ver >= 1:
+        hdr += struct.pack("<IQI", sizes["recovery_dtbo"], off, 1648 if ver == 1 else 1660)
+    if ver == 2:
+        hdr += struct.pack("<IQ", sizes["dtb"], 0x11F00000)
+    img = pad(hdr, page)
+    for name in ["kernel", "ramdisk", "second", "extra", "recovery_dtbo", "dtb"]:
+        img += pad(blocks.get(name, b""), page)
+    return img
+
+
+def gen_vendor_boot(ver, ramdisk, dtb):
+    page = 4096
+    hdr_size = 2112 if ver == 3 else 2128
+    hdr = struct.pack(
+        "<8s5I2048sI16s2IQ", VENDOR_BOOT_MAGIC, ver, page, 0x10008000, 0x11000000,
+        len(ramdisk), b"androidboot.console=ttyMSM0", 0x10000100, b"bench", hdr_size,
+        len(dtb), 0x11F00000
+    )
+    table = b""
+    bootconfig = b""
+    if ver == 4:
+        # A single vendor ramdisk entry
+        table = struct.pack("<3I32s16I", len(ramdisk), 0, 1, b"", *([0] * 16))
+        bootconfig = b"androidboot.bench=1\n"
+        hdr += struct.pack("<4I", len(table), 1, len(table), len(bootconfig))
+    img = pad(hdr, page) + pad(ramdisk, page) + pad(dtb, page)
+    if ver == 4:
+        img += pad(table, page) + pad(bootconfig, page)
+    return img
+
+
+def pb_varint(v):
+    out = bytearray()
+    while True:
+        b = v & 0x7F
+        v >>= 7
+        if v:
+            out.append(b | 0x80)
+        else:
+            out.append(b)
+            return bytes(out)
+
+
+def pb_field(num, v):
+    if isinstance(v, int):
+        return pb_varint(num << 3) + pb_varint(v)
+    return pb_varint((num << 3) | 2) + pb_varint(len(v)) + v
+
+
+def gen_payload(partitions, block_size=4096):
+    # A full payload, every operation type for new data is used in turn
+    manifest = pb_field(3, block_size)
+    data = b""
+    chunk = 1024 * 1024
+    for name, img in partitions:
+        part = pb_field(1, name.encode())
+        for i, off in enumerate(range(0, len(img), chunk)):
+            piece = img[off : off + chunk]
+            op_type, blob = [
+                (0, piece),  # REPLACE
+                (8, lzma.compress(piece, format=lzma.FORMAT_XZ)),  # REPLACE_XZ
+                (1, bz2.compress(piece)),  # REPLACE_BZ
+            ][i % 3]
+            extent = pb_field(1, off // block_size) + pb_field(2, align(len(piece), block_size) // block_size)
+            op = pb_field(1, op_type) + pb_field(2, len(data)) + pb_field(3, len(blob))
+            op += pb_field(6, extent) + pb_field(8, hashlib.sha256(blob).digest())
+            part += pb_field(8, op)
+            data += blob
+        info = pb_field(1, len(img)) + pb_field(2, hashlib.sha256(img).digest())
+        part += pb_field(7, info)
+        manifest += pb_field(13, part)
+    sig = pb_field(1, pb_field(2, b"\0" * 256))
+    hdr = b"CrAU" + struct.pack(">QQI", 2, len(manifest), len(sig))
+    return hdr + manifest + sig + data
+
+
+##########
+# Runner
+##########
+
+
+class Bench:
+    def __init__(self, args, magiskboot):
+        self.args = args
+        self.magiskboot = magiskboot
+        self.results = {}
+        self.failures = []
+        self.strace = args.syscalls and shutil.which("strace")
+        if args.syscalls and not self.strace:
+            print_error("! strace not found, syscall counts are skipped")
+
+    def exec(self, cmd, cwd):
+        t = time.perf_counter()
+        proc = subprocess.Popen(
+            cmd, cwd=cwd, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL
+        )
+        _, status, usage = os.wait4(proc.pid, 0)
+        proc.returncode = os.waitstatus_to_exitcode(status)
+        return proc.returncode, time.perf_counter() - t, usage.ru_maxrss
+
+    def count_syscalls(self, cmd, cwd):
+        with tempfile.NamedTemporaryFile("r") as f:
+            subprocess.run(
+                ["strace", "-f", "-c", "-o", f.name, *cmd],
+                cwd=cwd, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL,
+            )
+            for line in f:
+                fields = line.split()
+                if fields and fields[-1] == "total":
+                    return int(fields[3])
+        return None
+
+    # Run a magiskboot action, prepare() resets the working directory before each run
+    def run(self, name, cmd, cwd, size, prepare=None, expect_rc=(0,)):
+        cmd = [self.magiskboot, *cmd]
+        best = None
+        rss = 0
+        rc = 0
+        for _ in range(self.args.iterations):
+            if prepare:
+                prepare()
+            rc, secs, maxrss = self.exec(cmd, cwd)
+            best = secs if best is None else min(best, secs)
+            rss = max(rss, maxrss)
+        syscalls = None
+        if self.strace:
+            if prepare:
+                prepare()
+            syscalls = self.count_syscalls(cmd, cwd)
+        ok = rc in expect_rc
+        self.results[name] = {
+            "seconds": round(best, 6),
+            "mbps": round(size / best / 1024 / 1024, 2) if best > 0 else 0,
+            "max_rss_kb": rss,
+            "syscalls": syscalls,
+            "ok": ok,
+        }
+        if not ok:
+            self.fail(name, f"exit code {rc}")
+        return ok
+
+    def fail(self, name, msg):
+        self.failures.append(f"{name}: {msg}")
+        if name in self.results:
+            self.results[name]["ok"] = False
+
+    def check_same(self, name, a, b):
+        with open(a, "rb") as f1, open(b, "rb") as f2:
+            if f1.read() != f2.read():
+                self.fail(name, f"{op.basename(a)} and {op.basename(b)} differ")
+                return False
+        return True
+
+
+def write(path, data):
+    with open(path, "wb") as f:
+        f.write(data)
+
+
+def read(path):
+    with open(path, "rb") as f:
+        return f.read()
+
+
+def bench_compress(b, corpus, raw):
+    print_title("Compression")
+    src = op.join(corpus, "raw.cpio")
+    write(src, raw)
+    for fmt in FORMATS:
+        out = op.join(corpus, f"raw.{fmt}")
+        back = op.join(corpus, f"raw.{fmt}.out")
+        if b.run(f"compress/{fmt}", [f"compress={fmt}", src, out], corpus, len(raw)):
+            if b.run(f"decompress/{fmt}", ["decompress", out, back], corpus, len(raw)):
+                b.check_same(f"decompress/{fmt}", src, back)
+        print_result(b, f"compress/{fmt}")
+        print_result(b, f"decompress/{fmt}")
+
+
+def compress_with(b, corpus, fmt, data, name):
+    src = op.join(corpus, name)
+    write(src, data)
+    out = src + "." + fmt
+    subprocess.run([b.magiskboot, f"compress={fmt}", src, out], stderr=subprocess.DEVNULL, check=True)
+    return read(out)
+
+
+def bench_images(b, corpus, rng, raw):
+    print_title("Boot images")
+    # Do not let the raw kernel start with anything that looks like a known format
+    kernel = b"\0" * 64 + gen_data(rng, 8 * 1024 * 1024)
+    dtbs = gen_dtbs(4)
+    gz_kernel = compress_with(b, corpus, "gzip", kernel, "kernel")
+
+    images = []
+    for fmt in FORMATS:
+        ramdisk = compress_with(b, corpus, fmt, raw, "ramdisk")
+        blocks = {"kernel": gz_kernel, "ramdisk": ramdisk, "second": gen_data(rng, 4096)}
+        images.append((f"v0/{fmt}", gen_boot(0, blocks)))
+        if fmt == "gzip":
+            images.append((f"pxa/{fmt}", gen_boot(0, {**blocks, "extra": gen_data(rng, 8192)}, pxa=True)))
+            blocks["recovery_dtbo"] = dtbs
+            images.append((f"v1/{fmt}", gen_boot(1, blocks)))
+            images.append((f"v2/{fmt}", gen_boot(2, {**blocks, "dtb": dtbs})))
+        if fmt == "lz4_legacy":
+            # v4 boot images always use lz4_legacy ramdisks
+            images.append((f"v3/{fmt}", gen_boot(3, {"kernel": kernel, "ramdisk": ramdisk})))
+            images.append((f"v4/{fmt}", gen_boot(4, {"kernel": kernel, "ramdisk": ramdisk})))
+            images.append((f"vendor_v4/{fmt}", gen_vendor_boot(4, ramdisk, dtbs)))
+        images.append((f"vendor_v3/{fmt}", gen_vendor_boot(3, ramdisk, dtbs)))
+
+    for name, img in images:
+        work = op.join(corpus, "img", name.replace("/", "_"))
+        os.makedirs(work, exist_ok=True)
+        write(op.join(work, "boot.img"), img)
+
+        def clean():
+            subprocess.run([b.magiskboot, "cleanup"], cwd=work, stderr=subprocess.DEVNULL)
+
+        if b.run(f"unpack/{name}", ["unpack", "boot.img"], work, len(img), prepare=clean):
+            if b.run(f"repack/{name}", ["repack", "boot.img", "new-boot.img"], work, len(img)):
+                b.check_same(f"repack/{name}", op.join(work, "boot.img"), op.join(work, "new-boot.img"))
+        print_result(b, f"unpack/{name}")
+        print_result(b, f"repack/{name}")
+
+
+def bench_cpio(b, corpus, raw):
+    print_title("cpio")
+    work = op.join(corpus, "cpio")
+    os.makedirs(work, exist_ok=True)
+    orig = op.join(work, "orig.cpio")
+    write(orig, raw)
+
+    def reset(name):
+        return lambda: shutil.copyfile(orig, op.join(work, name))
+
+    # Loading and dumping an archive is canonical, so a second pass has to be identical
+    cmds = ["mkdir 0755 bench", "rm bench"]
+    if b.run("cpio/rewrite", ["cpio", "a.cpio", *cmds], work, len(raw), prepare=reset("a.cpio")):
+        shutil.copyfile(op.join(work, "a.cpio"), op.join(work, "b.cpio"))
+        subprocess.run([b.magiskboot, "cpio", "b.cpio", *cmds], cwd=work, stderr=subprocess.DEVNULL)
+        b.check_same("cpio/rewrite", op.join(work, "a.cpio"), op.join(work, "b.cpio"))
+    print_result(b, "cpio/rewrite")
+
+    b.run("cpio/dedup", ["cpio", "-d", "d.cpio", *cmds], work, len(raw), prepare=reset("d.cpio"))
+    print_result(b, "cpio/dedup")
+
+    b.run("cpio/xz", ["cpio", "-c", "xz", "x.cpio", *cmds], work, len(raw), prepare=reset("x.cpio"))
+    print_result(b, "cpio/xz")
+
+    # Back up the original against a patched ramdisk and restore it again
+    def patched():
+        reset("p.cpio")()
+        subprocess.run(
+            [b.magiskboot, "cpio", "p.cpio", "add 0750 init init.rc", "rm -r system"],
+            cwd=work, stderr=subprocess.DEVNULL,
+        )
+        shutil.copyfile(op.join(work, "a.cpio"), op.join(work, "canon.cpio"))
+
+    write(op.join(work, "init.rc"), b"on init\n")
+    if b.run("cpio/backup", ["cpio", "p.cpio", "backup canon.cpio"], work, len(raw), prepare=patched):
+        if b.run("cpio/restore", ["cpio", "p.cpio", "restore"], work, len(raw)):
+            b.check_same("cpio/restore", op.join(work, "a.cpio"), op.join(work, "p.cpio"))
+    print_result(b, "cpio/backup")
+    print_result(b, "cpio/restore")
+
+
+def bench_dtb(b, corpus, count):
+    print_title("dtb")
+    work = op.join(corpus, "dtb")
+    os.makedirs(work, exist_ok=True)
+    orig = op.join(work, "orig.dtb")
+    data = gen_dtbs(count)
+    write(orig, data)
+    size = len(data)
+
+    def reset():
+        shutil.copyfile(orig, op.join(work, "a.dtb"))
+
+    b.run("dtb/print", ["dtb", "orig.dtb", "print"], work, size)
+    b.run("dtb/test", ["dtb", "orig.dtb", "test"], work, size, expect_rc=(0, 1))
+    if b.run("dtb/patch", ["dtb", "a.dtb", "patch"], work, size, prepare=reset):
+        shutil.copyfile(op.join(work, "a.dtb"), op.join(work, "b.dtb"))
+        subprocess.run([b.magiskboot, "dtb", "b.dtb", "patch"], cwd=work, stderr=subprocess.DEVNULL)
+        b.check_same("dtb/patch", op.join(work, "a.dtb"), op.join(work, "b.dtb"))
+
+    # Setting a property and back to its value has to be canonical
+    args = ["/chosen", "bootargs"]
+    old = "console=ttyS0 skip_initramfs"
+
+    def edit(name):
+        for value in ["console=ttyS1 quiet", old]:
+            subprocess.run(
+                [b.magiskboot, "dtb", name, "set", *args, value], cwd=work, stderr=subprocess.DEVNULL
+            )
+
+    if b.run("dtb/set", ["dtb", "a.dtb", "set", *args, "console=ttyS1 quiet"], work, size, prepare=reset):
+        reset()
+        edit("a.dtb")
+        shutil.copyfile(op.join(work, "a.dtb"), op.join(work, "b.dtb"))
+        edit("b.dtb")
+        b.check_same("dtb/set", op.join(work, "a.dtb"), op.join(work, "b.dtb"))
+    for name in ["dtb/print", "dtb/test", "dtb/patch", "dtb/set"]:
+        print_result(b, name)
+
+
+def bench_extract(b, corpus, rng, size):
+    print_title("extract")
+    work = op.join(corpus, "payload")
+    os.makedirs(work, exist_ok=True)
+    parts = [
+        ("boot", gen_data(rng, size)),
+        ("init_boot", gen_data(rng, size // 4)),
+        ("vendor_boot", gen_data(rng, size // 2)),
+    ]
+    payload = gen_payload(parts)
+    write(op.join(work, "payload.bin"), payload)
+    for name, img in parts:
+        write(op.join(work, f"{name}.orig"), img)
+
+    if b.run("extract/single", ["extract", "payload.bin", "boot", "boot.img"], work, size):
+        b.check_same("extract/single", op.join(work, "boot.orig"), op.join(work, "boot.img"))
+    total = sum(len(img) for _, img in parts)
+    if b.run("extract/all", ["extract", "payload.bin", "all", "out"], work, total):
+        for name, _ in parts:
+            b.check_same("extract/all", op.join(work, f"{name}.orig"), op.join(work, "out", f"{name}.img"))
+    print_result(b, "extract/single")
+    print_result(b, "extract/all")
+
+
+def print_result(b, name):
+    r = b.results.get(name)
+    if r is None:
+        return
+    syscalls = "-" if r["syscalls"] is None else str(r["syscalls"])
+    line = (
+        f"{name:<28} {r['seconds']:>9.3f}s {r['mbps']:>9.2f} MB/s "
+        f"{r['max_rss_kb'] / 1024:>8.1f} MB {syscalls:>8} syscalls"
+    )
+    if r["ok"]:
+        print(line)
+    else:
+        print_error(f"{line}  FAIL")
+
+
+def compare(b, baseline, threshold):
+    print_title(f"Compare with baseline (threshold {threshold}%)")
+    regressions = 0
+    for name, r in b.results.items():
+        old = baseline.get(name)
+        if old is None:
+            continue
+        for key in ["seconds", "max_rss_kb", "syscalls"]:
+            if not old.get(key) or r[key] is None:
+                continue
+            delta = (r[key] - old[key]) * 100 / old[key]
+            if delta > threshold:
+                regressions += 1
+                print_error(f"{name:<28} {key:<10} {old[key]} -> {r[key]} (+{delta:.1f}%)")
+    if regressions == 0:
+        print("No regressions")
+    return regressions
+
+
+def main():
+    parser = argparse.ArgumentParser(description="magiskboot benchmark and golden corpus")
+    parser.add_argument("magiskboot", nargs="?", help="path to a host runnable magiskboot")
+    parser.add_argument("-d", "--corpus", help="directory to keep the generated corpus")
+    parser.add_argument("-s", "--size", type=int, default=16, help="ramdisk/partition size in MB")
+    parser.add_argument("-n", "--iterations", type=int, default=3, help="runs per action, best time is reported")
+    parser.add_argument("--dtbs", type=int, default=256, help="number of DTBs in the container")
+    parser.add_argument("--seed", type=int, default=1, help="seed of the generated corpus")
+    parser.add_argument("--syscalls", action="store_true", help="count syscalls with strace")
+    parser.add_argument("--only", action="append", help="only run the given groups")
+    parser.add_argument("--save", help="save results to a JSON file")
+    parser.add_argument("--compare", help="compare with results in a JSON file")
+    parser.add_argument("--threshold", type=float, default=10, help="regression threshold in percent")
+    args = parser.parse_args()
+
+    script_dir = op.dirname(op.abspath(__file__))
+    magiskboot = args.magiskboot or op.join(script_dir, "..", "native", "out", "x86_64", "magiskboot")
+    magiskboot = op.abspath(magiskboot)
+    if not os.access(magiskboot, os.X_OK):
+        print_error(f"! {magiskboot} is not executable")
+        sys.exit(1)
+
+    corpus = args.corpus or tempfile.mkdtemp(prefix="magiskboot_bench.")
+    os.makedirs(corpus, exist_ok=True)
+    corpus = op.abspath(corpus)
+
+    b = Bench(args, magiskboot)
+    rng = random.Random(args.seed)
+    raw = gen_cpio(rng, args.size * 1024 * 1024)
+    groups = args.only or ["compress", "images", "cpio", "dtb", "extract"]
+
+    try:
+        if "compress" in groups:
+            bench_compress(b, corpus, raw)
+        if "images" in groups:
+            bench_images(b, corpus, rng, raw)
+        if "cpio" in groups:
+            bench_cpio(b, corpus, raw)
+        if "dtb" in groups:
+            bench_dtb(b, corpus, args.dtbs)
+        if "extract" in groups:
+            bench_extract(b, corpus, rng, args.size * 1024 * 1024)
+    finally:
+        if not args.corpus:
+            shutil.rmtree(corpus, ignore_errors=True)
+
+    if args.save:
+        with open(args.save, "w") as f:
+            json.dump(b.results, f, indent=2, sort_keys=True)
+
+    regressions = 0
+    if args.compare:
+        with open(args.compare) as f:
+            regressions = compare(b, json.load(f), args.threshold)
+
+    if b.failures:
+        print_title("Round trip failures")
+        for f in b.failures:
+            print_error(f)
+
+    sys.exit(1 if b.failures or regressions else 0)
+
+
+if __name__ == "__main__":
+    main()